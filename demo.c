@@ -1,5 +1,7 @@
 #define SPZ_IMPLEMENTATION
 #include "supozi.h"
+#include <unistd.h>
+#include <sys/wait.h>
 
 // Define the test functions
 TEST(void, test_addition) {
@@ -23,10 +25,603 @@ TEST(bool, test_foo) {
     return false;
 }
 
+// Regression tests, run in their own suites
+
+// The runner must only reap its own children, also with --in-process
+TEST(bool, test_own_child) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(7);
+    }
+    int status = 0;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 7;
+}
+
+// A zero-initialized registry accepts suites and tests
+TEST(bool, test_zero_registry) {
+    TestRegistry tr = {0};
+    register_test_suite_toreg(&tr, "first");
+    REGISTER_TEST_TOREG(&tr, test_addition);
+    register_test_suite_toreg(&tr, "second");
+    REGISTER_TEST_TOREG(&tr, test_subtraction);
+    int suite_idx = -1;
+    int test_idx = -1;
+    bool ok = tr.suites_count == 1 && lookup_testregistry(&tr, "second::test_subtraction", &suite_idx, &test_idx) && suite_idx == 1 && test_idx == 0;
+    free_testregistry(&tr);
+    return ok;
+}
+
+// Indexed lookups find the same suites and tests as scanning the registry
+TEST(bool, test_lookup) {
+    static char names[64][16];
+    TestRegistry tr = {0};
+    for (int i = 0; i < 64; i++) {
+        snprintf(names[i], sizeof(names[i]), "suite%i", i);
+        register_test_suite_toreg(&tr, names[i]);
+        REGISTER_TEST_TOREG(&tr, test_addition);
+        REGISTER_TEST_TOREG(&tr, test_subtraction);
+    }
+    const char* lookups[] = {
+        "suite42::test_subtraction", "suite7", "suite63::test_addition", "suite1::test_subtraction",
+        "suite64", "suite4::", "suite4::test_foo", "::test_addition", "suite4::test_addition::x", "suite", "",
+    };
+    int expected[][2] = { {42, 1}, {7, -1}, {63, 0}, {1, 1}, {-1}, {-1}, {-1}, {-1}, {-1}, {-1}, {-1}, };
+    bool ok = true;
+    for (int pass = 0; pass < 2; pass++) {
+        /* Scan first, then use the index */
+        if (pass == 1) index_testregistry(&tr);
+        for (size_t i = 0; i < sizeof(lookups) / sizeof(lookups[0]); i++) {
+            int suite_idx = -1;
+            int test_idx = -1;
+            bool found = lookup_testregistry(&tr, lookups[i], &suite_idx, &test_idx);
+            if (found != (expected[i][0] != -1) || (found && (suite_idx != expected[i][0] || test_idx != expected[i][1]))) {
+                printf("lookup of {%s} failed, pass %i\n", lookups[i], pass);
+                ok = false;
+            }
+        }
+    }
+    /* Registering drops the index, so later suites are found too */
+    register_test_suite_toreg(&tr, "late");
+    int suite_idx = -1;
+    int test_idx = -1;
+    ok = ok && lookup_testregistry(&tr, "late", &suite_idx, &test_idx) && suite_idx == 64;
+    free_testregistry(&tr);
+    return ok;
+}
+
+// Filters matching nothing are an error, not an empty run
+TEST(bool, test_glob_no_match) {
+    const char* none[] = { "nosuch*", };
+    const char* excluded[] = { "!*", };
+    const char* some[] = { "regis*", "!*::nosuch", };
+    bool selected[64] = {0};
+    return spz_filter_select(&SPZ_TEST_REGISTRY__, none, 1, selected) == -1
+        && spz_filter_select(&SPZ_TEST_REGISTRY__, excluded, 1, selected) == -1
+        && spz_filter_select(&SPZ_TEST_REGISTRY__, some, 2, selected) == 0;
+}
+
+// Ints shrink to the value closest to 0, whichever side they started on
+static int64_t SHRUNK_A = 0;
+static int64_t SHRUNK_B = 0;
+
+static bool sum_below_100(SpzProp* prop) {
+    SHRUNK_A = spz_gen_int(prop, -1000, 1000);
+    SHRUNK_B = spz_gen_int(prop, -1000, 1000);
+    return SHRUNK_A + SHRUNK_B < 100;
+}
+
+TEST(bool, test_shrink_int) {
+    return check_property("sum_below_100", &sum_below_100, 100) == 1 && SHRUNK_A == 0 && SHRUNK_B == 100;
+}
+
+#ifndef SPZ_NOTIMER
+// Mann-Whitney z scores, against values computed by hand
+TEST(bool, test_mann_whitney) {
+    const double low[] = { 5, 1, 4, 2, 3, };
+    const double high[] = { 9, 6, 10, 8, 7, };
+    const double tied[] = { 3, 3, 3, 3, 3, };
+    double z_slower = spz_mann_whitney_z(low, 5, high, 5);
+    double z_faster = spz_mann_whitney_z(high, 5, low, 5);
+    double z_tied = spz_mann_whitney_z(tied, 5, tied, 5);
+    return z_slower > 2.50 && z_slower < 2.51 && z_faster < -2.50 && z_faster > -2.51 && z_tied == 0;
+}
+
+#define TIMER_TEST_LIST \
+    REGISTER_SUITE("stats"); \
+    REGISTER_TEST(test_mann_whitney);
+#else
+#define TIMER_TEST_LIST
+#endif // SPZ_NOTIMER
+
+#ifndef SPZ_NOPIPE
+// Captures are only mapped on demand
+TEST(bool, test_lazy_map) {
+    TestResult r = run_test_piped((Test) { .type = TEST_BOOL, .func.bool_fn = &test_foo, .name = "test_foo", });
+    bool ok = !r.stdout_buf && r.exit_code == 1;
+    testresult_map(&r);
+    ok = ok && r.stdout_len == 4 && !memcmp(r.stdout_buf, "FOO\n", 4) && !r.stderr_buf;
+    testresult_close(&r);
+    return ok;
+}
+
+// Record diffs, as printed on mismatch
+typedef struct DiffCase {
+    const char* expected;
+    const char* found;
+    const char* diff;
+} DiffCase;
+
+static const DiffCase DIFF_CASES[] = {
+    { "a\nb\nc\n", "a\nB\nc\n", "First difference at byte offset {2}, line {2}, column {1}\n--- expected\n+++ found\n@@ -1,3 +1,3 @@\n a\n-b\n+B\n c\n", },
+    /* The common tail must start a line in both buffers */
+    { "a\nb\n", "ab\n", "First difference at byte offset {1}, line {1}, column {2}\n--- expected\n+++ found\n@@ -1,2 +1,1 @@\n-a\n-b\n+ab\n", },
+    { "x\n", "x\ny\n", "First difference at byte offset {2}, line {2}, column {1}\n--- expected\n+++ found\n@@ -1,1 +1,2 @@\n x\n+y\n", },
+    { "", "x\n", "First difference at byte offset {0}, line {1}, column {1}\n--- expected\n+++ found\n@@ -0,0 +1,1 @@\n+x\n", },
+    { "a\nb", "a\nb\n", "First difference at byte offset {3}, line {2}, column {2}\n--- expected\n+++ found\n@@ -1,2 +1,2 @@\n a\n-b\n\\ No newline at end of file\n+b\n", },
+    { "same\n", "same\n", "", },
+};
+
+TEST_PARAM(test_diff) {
+    (void) idx;
+    const DiffCase* c = param;
+    FILE* out = tmpfile();
+    if (!out) return false;
+    spz_print_diff(c->expected, strlen(c->expected), c->found, strlen(c->found), out);
+    char buf[512] = {0};
+    rewind(out);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, out);
+    fclose(out);
+    if (len != strlen(c->diff) || memcmp(buf, c->diff, len)) {
+        printf("got:\n%s", buf);
+        return false;
+    }
+    return true;
+}
+
+// Reports stay valid UTF-8, escaping everything past ASCII
+TEST(bool, test_report_escape) {
+    /* e-acute, an emoji, a lone continuation byte and a truncated sequence */
+    const char in[] = "\xc3\xa9\xf0\x9f\x98\x80\x80<\xe2\x82";
+    const char* json = "\"\\u00e9\\ud83d\\ude00\\ufffd<\\ufffd\\ufffd\"";
+    const char* xml = "&#xe9;&#x1f600;&#xfffd;&lt;&#xfffd;&#xfffd;";
+    char buf[128] = {0};
+    FILE* out = tmpfile();
+    if (!out) return false;
+    spz_write_json(out, in, sizeof(in) - 1);
+    fputc('|', out);
+    spz_write_xml(out, in, sizeof(in) - 1);
+    rewind(out);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, out);
+    fclose(out);
+    char expected[128] = {0};
+    snprintf(expected, sizeof(expected), "%s|%s", json, xml);
+    if (len != strlen(expected) || memcmp(buf, expected, len)) {
+        printf("got:\n%s\n", buf);
+        return false;
+    }
+    return true;
+}
+
+// Cache keys follow the options tests run with, and only hit for the same binary
+TEST(bool, test_cache_key) {
+    SpzCache cache = { .binary = 1, };
+    TestSuite suite = { .name = "cache", };
+    Test t = { .type = TEST_BOOL, .func.bool_fn = &test_foo, .name = "no_such_test", };
+    TestRunOptions saved = SPZ_RUN_OPTIONS__;
+    uint64_t key = spz_cache_key(&cache, &suite, &t, NULL, NULL);
+    bool ok = (key == spz_cache_key(&cache, &suite, &t, NULL, NULL));
+    SPZ_RUN_OPTIONS__.timeout_ms++;
+    ok = ok && key != spz_cache_key(&cache, &suite, &t, NULL, NULL);
+    SPZ_RUN_OPTIONS__ = saved;
+    SPZ_RUN_OPTIONS__.in_process = !saved.in_process;
+    ok = ok && key != spz_cache_key(&cache, &suite, &t, NULL, NULL);
+    SPZ_RUN_OPTIONS__ = saved;
+    SPZ_RUN_OPTIONS__.seed_set = !saved.seed_set;
+    ok = ok && key != spz_cache_key(&cache, &suite, &t, NULL, NULL);
+    SPZ_RUN_OPTIONS__ = saved;
+    /* Only passed seeds change the key */
+    SPZ_RUN_OPTIONS__.seed = saved.seed + 1;
+    ok = ok && saved.seed_set == (key != spz_cache_key(&cache, &suite, &t, NULL, NULL));
+    SPZ_RUN_OPTIONS__ = saved;
+    FILE* fp = tmpfile();
+    if (!fp) return false;
+    fprintf(fp, "supozi-cache 2 %016llx\n%016llx cache::no_such_test\n", 1ULL, (unsigned long long) key);
+    rewind(fp);
+    cache.count = spz_cache_read(fp, 1, &cache.entries);
+    ok = ok && cache.count == 1 && spz_cache_has(&cache, key) && !spz_cache_has(&cache, key + 1);
+    spz_cache_free_entries(cache.entries, cache.count);
+    rewind(fp);
+    SpzCacheEntry* entries = NULL;
+    ok = ok && spz_cache_read(fp, 2, &entries) == 0;
+    fclose(fp);
+    return ok;
+}
+
+// Fills a buffer with bytes cycling through all values, NULs included
+static unsigned char* stream_data(size_t len) {
+    unsigned char* data = malloc(len);
+    for (size_t i = 0; data && i < len; i++) {
+        data[i] = (unsigned char) (i * 7);
+    }
+    return data;
+}
+
+// Streams copy binary data past the buffer size, from the current offset
+TEST(bool, test_stream_copy) {
+    size_t len = 3 * SPZ_STREAM_BUFSIZE + 17;
+    unsigned char* data = stream_data(len);
+    unsigned char* copy = malloc(len);
+    FILE* src = tmpfile();
+    FILE* file = tmpfile();
+    char* mem_buf = NULL;
+    size_t mem_len = 0;
+    FILE* mem = open_memstream(&mem_buf, &mem_len);
+    bool ok = data && copy && src && file && mem && fwrite(data, 1, len, src) == len && fflush(src) == 0;
+    if (ok) {
+        /* A regular file can take sendfile() */
+        lseek(fileno(src), 5, SEEK_SET);
+        spz_print_stream_to_file(fileno(src), file);
+        rewind(file);
+        ok = fread(copy, 1, len, file) == len - 5 && !memcmp(copy, data + 5, len - 5);
+        /* A memory stream has no file descriptor, so it goes through the buffer */
+        lseek(fileno(src), 5, SEEK_SET);
+        spz_print_stream_to_file(fileno(src), mem);
+        fflush(mem);
+        ok = ok && mem_len == len - 5 && !memcmp(mem_buf, data + 5, len - 5);
+    }
+    if (mem) fclose(mem);
+    if (file) fclose(file);
+    if (src) fclose(src);
+    free(mem_buf);
+    free(copy);
+    free(data);
+    return ok;
+}
+
+// Comparisons are binary-safe, from the current offset, for files and for pipes filling up slowly
+TEST(bool, test_stream_compare) {
+    size_t len = SPZ_STREAM_BUFSIZE + 4099;
+    unsigned char* data = stream_data(len);
+    char path[] = "/tmp/supozi-compare-XXXXXX";
+    int fd = mkstemp(path);
+    FILE* src = tmpfile();
+    bool ok = data && fd != -1 && src && write(fd, data, len) == (ssize_t) len && fwrite(data, 1, len, src) == len && fflush(src) == 0;
+    if (ok) {
+        int source = fileno(src);
+        lseek(source, 0, SEEK_SET);
+        ok = spz_compare_stream_to_file(source, path) == 1 && lseek(source, 0, SEEK_CUR) == 0;
+        lseek(source, 1, SEEK_SET);
+        ok = ok && spz_compare_stream_to_file(source, path) == 0 && lseek(source, 0, SEEK_CUR) == 1;
+        /* Same size, last byte changed */
+        fseek(src, len - 1, SEEK_SET);
+        fputc(data[len - 1] ^ 1, src);
+        fflush(src);
+        lseek(source, 0, SEEK_SET);
+        ok = ok && spz_compare_stream_to_file(source, path) == 0;
+        ok = ok && spz_compare_stream_to_file(source, "/nonexistent/record") == -1;
+    }
+    int fds[2] = {-1, -1};
+    if (ok && pipe(fds) == 0) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            for (size_t off = 0; off < len; off += 4096) {
+                size_t chunk = (len - off < 4096 ? len - off : 4096);
+                if (write(fds[1], data + off, chunk) != (ssize_t) chunk) _exit(1);
+                usleep(1000);
+            }
+            _exit(0);
+        }
+        close(fds[1]);
+        ok = pid > 0 && spz_compare_stream_to_file(fds[0], path) == 1;
+        close(fds[0]);
+        if (pid > 0) waitpid(pid, NULL, 0);
+    }
+    if (src) fclose(src);
+    if (fd != -1) {
+        close(fd);
+        unlink(path);
+    }
+    free(data);
+    return ok;
+}
+
+// Hardware counters are collected where permitted, and tests run the same without them
+TEST(bool, test_perf_fallback) {
+    TestRunOptions saved = SPZ_RUN_OPTIONS__;
+    SPZ_RUN_OPTIONS__.perf = true;
+    TestResult r = run_test_piped((Test) { .type = TEST_VOID, .func.void_fn = &test_addition, .name = "test_addition", });
+    /* Counters which can't be opened turn the option off */
+    bool available = SPZ_RUN_OPTIONS__.perf;
+    bool ok = r.exit_code == 0 && r.counters.valid < (1u << SPZ_COUNTERS_COUNT) && (available || r.counters.valid == 0);
+    if (r.counters.valid & (1u << SPZ_COUNTER_INSTRUCTIONS)) {
+        ok = ok && r.counters.values[SPZ_COUNTER_INSTRUCTIONS] > 0;
+    }
+    printf("counters %s, valid mask {%x}\n", (available ? "available" : "unavailable"), r.counters.valid);
+    testresult_close(&r);
+    SPZ_RUN_OPTIONS__ = saved;
+    return ok;
+}
+
+// Runs a registry, one of its suites or the tests matching a filter, from a test, apart from the options, reporters and fork server of the outer run
+static int run_nested(const TestRegistry* tr, const TestSuite* suite, const char* filter, TestRunOptions opts) {
+    TestRunOptions saved = SPZ_RUN_OPTIONS__;
+    int reporters = SPZ_REPORTERS_COUNT__;
+    SpzForkServer server = SPZ_FORK_SERVER__;
+    opts.capture = saved.capture;
+    SPZ_RUN_OPTIONS__ = opts;
+    SPZ_REPORTERS_COUNT__ = 0;
+    SPZ_FORK_SERVER__ = (SpzForkServer) { .fd = -1, };
+    int res = -1;
+    if (!opts.fork_server || spz_fork_server_start()) {
+        if (suite) {
+            res = run_suite_ptr(suite, 1);
+        } else if (filter) {
+            res = run_testregistry_filter(tr, &filter, 1, 1);
+        } else {
+            res = run_testregistry_ptr(tr, 1);
+        }
+        spz_fork_server_stop();
+    }
+    SPZ_RUN_OPTIONS__ = saved;
+    SPZ_REPORTERS_COUNT__ = reporters;
+    SPZ_FORK_SERVER__ = server;
+    return res;
+}
+
+// Flags shared with the children of nested runs
+static volatile int* SHARED_FLAGS = NULL;
+
+TEST(bool, slow_first) {
+    usleep(300 * 1000);
+    SHARED_FLAGS[0] = 1;
+    return true;
+}
+
+TEST(bool, fast_second) {
+    SHARED_FLAGS[1] = SHARED_FLAGS[0] + 1;
+    return true;
+}
+
+// A slow suite doesn't hold back the next one when running jobs at once
+TEST(bool, test_cross_suite) {
+    int* flags = mmap(NULL, 2 * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flags == MAP_FAILED) return false;
+    SHARED_FLAGS = flags;
+    TestRegistry tr = {0};
+    register_test_suite_toreg(&tr, "slow");
+    REGISTER_TEST_TOREG(&tr, slow_first);
+    register_test_suite_toreg(&tr, "fast");
+    REGISTER_TEST_TOREG(&tr, fast_second);
+    int res = run_nested(&tr, NULL, NULL, (TestRunOptions) { .jobs = 2, });
+    /* fast_second started while slow_first was still sleeping */
+    bool ok = res == 0 && flags[0] == 1 && flags[1] == 1;
+    free_testregistry(&tr);
+    munmap(flags, 2 * sizeof(int));
+    return ok;
+}
+
+// Set by the fixture of the nested fork server suite
+static int SERVER_FIXTURE = 0;
+
+static bool server_setup(void) {
+    SERVER_FIXTURE = 42;
+    return true;
+}
+
+TEST(bool, forked_from_server) {
+    SHARED_FLAGS[0] = (int) getppid();
+    return SERVER_FIXTURE == 42;
+}
+
+// Tests fork from the fork server, and see the fixture it set up
+TEST(bool, test_fork_server) {
+    int* flags = mmap(NULL, 2 * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flags == MAP_FAILED) return false;
+    SHARED_FLAGS = flags;
+    TestRegistry tr = {0};
+    register_test_suite_toreg(&tr, "server");
+    REGISTER_SUITE_FIXTURE_TOREG(&tr, server_setup, NULL);
+    REGISTER_TEST_TOREG(&tr, forked_from_server);
+    int res = run_nested(&tr, NULL, NULL, (TestRunOptions) { .jobs = 1, .fork_server = true, });
+    /* The test was not forked from this process, which never set up the fixture */
+    bool ok = res == 0 && flags[0] > 1 && flags[0] != (int) getpid() && SERVER_FIXTURE == 0;
+    free_testregistry(&tr);
+    munmap(flags, 2 * sizeof(int));
+    return ok;
+}
+
+// Stopping the fork server doesn't wait for other processes holding its socket to exit
+TEST(bool, test_fork_server_stop) {
+    SpzForkServer saved = SPZ_FORK_SERVER__;
+    SPZ_FORK_SERVER__ = (SpzForkServer) { .fd = -1, };
+    if (!spz_fork_server_start()) {
+        SPZ_FORK_SERVER__ = saved;
+        return false;
+    }
+    bool ok = (fcntl(SPZ_FORK_SERVER__.fd, F_GETFD) & FD_CLOEXEC) != 0;
+    pid_t pid = fork();
+    if (pid == 0) {
+        sleep(2);
+        _exit(0);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    spz_fork_server_stop();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    ok = ok && pid > 0 && elapsed_ms < 1000;
+    if (pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    SPZ_FORK_SERVER__ = saved;
+    return ok;
+}
+
+// Set by the tests of the nested in-process suite, which run in the runner
+static pid_t IN_PROCESS_PID = 0;
+
+TEST(bool, aborting) {
+    abort();
+    return true;
+}
+
+TEST(bool, segfaulting) {
+    raise(SIGSEGV);
+    return true;
+}
+
+TEST(bool, after_crashes) {
+    IN_PROCESS_PID = getpid();
+    printf("captured\n");
+    return true;
+}
+
+// Crashes of tests run in-process fail them, and the run goes on
+TEST(bool, test_in_process_crash) {
+    TestRegistry tr = {0};
+    register_test_suite_toreg(&tr, "in_process");
+    REGISTER_TEST_TOREG(&tr, aborting);
+    REGISTER_TEST_TOREG(&tr, segfaulting);
+    REGISTER_TEST_TOREG(&tr, after_crashes);
+    IN_PROCESS_PID = 0;
+    int res = run_nested(&tr, NULL, NULL, (TestRunOptions) { .jobs = 1, .in_process = true, });
+    bool ok = res == 2 && IN_PROCESS_PID == getpid();
+    free_testregistry(&tr);
+    return ok;
+}
+
+// Registries and suites run in place, through pointers
+TEST(bool, test_run_ptr) {
+    TestRegistry tr = {0};
+    register_test_suite_toreg(&tr, "passing");
+    REGISTER_TEST_TOREG(&tr, test_addition);
+    REGISTER_TEST_TOREG(&tr, test_subtraction);
+    register_test_suite_toreg(&tr, "failing");
+    REGISTER_TEST_TOREG(&tr, test_foo);
+    const Test* tests = tr.suites[0].tests;
+    TestRunOptions opts = { .jobs = 1, };
+    bool ok = run_nested(&tr, NULL, NULL, opts) == 1
+        && run_nested(&tr, &tr.suites[0], NULL, opts) == 0
+        && run_nested(&tr, &tr.suites[1], NULL, opts) == 1;
+    ok = ok && tr.suites_count == 1 && tr.suites[0].tests == tests && tr.suites[0].test_count == 2 && tr.suites[1].test_count == 1;
+    free_testregistry(&tr);
+    return ok;
+}
+
+// Slots counting the runs of each test of the nested sharded registry
+static const int SHARD_SLOTS_FIRST[] = { 0, 1, 2, 3, 4, 5, 6, };
+static const int SHARD_SLOTS_SECOND[] = { 7, 8, 9, 10, 11, };
+#define SHARD_SLOTS_COUNT 12
+#define SHARD_COUNT 3
+
+TEST_PARAM(counted) {
+    (void) idx;
+    SHARED_FLAGS[*(const int*) param]++;
+    return true;
+}
+
+// Shards of all tests, or of a single suite, run each selected test exactly once, by hash and by durations
+TEST(bool, test_shards) {
+    int* flags = mmap(NULL, SHARD_SLOTS_COUNT * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flags == MAP_FAILED) return false;
+    SHARED_FLAGS = flags;
+    char path[] = "/tmp/supozi-durations-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        munmap(flags, SHARD_SLOTS_COUNT * sizeof(int));
+        return false;
+    }
+    /* One test longer than all others together, so it gets a shard of its own */
+    for (int i = 0; i < SHARD_SLOTS_COUNT; i++) {
+        int first = (int) (sizeof(SHARD_SLOTS_FIRST) / sizeof(SHARD_SLOTS_FIRST[0]));
+        dprintf(fd, "%s::counted/%d %.1f\n", (i < first ? "first" : "second"), (i < first ? i : i - first), (i == first + 2 ? 100.0 : 1.0));
+    }
+    close(fd);
+    TestRegistry tr = {0};
+    register_test_suite_toreg(&tr, "first");
+    REGISTER_PARAM_TEST_TOREG(&tr, counted, SHARD_SLOTS_FIRST);
+    register_test_suite_toreg(&tr, "second");
+    REGISTER_PARAM_TEST_TOREG(&tr, counted, SHARD_SLOTS_SECOND);
+    expand_testregistry(&tr);
+    bool ok = true;
+    for (int by_durations = 0; by_durations < 2; by_durations++) {
+        for (int single_suite = 0; single_suite < 2; single_suite++) {
+            memset(flags, 0, SHARD_SLOTS_COUNT * sizeof(int));
+            int ran[SHARD_COUNT] = {0};
+            for (int s = 0; s < SHARD_COUNT; s++) {
+                TestRunOptions opts = { .jobs = 1, .shard_count = SHARD_COUNT, .shard_index = s, .shard_durations = (by_durations ? path : NULL), };
+                int before = 0;
+                for (int i = 0; i < SHARD_SLOTS_COUNT; i++) before += flags[i];
+                if (run_nested(&tr, NULL, (single_suite ? "second" : "*"), opts) != 0) ok = false;
+                for (int i = 0; i < SHARD_SLOTS_COUNT; i++) ran[s] += flags[i];
+                ran[s] -= before;
+            }
+            /* Disjoint shards covering the selection run each test once */
+            for (int i = 0; i < SHARD_SLOTS_COUNT; i++) {
+                int expected = (!single_suite || i >= SHARD_SLOTS_SECOND[0]);
+                if (flags[i] != expected) {
+                    printf("slot {%d} ran {%d} times, by %s, %s\n", i, flags[i], (by_durations ? "durations" : "hash"), (single_suite ? "single suite" : "all suites"));
+                    ok = false;
+                }
+            }
+            if (by_durations && ran[0] != 1) {
+                printf("shard {0} ran {%d} tests instead of the longest one\n", ran[0]);
+                ok = false;
+            }
+        }
+    }
+    free_testregistry(&tr);
+    unlink(path);
+    munmap(flags, SHARD_SLOTS_COUNT * sizeof(int));
+    return ok;
+}
+
+#define PIPED_TEST_LIST \
+    REGISTER_SUITE("scheduler"); \
+    REGISTER_UNSAFE_TEST(test_cross_suite); \
+    REGISTER_SUITE("fork_server"); \
+    REGISTER_UNSAFE_TEST(test_fork_server); \
+    REGISTER_UNSAFE_TEST(test_fork_server_stop); \
+    REGISTER_SUITE("in_process"); \
+    REGISTER_UNSAFE_TEST(test_in_process_crash); \
+    REGISTER_SUITE("run"); \
+    REGISTER_UNSAFE_TEST(test_run_ptr); \
+    REGISTER_SUITE("shard"); \
+    REGISTER_UNSAFE_TEST(test_shards); \
+    REGISTER_SUITE("perf"); \
+    REGISTER_TEST(test_perf_fallback); \
+    REGISTER_SUITE("stream"); \
+    REGISTER_TEST(test_stream_copy); \
+    REGISTER_TEST(test_stream_compare); \
+    REGISTER_SUITE("cache"); \
+    REGISTER_TEST(test_cache_key); \
+    REGISTER_SUITE("report"); \
+    REGISTER_TEST(test_report_escape); \
+    REGISTER_SUITE("capture"); \
+    REGISTER_TEST(test_lazy_map); \
+    REGISTER_SUITE("diff"); \
+    REGISTER_PARAM_TEST(test_diff, DIFF_CASES);
+#else
+#define PIPED_TEST_LIST
+#endif // SPZ_NOPIPE
+
 // Use a macro to automatically register all tests and define main()
 #define TEST_LIST \
     REGISTER_TEST(test_addition); \
     REGISTER_TEST(test_subtraction); \
-    REGISTER_TEST(test_foo);
+    REGISTER_TEST(test_foo); \
+    REGISTER_SUITE("jobs"); \
+    REGISTER_TEST(test_own_child); \
+    REGISTER_SUITE("registry"); \
+    REGISTER_TEST(test_zero_registry); \
+    REGISTER_TEST(test_lookup); \
+    REGISTER_SUITE("filter"); \
+    REGISTER_TEST(test_glob_no_match); \
+    REGISTER_SUITE("property"); \
+    REGISTER_TEST(test_shrink_int); \
+    TIMER_TEST_LIST \
+    PIPED_TEST_LIST
 
 REGISTER_ALL_TESTS();  // This will automatically define the main function and register the tests
@@ -20,12 +20,34 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #ifndef SPZ_NOPIPE
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#ifndef SPZ_NOPERF
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#define SPZ_HAS_PERF
+#endif // SPZ_NOPERF
+#endif // __linux__
 #endif // SPZ_NOPIPE
 
 #define SPZ_MAJOR 0 /**< Represents current major release.*/
@@ -42,6 +64,7 @@ static const int SPZ_API_VERSION_INT =
 typedef void (*test_void_fn)(void); /**< Used to select a test function returning void.*/
 typedef int (*test_int_fn)(void); /**< Used to select a test function returning int.*/
 typedef bool (*test_bool_fn)(void); /**< Used to select a test function returning bool.*/
+typedef bool (*test_param_fn)(const void* param, size_t idx); /**< Used to select a parameterized test function.*/
 
 /**
  * Macro to declare a test function.
@@ -52,6 +75,123 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
     static retType name(void); \
     static retType name(void)
 
+/**
+ * Macro to declare a parameterized test function.
+ * The body gets a pointer to its case in the table as param, NULL for
+ *  tests registered with REGISTER_INDEX_TEST, and the index of the case as
+ *  idx. It returns false when the case fails.
+ * @see REGISTER_PARAM_TEST
+ * @see REGISTER_INDEX_TEST
+ * @param name The name for the test.
+ */
+#define TEST_PARAM(name) \
+    static bool name(const void* param, size_t idx); \
+    static bool name(const void* param, size_t idx)
+
+typedef struct SpzProp SpzProp; /**< Holds the state of a property check, passed to the spz_gen_X() generators.*/
+typedef bool (*prop_fn)(SpzProp* prop); /**< Used to select a property function.*/
+
+/**
+ * Macro to declare a property, checked against random inputs drawn with the
+ *  spz_gen_X() generators, and a test of the same name checking it, to
+ *  register with REGISTER_TEST.
+ * The body gets the SpzProp to pass to the generators as prop, and returns
+ *  false when the property does not hold.
+ * @see PROPERTY_ITERS
+ * @see check_property
+ * @param name The name for the property.
+ */
+#define PROPERTY(name) PROPERTY_ITERS(name, 0)
+
+/**
+ * Macro to declare a property checked against a fixed number of inputs.
+ * @see PROPERTY
+ * @param name The name for the property.
+ * @param iters The number of inputs, 0 to use the one from TestRunOptions.
+ */
+#define PROPERTY_ITERS(name, iters) \
+    static bool name##_prop__(SpzProp* prop); \
+    TEST(int, name) { return check_property(#name, &name##_prop__, iters); } \
+    static bool name##_prop__(SpzProp* prop)
+
+typedef bool (*fuzz_fn)(const uint8_t* data, size_t size); /**< Used to select a fuzz target.*/
+
+/**
+ * Macro to declare a fuzz target, to register with REGISTER_TEST.
+ * The body gets an input as data and size, and returns false when it finds
+ *  it wrong. Crashes, sanitizer reports and timeouts are failures too.
+ * Run as a test, the target checks the empty input and each file of its
+ *  corpus directory. The fuzz subcommand grows the corpus with inputs
+ *  reaching new code.
+ * @see fuzz_testregistry
+ * @param name The name for the fuzz target.
+ */
+#define FUZZ(name) \
+    static bool name(const uint8_t* data, size_t size); \
+    static bool name(const uint8_t* data, size_t size)
+
+typedef void (*bench_fn)(uint64_t iters); /**< Used to select a benchmark function.*/
+
+/**
+ * Macro to declare a benchmark function.
+ * The body gets the number of iterations to run as iters, and should loop
+ *  over the measured code that many times, using spz_do_not_optimize() to
+ *  keep its results alive.
+ * @see REGISTER_BENCH
+ * @see spz_do_not_optimize
+ * @param name The name for the benchmark.
+ */
+#define BENCH(name) \
+    static void name(uint64_t iters); \
+    static void name(uint64_t iters)
+
+typedef bool (*fixture_setup_fn)(void); /**< Used to select a fixture setup function, returning false on failure.*/
+typedef void (*fixture_teardown_fn)(void); /**< Used to select a fixture teardown function.*/
+
+/**
+ * Macro to declare a fixture setup function.
+ * The body returns false when the fixture could not be set up, failing the
+ *  tests it was registered for.
+ * @see REGISTER_SUITE_FIXTURE
+ * @see REGISTER_TEST_FIXTURE
+ * @param name The name for the setup function.
+ */
+#define SETUP(name) \
+    static bool name(void); \
+    static bool name(void)
+
+/**
+ * Macro to declare a fixture teardown function.
+ * @see REGISTER_SUITE_FIXTURE
+ * @see REGISTER_TEST_FIXTURE
+ * @param name The name for the teardown function.
+ */
+#define TEARDOWN(name) \
+    static void name(void); \
+    static void name(void)
+
+#if defined(__GNUC__) || defined(__clang__)
+/**
+ * Macro to keep the compiler from optimizing away a value computed in a
+ *  benchmark, without storing it anywhere.
+ * Passing an array or pointer also keeps the writes to the memory it points to.
+ * @param x The value to keep.
+ */
+#define spz_do_not_optimize(x) __asm__ __volatile__("" : : "r,m"(x) : "memory")
+
+/**
+ * Macro to keep the compiler from optimizing away or reordering writes to
+ *  memory across this point of a benchmark.
+ */
+#define spz_clobber() __asm__ __volatile__("" : : : "memory")
+#else
+#define spz_do_not_optimize(x) do { \
+    volatile const void* spz_sink__ = &(x); \
+    (void) spz_sink__; \
+} while (0)
+#define spz_clobber() do { } while (0)
+#endif // __GNUC__ || __clang__
+
 #define ERROR_UNSUPPORTED_TYPE (*(int*)0)  /**< Used internally to detect an unexpected test type was passed to REGISTER_TEST().*/
 
 /**
@@ -63,6 +203,7 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
         test_void_fn: register_void_test_toreg, \
         test_int_fn: register_int_test_toreg, \
         test_bool_fn: register_bool_test_toreg, \
+        fuzz_fn: register_fuzz_test_toreg, \
         default: ERROR_UNSUPPORTED_TYPE \
         )(registry, #name, &name)
 
@@ -91,6 +232,287 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
 #define REGISTER_SUITE(name) \
     REGISTER_SUITE_TOREG(&SPZ_TEST_REGISTRY__, name)
 
+/**
+ * Macro to register a benchmark to a TestRegistry.
+ * @see BENCH
+ * @param registry The TestRegitry to add to.
+ * @param name The name for the benchmark.
+ */
+#define REGISTER_BENCH_TOREG(registry, name) \
+    register_bench_toreg(registry, #name, &name)
+
+/**
+ * Macro to register a benchmark to the default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_BENCH_TOREG
+ * @param name The name for the benchmark.
+ */
+#define REGISTER_BENCH(name) REGISTER_BENCH_TOREG(&SPZ_TEST_REGISTRY__, name)
+
+/**
+ * Macro to register a test with its own timeout to a TestRegistry.
+ * @see REGISTER_TEST_TOREG
+ * @see set_test_timeout_toreg
+ * @param registry The TestRegitry to add to.
+ * @param name The name for the test.
+ * @param timeout_ms The timeout in milliseconds, negative to disable it.
+ */
+#define REGISTER_TEST_TIMEOUT_TOREG(registry, name, timeout_ms) do { \
+    REGISTER_TEST_TOREG(registry, name); \
+    set_test_timeout_toreg(registry, timeout_ms); \
+} while (0)
+
+/**
+ * Macro to register a test with its own timeout to the default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_TEST_TIMEOUT_TOREG
+ * @param name The name for the test.
+ * @param timeout_ms The timeout in milliseconds, negative to disable it.
+ */
+#define REGISTER_TEST_TIMEOUT(name, timeout_ms) \
+    REGISTER_TEST_TIMEOUT_TOREG(&SPZ_TEST_REGISTRY__, name, timeout_ms)
+
+/**
+ * Macro to register a TestSuite with a timeout for its tests to a TestRegistry.
+ * @see REGISTER_SUITE_TOREG
+ * @see set_suite_timeout_toreg
+ * @param registry The TestRegitry to add to.
+ * @param name The name for the suite.
+ * @param timeout_ms The timeout in milliseconds, negative to disable it.
+ */
+#define REGISTER_SUITE_TIMEOUT_TOREG(registry, name, timeout_ms) do { \
+    REGISTER_SUITE_TOREG(registry, name); \
+    set_suite_timeout_toreg(registry, timeout_ms); \
+} while (0)
+
+/**
+ * Macro to register a TestSuite with a timeout for its tests to the default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_SUITE_TIMEOUT_TOREG
+ * @param name The name for the suite.
+ * @param timeout_ms The timeout in milliseconds, negative to disable it.
+ */
+#define REGISTER_SUITE_TIMEOUT(name, timeout_ms) \
+    REGISTER_SUITE_TIMEOUT_TOREG(&SPZ_TEST_REGISTRY__, name, timeout_ms)
+
+/**
+ * Macro to register a test which must always run in its own process to a
+ *  TestRegistry, like tests calling exit() or leaving global state behind.
+ * @see REGISTER_TEST_TOREG
+ * @see set_test_unsafe_toreg
+ * @param registry The TestRegitry to add to.
+ * @param name The name for the test.
+ */
+#define REGISTER_UNSAFE_TEST_TOREG(registry, name) do { \
+    REGISTER_TEST_TOREG(registry, name); \
+    set_test_unsafe_toreg(registry, true); \
+} while (0)
+
+/**
+ * Macro to register a test which must always run in its own process to the
+ *  default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_UNSAFE_TEST_TOREG
+ * @param name The name for the test.
+ */
+#define REGISTER_UNSAFE_TEST(name) \
+    REGISTER_UNSAFE_TEST_TOREG(&SPZ_TEST_REGISTRY__, name)
+
+/**
+ * Macro to register a parameterized test over the cases of a table to a
+ *  TestRegistry. The table must be an array, not a pointer.
+ * @see TEST_PARAM
+ * @see register_param_test_toreg
+ * @param registry The TestRegitry to add to.
+ * @param name The name for the test.
+ * @param table The array of cases.
+ */
+#define REGISTER_PARAM_TEST_TOREG(registry, name, table) \
+    register_param_test_toreg(registry, #name, &name, (table), sizeof((table)[0]), (int) (sizeof(table) / sizeof((table)[0])))
+
+/**
+ * Macro to register a parameterized test over the cases of a table to the
+ *  default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_PARAM_TEST_TOREG
+ * @param name The name for the test.
+ * @param table The array of cases.
+ */
+#define REGISTER_PARAM_TEST(name, table) \
+    REGISTER_PARAM_TEST_TOREG(&SPZ_TEST_REGISTRY__, name, table)
+
+/**
+ * Macro to register a parameterized test getting only the index of its
+ *  cases to a TestRegistry.
+ * @see TEST_PARAM
+ * @see register_param_test_toreg
+ * @param registry The TestRegitry to add to.
+ * @param name The name for the test.
+ * @param count The number of cases.
+ */
+#define REGISTER_INDEX_TEST_TOREG(registry, name, count) \
+    register_param_test_toreg(registry, #name, &name, NULL, 0, count)
+
+/**
+ * Macro to register a parameterized test getting only the index of its
+ *  cases to the default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_INDEX_TEST_TOREG
+ * @param name The name for the test.
+ * @param count The number of cases.
+ */
+#define REGISTER_INDEX_TEST(name, count) \
+    REGISTER_INDEX_TEST_TOREG(&SPZ_TEST_REGISTRY__, name, count)
+
+/**
+ * Macro to set the suite fixture of the last TestSuite registered to a
+ *  TestRegistry.
+ * The setup runs once in the runner, right before the first test of the
+ *  suite which is run, so that forked tests inherit what it builds. The
+ *  teardown runs after the last one.
+ * @see set_suite_fixture_toreg
+ * @param registry The TestRegitry to update.
+ * @param setup The setup function, or NULL.
+ * @param teardown The teardown function, or NULL.
+ */
+#define REGISTER_SUITE_FIXTURE_TOREG(registry, setup, teardown) \
+    set_suite_fixture_toreg(registry, setup, teardown)
+
+/**
+ * Macro to set the suite fixture of the last TestSuite registered to the
+ *  default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_SUITE_FIXTURE_TOREG
+ * @param setup The setup function, or NULL.
+ * @param teardown The teardown function, or NULL.
+ */
+#define REGISTER_SUITE_FIXTURE(setup, teardown) \
+    REGISTER_SUITE_FIXTURE_TOREG(&SPZ_TEST_REGISTRY__, setup, teardown)
+
+/**
+ * Macro to set the per-test fixture of the last TestSuite registered to a
+ *  TestRegistry, run around each of its tests, in the same process.
+ * @see set_test_fixture_toreg
+ * @param registry The TestRegitry to update.
+ * @param setup The setup function, or NULL.
+ * @param teardown The teardown function, or NULL.
+ */
+#define REGISTER_TEST_FIXTURE_TOREG(registry, setup, teardown) \
+    set_test_fixture_toreg(registry, setup, teardown)
+
+/**
+ * Macro to set the per-test fixture of the last TestSuite registered to the
+ *  default TestRegistry.
+ * @see SPZ_TEST_REGISTRY__
+ * @see REGISTER_TEST_FIXTURE_TOREG
+ * @param setup The setup function, or NULL.
+ * @param teardown The teardown function, or NULL.
+ */
+#define REGISTER_TEST_FIXTURE(setup, teardown) \
+    REGISTER_TEST_FIXTURE_TOREG(&SPZ_TEST_REGISTRY__, setup, teardown)
+
+/**
+ * Defines the default timeout for piped tests, in milliseconds.
+ * 0 means tests can run forever. Overridden by the --timeout option.
+ * @see TestRunOptions
+ */
+#ifndef SPZ_DEFAULT_TIMEOUT_MS
+#define SPZ_DEFAULT_TIMEOUT_MS 0
+#endif // SPZ_DEFAULT_TIMEOUT_MS
+
+/**
+ * Defines how many of the slowest piped tests are listed at the end of a
+ *  registry run. 0 turns the list off. Overridden by the --slowest option.
+ * @see TestRunOptions
+ */
+#ifndef SPZ_SLOWEST
+#define SPZ_SLOWEST 0
+#endif // SPZ_SLOWEST
+
+/**
+ * Defines the default number of inputs a property is checked against.
+ * Overridden by the --prop-iters option.
+ * @see TestRunOptions
+ */
+#ifndef SPZ_PROP_ITERS
+#define SPZ_PROP_ITERS 100
+#endif // SPZ_PROP_ITERS
+
+/**
+ * Defines the max number of calls to a property spent shrinking its input.
+ * @see check_property
+ */
+#ifndef SPZ_PROP_SHRINK_RUNS
+#define SPZ_PROP_SHRINK_RUNS 2000
+#endif // SPZ_PROP_SHRINK_RUNS
+
+/**
+ * Defines the characters drawn by spz_gen_string() when passed no alphabet,
+ *  in the order they shrink to.
+ * @see spz_gen_string
+ */
+#ifndef SPZ_PROP_ALPHABET
+#define SPZ_PROP_ALPHABET "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 !\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}~"
+#endif // SPZ_PROP_ALPHABET
+
+/**
+ * Defines the suffix of the corpus directory of fuzz targets, next to
+ *  their name.
+ */
+#ifndef SPZ_FUZZ_SUFFIX
+#define SPZ_FUZZ_SUFFIX ".corpus"
+#endif // SPZ_FUZZ_SUFFIX
+
+/**
+ * Defines the default number of inputs tried by the fuzz subcommand, 0 to
+ *  go on until one fails.
+ * @see TestRunOptions
+ */
+#ifndef SPZ_FUZZ_RUNS
+#define SPZ_FUZZ_RUNS 0
+#endif // SPZ_FUZZ_RUNS
+
+/**
+ * Defines the default length of the longest input generated by the fuzz
+ *  subcommand.
+ * @see TestRunOptions
+ */
+#ifndef SPZ_FUZZ_MAX_LEN
+#define SPZ_FUZZ_MAX_LEN 4096
+#endif // SPZ_FUZZ_MAX_LEN
+
+/**
+ * Defines the timeout in milliseconds of each input tried by the fuzz
+ *  subcommand, for targets with no timeout of their own.
+ */
+#ifndef SPZ_FUZZ_TIMEOUT_MS
+#define SPZ_FUZZ_TIMEOUT_MS 1000
+#endif // SPZ_FUZZ_TIMEOUT_MS
+
+/**
+ * Defines the number of slots of the coverage map of the fuzz subcommand.
+ * Must be a power of 2.
+ */
+#ifndef SPZ_FUZZ_MAP_SIZE
+#define SPZ_FUZZ_MAP_SIZE 65536
+#endif // SPZ_FUZZ_MAP_SIZE
+
+/**
+ * Defines the number of comparison operands each fuzzed child reports, with
+ *  -fsanitize-coverage=trace-cmp.
+ */
+#ifndef SPZ_FUZZ_CMP_SLOTS
+#define SPZ_FUZZ_CMP_SLOTS 64
+#endif // SPZ_FUZZ_CMP_SLOTS
+
+/**
+ * Defines the number of comparison operands kept by the fuzz subcommand, to
+ *  be written into inputs.
+ */
+#ifndef SPZ_FUZZ_DICT_SIZE
+#define SPZ_FUZZ_DICT_SIZE 256
+#endif // SPZ_FUZZ_DICT_SIZE
+
 #ifndef SPZ_NOPIPE
 #ifndef REGISTER_ALL_TESTS_PIPED
 #define REGISTER_ALL_TESTS_PIPED 1
@@ -101,6 +523,9 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
 #ifndef SPZ_STDERR_SUFFIX
 #define SPZ_STDERR_SUFFIX ".stderr"
 #endif // SPZ_STDERR_SUFFIX
+#ifndef SPZ_CACHE_SUFFIX
+#define SPZ_CACHE_SUFFIX ".cache"
+#endif // SPZ_CACHE_SUFFIX
 #else
 #ifndef REGISTER_ALL_TESTS_PIPED
 #define REGISTER_ALL_TESTS_PIPED 0
@@ -118,12 +543,19 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
  * In the default case, if REGISTER_ALL_TESTS_PIPED is defined as 1,
  *  run_test_piped() is used, otherwise run_test().
  * If main() is called with a suite or test name as args, it will
- *  run that specific suite/test.
+ *  run that specific suite/test. Names are resolved through the index built
+ *  by index_testregistry(). Passing more than one name, or glob patterns,
+ *  runs all matching tests with run_testregistry_filter().
+ * The fuzz subcommand runs fuzz_testregistry() on the named target.
+ * Runner options are parsed by spz_parse_args() before anything else.
+ * When requested, the fork server is started right after registration.
  * @see SPZ_TEST_REGISTRY__
  * @see REGISTER_SUITE
  * @see REGISTER_TEST
  * @see run_test_piped
  * @see run_test
+ * @see spz_parse_args
+ * @see spz_fork_server_start
  */
 #define REGISTER_ALL_TESTS() \
     static void register_all_tests(void) { \
@@ -132,66 +564,141 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
     } \
     static void spz_usage(const char* progname) { \
         if (!progname) return; \
-        printf("Usage: %s [subcommand | SUITE | SUITE::TEST]\n", progname); \
+        printf("Usage: %s [options] [subcommand | SUITE | SUITE::TEST | PATTERN ...]\n", progname); \
         printf("\nArguments:\n\n"); \
-        printf("  [subcommand]    record, help\n"); \
+        printf("  [subcommand]    record, list, bench, bench-record, bench-check, fuzz, help\n"); \
         printf("  SUITE           name of suite to run\n"); \
         printf("  SUITE::TEST     name of test to run from given suite\n"); \
+        printf("  PATTERN         glob for SUITE or SUITE::TEST (*, ?, [...]), prefix with ! to exclude\n"); \
         printf("\nSubcommands:\n\n"); \
         printf("  record          record all successful tests\n"); \
+        printf("  list [--json] [PATTERN ...]  list tests with their stable IDs, without running them\n"); \
+        printf("  bench [PATTERN] run benchmarks, all or the ones matching the patterns\n"); \
+        printf("  bench-record    like bench, also writing the results as baselines\n"); \
+        printf("  bench-check     like bench, failing on slowdowns from the baselines\n"); \
+        printf("  fuzz TARGET [DIR]  fuzz a target, growing its corpus in DIR (default: ./TARGET%s)\n", SPZ_FUZZ_SUFFIX); \
         printf("  help            show this message\n"); \
+        printf("\nOptions:\n\n"); \
+        printf("  -j N, --jobs N  run up to N piped tests at once (0 for all cpus, env: SPZ_JOBS)\n"); \
+        printf("  --capture MODE  capture piped output with memfd or tmpfile (env: SPZ_CAPTURE)\n"); \
+        printf("  --timeout MS    kill piped tests running longer than MS milliseconds (env: SPZ_TIMEOUT)\n"); \
+        printf("  --fork-server   fork piped tests from a helper started before running them (env: SPZ_FORK_SERVER)\n"); \
+        printf("  --bench-threshold PCT  slowdown of the median tolerated by bench-check (env: SPZ_BENCH_THRESHOLD)\n"); \
+        printf("  --in-process    run piped tests in the runner, recovering from crashes, unless unsafe (env: SPZ_IN_PROCESS)\n"); \
+        printf("  --slowest N     list the resources used by the N slowest tests, 0 for none (env: SPZ_SLOWEST)\n"); \
+        printf("  --perf          count cycles, instructions, cache and branch misses of tests and benchmarks (env: SPZ_PERF)\n"); \
+        printf("  --report FORMAT:PATH  also write results as junit, jsonl, tap or durations, to a file or - for stdout, moving other output to stderr (env: SPZ_REPORT)\n"); \
+        printf("  --shard-index K, --shard-count N  only run shard K of N, from 0 (env: SPZ_SHARD_INDEX, SPZ_SHARD_COUNT)\n"); \
+        printf("  --shard-durations PATH  balance shards with a durations report from a previous run (env: SPZ_SHARD_DURATIONS)\n"); \
+        printf("  --seed N        seed of property checks, random by default (env: SPZ_SEED)\n"); \
+        printf("  --prop-iters N  check properties against N inputs, unless they set their own (env: SPZ_PROP_ITERS)\n"); \
+        printf("  --fuzz-runs N   stop fuzzing after N inputs, 0 to go on until one fails (env: SPZ_FUZZ_RUNS)\n"); \
+        printf("  --fuzz-max-len N  longest input generated when fuzzing (env: SPZ_FUZZ_MAX_LEN)\n"); \
+        printf("  --changed       skip tests which passed with the same binary and records, caching results (env: SPZ_CHANGED)\n"); \
+        printf("  --cache PATH    cache file used by --changed (default: %s%s, env: SPZ_CACHE)\n", progname, SPZ_CACHE_SUFFIX); \
     } \
     /* Automatically generate the main function */ \
     int main(int argc, char** argv) { \
-        printf("%s: using supozi v%i.%i.%i\n", argv[0], SPZ_MAJOR, SPZ_MINOR, SPZ_PATCH); \
+        argc = spz_parse_args(argc, argv); \
+        /* Keep list output machine-readable */ \
+        if (argc < 2 || strcmp(argv[1], "list")) { \
+            /* Print the seed before running anything, so that crashing properties can be replayed too */ \
+            printf("%s: using supozi v%i.%i.%i, seed %llu\n", argv[0], SPZ_MAJOR, SPZ_MINOR, SPZ_PATCH, (unsigned long long) SPZ_RUN_OPTIONS__.seed); \
+        } \
         register_all_tests(); \
+        expand_testregistry(&SPZ_TEST_REGISTRY__); \
+        index_testregistry(&SPZ_TEST_REGISTRY__); \
+        /* list and help don't run tests */ \
+        bool runs_tests = (argc < 2 || (strcmp(argv[1], "list") && strcmp(argv[1], "help"))); \
+        if (SPZ_RUN_OPTIONS__.fork_server && REGISTER_ALL_TESTS_PIPED == 1 && runs_tests) { \
+            spz_fork_server_start(); \
+        } \
         if (argc > 1) { \
             if (!strcmp(argv[1], "help")) { \
                 spz_usage(argv[0]); \
                 return 0; \
             } else if (!strcmp(argv[1], "record")) { \
                 return run_tests_record(REGISTER_ALL_TESTS_PIPED, 1, SPZ_STDOUT_SUFFIX, SPZ_STDERR_SUFFIX); \
-            } else { \
-                char namebuf[FILENAME_MAX] = {0}; \
-                for (int i=0; i < SPZ_TEST_REGISTRY__.suites_count+1; i++) { \
-                    TestSuite suite = SPZ_TEST_REGISTRY__.suites[i]; \
-                    if (!strcmp(argv[1], suite.name)) { \
-                        printf("%s: running suite %s:\n", argv[0], suite.name); \
-                        int res = run_suite(suite, REGISTER_ALL_TESTS_PIPED); \
-                        return res; \
+            } else if (!strcmp(argv[1], "list")) { \
+                bool json = false; \
+                int filters_count = 0; \
+                for (int i = 2; i < argc; i++) { \
+                    if (!strcmp(argv[i], "--json")) { \
+                        json = true; \
+                    } else { \
+                        argv[2 + filters_count++] = argv[i]; \
                     } \
-                    for (int j=0; j < suite.test_count+1; j++) { \
-                        Test t = suite.tests[j]; \
-                        sprintf(namebuf, "%s::%s", suite.name, t.name); \
-                        if (!strcmp(argv[1], namebuf)) { \
-                            printf("%s: running test %s::%s: ", argv[0], suite.name, t.name); \
-                            fflush(stdout); \
-                            int res = -1; \
-                            TestResult tr = {0}; \
-                            if (REGISTER_ALL_TESTS_PIPED == 1) { \
-                                tr = run_test_piped(t); \
-                                res = tr.exit_code; \
-                            } else { \
-                                res = run_test(t); \
-                            } \
-                            printf("%s\n", (res == 0 ? "\033[0;32mSUCCESS\033[0m" : "\033[0;31mFAILURE\033[0m")); \
-                            if (REGISTER_ALL_TESTS_PIPED == 1) { \
-                                printf("---- %s::%s stdout ----\n", suite.name, t.name); \
-                                int stdout_fd = fileno(tr.stdout_fp); \
-                                spz_print_stream_to_file(stdout_fd, stdout); \
-                                printf("---- %s::%s stderr ----\n", suite.name, t.name); \
-                                int stderr_fd = fileno(tr.stderr_fp); \
-                                spz_print_stream_to_file(stderr_fd, stdout); \
-                                fclose(tr.stdout_fp); \
-                                fclose(tr.stderr_fp); \
-                            } \
-                            return res; \
-                        } \
+                } \
+                return (list_testregistry(&SPZ_TEST_REGISTRY__, (const char**) argv+2, filters_count, json) < 0 ? 1 : 0); \
+            } else if (!strcmp(argv[1], "bench")) { \
+                int res = run_benches_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+2, argc-2); \
+                return (res != 0 ? 1 : 0); \
+            } else if (!strcmp(argv[1], "bench-record")) { \
+                int res = run_benches_record_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+2, argc-2, SPZ_BENCH_RECORD, SPZ_BENCH_SUFFIX); \
+                return (res != 0 ? 1 : 0); \
+            } else if (!strcmp(argv[1], "bench-check")) { \
+                int res = run_benches_record_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+2, argc-2, SPZ_BENCH_CHECK, SPZ_BENCH_SUFFIX); \
+                /* Regression counts would wrap as exit status */ \
+                return (res != 0 ? 1 : 0); \
+            } else if (!strcmp(argv[1], "fuzz")) { \
+                if (argc < 3 || argc > 4) { \
+                    spz_usage(argv[0]); \
+                    return 1; \
+                } \
+                int res = fuzz_testregistry(&SPZ_TEST_REGISTRY__, argv[2], (argc > 3 ? argv[3] : NULL)); \
+                return (res < 0 ? 1 : res); \
+            } else { \
+                int suite_idx = -1; \
+                int test_idx = -1; \
+                /* Reporters and sharding only see tests run as part of a registry */ \
+                if (argc > 2 || SPZ_REPORTERS_COUNT__ > 0 || SPZ_RUN_OPTIONS__.shard_count > 1 || !lookup_testregistry(&SPZ_TEST_REGISTRY__, argv[1], &suite_idx, &test_idx)) { \
+                    int res = run_testregistry_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+1, argc-1, REGISTER_ALL_TESTS_PIPED); \
+                    if (res < 0) { \
+                        spz_usage(argv[0]); \
+                        return 1; \
                     } \
+                    return res; \
                 } \
-                printf("%s: unknown argument: %s\n", argv[0], argv[1]); \
-                spz_usage(argv[0]); \
-                return 1; \
+                const TestSuite* suite = &SPZ_TEST_REGISTRY__.suites[suite_idx]; \
+                if (test_idx == -1) { \
+                    printf("%s: running suite %s:\n", argv[0], suite->name); \
+                    int res = run_suite_ptr(suite, REGISTER_ALL_TESTS_PIPED); \
+                    return res; \
+                } \
+                Test t = suite->tests[test_idx]; \
+                if (t.timeout_ms == 0) { \
+                    t.timeout_ms = suite->timeout_ms; \
+                } \
+                printf("%s: running test %s::%s: ", argv[0], suite->name, t.name); \
+                fflush(stdout); \
+                if (suite->setup && !suite->setup()) { \
+                    printf("\033[0;31mFAILURE\033[0m\n"); \
+                    fflush(stdout); \
+                    fprintf(stderr, "%s: setup of suite {%s} failed\n", argv[0], suite->name); \
+                    if (suite->teardown) suite->teardown(); \
+                    return 1; \
+                } \
+                int res = -1; \
+                TestResult tr = {0}; \
+                if (REGISTER_ALL_TESTS_PIPED == 1) { \
+                    tr = run_test_piped(t); \
+                    res = tr.exit_code; \
+                } else { \
+                    res = run_test(t); \
+                } \
+                printf("%s\n", (tr.timed_out ? "\033[0;31mTIMEOUT\033[0m" : (res == 0 ? "\033[0;32mSUCCESS\033[0m" : "\033[0;31mFAILURE\033[0m"))); \
+                spz_print_counters(&tr.counters, 0); \
+                if (REGISTER_ALL_TESTS_PIPED == 1) { \
+                    printf("---- %s::%s stdout ----\n", suite->name, t.name); \
+                    int stdout_fd = fileno(tr.stdout_fp); \
+                    spz_print_stream_to_file(stdout_fd, stdout); \
+                    printf("---- %s::%s stderr ----\n", suite->name, t.name); \
+                    int stderr_fd = fileno(tr.stderr_fp); \
+                    spz_print_stream_to_file(stderr_fd, stdout); \
+                    testresult_close(&tr); \
+                } \
+                if (suite->teardown) suite->teardown(); \
+                return res; \
             } \
         } else { \
             return run_tests(REGISTER_ALL_TESTS_PIPED); \
@@ -207,11 +714,15 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
  * main() by default runs all tests registered in all test suites.
  * In the default case, run_test() is used.
  * If main() is called with a suite or test name as args, it will
- *  run that specific suite/test.
+ *  run that specific suite/test. Names are resolved through the index built
+ *  by index_testregistry(). Passing more than one name, or glob patterns,
+ *  runs all matching tests with run_testregistry_filter().
+ * Runner options are parsed by spz_parse_args() before anything else.
  * @see SPZ_TEST_REGISTRY__
  * @see REGISTER_SUITE
  * @see REGISTER_TEST
  * @see run_test
+ * @see spz_parse_args
  */
 #define REGISTER_ALL_TESTS() \
     static void register_all_tests(void) { \
@@ -220,46 +731,91 @@ typedef bool (*test_bool_fn)(void); /**< Used to select a test function returnin
     } \
     static void spz_usage(const char* progname) { \
         if (!progname) return; \
-        printf("Usage: %s [subcommand | SUITE | SUITE::TEST]\n", progname); \
+        printf("Usage: %s [options] [subcommand | SUITE | SUITE::TEST | PATTERN ...]\n", progname); \
         printf("\nArguments:\n\n"); \
-        printf("  [subcommand]    record, help\n"); \
+        printf("  [subcommand]    record, list, bench, bench-record, bench-check, help\n"); \
         printf("  SUITE           name of suite to run\n"); \
         printf("  SUITE::TEST     name of test to run from given suite\n"); \
+        printf("  PATTERN         glob for SUITE or SUITE::TEST (*, ?, [...]), prefix with ! to exclude\n"); \
         printf("\nSubcommands:\n\n"); \
+        printf("  list [--json] [PATTERN ...]  list tests with their stable IDs, without running them\n"); \
+        printf("  bench [PATTERN] run benchmarks, all or the ones matching the patterns\n"); \
+        printf("  bench-record    like bench, also writing the results as baselines\n"); \
+        printf("  bench-check     like bench, failing on slowdowns from the baselines\n"); \
         printf("  help            show this message\n"); \
+        printf("\nOptions:\n\n"); \
+        printf("  --bench-threshold PCT  slowdown of the median tolerated by bench-check (env: SPZ_BENCH_THRESHOLD)\n"); \
+        printf("  --shard-index K, --shard-count N  only run shard K of N, from 0 (env: SPZ_SHARD_INDEX, SPZ_SHARD_COUNT)\n"); \
+        printf("  --shard-durations PATH  balance shards with a durations file from a previous run (env: SPZ_SHARD_DURATIONS)\n"); \
+        printf("  --seed N        seed of property checks, random by default (env: SPZ_SEED)\n"); \
+        printf("  --prop-iters N  check properties against N inputs, unless they set their own (env: SPZ_PROP_ITERS)\n"); \
     } \
     /* Automatically generate the main function */ \
     int main(int argc, char** argv) { \
-        printf("%s: using supozi v%i.%i.%i\n", argv[0], SPZ_MAJOR, SPZ_MINOR, SPZ_PATCH); \
+        argc = spz_parse_args(argc, argv); \
+        /* Keep list output machine-readable */ \
+        if (argc < 2 || strcmp(argv[1], "list")) { \
+            /* Print the seed before running anything, so that crashing properties can be replayed too */ \
+            printf("%s: using supozi v%i.%i.%i, seed %llu\n", argv[0], SPZ_MAJOR, SPZ_MINOR, SPZ_PATCH, (unsigned long long) SPZ_RUN_OPTIONS__.seed); \
+        } \
         register_all_tests(); \
+        expand_testregistry(&SPZ_TEST_REGISTRY__); \
+        index_testregistry(&SPZ_TEST_REGISTRY__); \
         if (argc > 1) { \
             if (!strcmp(argv[1], "help")) { \
                 spz_usage(argv[0]); \
                 return 0; \
-            } else { \
-                char namebuf[FILENAME_MAX] = {0}; \
-                for (int i=0; i < SPZ_TEST_REGISTRY__.suites_count+1; i++) { \
-                    TestSuite suite = SPZ_TEST_REGISTRY__.suites[i]; \
-                    if (!strcmp(argv[1], suite.name)) { \
-                        printf("%s: running suite %s:\n", argv[0], suite.name); \
-                        int res = run_suite(suite, REGISTER_ALL_TESTS_PIPED); \
-                        return res; \
+            } else if (!strcmp(argv[1], "list")) { \
+                bool json = false; \
+                int filters_count = 0; \
+                for (int i = 2; i < argc; i++) { \
+                    if (!strcmp(argv[i], "--json")) { \
+                        json = true; \
+                    } else { \
+                        argv[2 + filters_count++] = argv[i]; \
                     } \
-                    for (int j=0; j < suite.test_count+1; j++) { \
-                        Test t = suite.tests[j]; \
-                        sprintf(namebuf, "%s::%s", suite.name, t.name); \
-                        if (!strcmp(argv[1], namebuf)) { \
-                            printf("%s: running test %s::%s: ", argv[0], suite.name, t.name); \
-                            fflush(stdout); \
-                            int res = run_test(t); \
-                            printf("%s\n", (res == 0 ? "\033[0;32mSUCCESS\033[0m" : "\033[0;31mFAILURE\033[0m")); \
-                            return res; \
-                        } \
+                } \
+                return (list_testregistry(&SPZ_TEST_REGISTRY__, (const char**) argv+2, filters_count, json) < 0 ? 1 : 0); \
+            } else if (!strcmp(argv[1], "bench")) { \
+                int res = run_benches_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+2, argc-2); \
+                return (res != 0 ? 1 : 0); \
+            } else if (!strcmp(argv[1], "bench-record")) { \
+                int res = run_benches_record_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+2, argc-2, SPZ_BENCH_RECORD, SPZ_BENCH_SUFFIX); \
+                return (res != 0 ? 1 : 0); \
+            } else if (!strcmp(argv[1], "bench-check")) { \
+                int res = run_benches_record_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+2, argc-2, SPZ_BENCH_CHECK, SPZ_BENCH_SUFFIX); \
+                /* Regression counts would wrap as exit status */ \
+                return (res != 0 ? 1 : 0); \
+            } else { \
+                int suite_idx = -1; \
+                int test_idx = -1; \
+                /* Sharding only sees tests run as part of a registry */ \
+                if (argc > 2 || SPZ_RUN_OPTIONS__.shard_count > 1 || !lookup_testregistry(&SPZ_TEST_REGISTRY__, argv[1], &suite_idx, &test_idx)) { \
+                    int res = run_testregistry_filter(&SPZ_TEST_REGISTRY__, (const char**) argv+1, argc-1, REGISTER_ALL_TESTS_PIPED); \
+                    if (res < 0) { \
+                        spz_usage(argv[0]); \
+                        return 1; \
                     } \
+                    return res; \
                 } \
-                printf("%s: unknown argument: %s\n", argv[0], argv[1]); \
-                spz_usage(argv[0]); \
-                return 1; \
+                const TestSuite* suite = &SPZ_TEST_REGISTRY__.suites[suite_idx]; \
+                if (test_idx == -1) { \
+                    printf("%s: running suite %s:\n", argv[0], suite->name); \
+                    int res = run_suite_ptr(suite, REGISTER_ALL_TESTS_PIPED); \
+                    return res; \
+                } \
+                const Test* t = &suite->tests[test_idx]; \
+                printf("%s: running test %s::%s: ", argv[0], suite->name, t->name); \
+                fflush(stdout); \
+                int res = 1; \
+                if (!suite->setup || suite->setup()) { \
+                    res = run_test(*t); \
+                } else { \
+                    fprintf(stderr, "%s: setup of suite {%s} failed\n", argv[0], suite->name); \
+                } \
+                if (suite->teardown) suite->teardown(); \
+                printf("%s\n", (res == 0 ? "\033[0;32mSUCCESS\033[0m" : "\033[0;31mFAILURE\033[0m")); \
+                return res; \
             } \
         } else { \
             return run_tests(REGISTER_ALL_TESTS_PIPED); \
@@ -277,6 +833,8 @@ typedef union test_fn {
     test_void_fn void_fn; /**< Used for tests returning void.*/
     test_int_fn int_fn; /**< Used for tests returning int.*/
     test_bool_fn bool_fn; /**< Used for tests returning bool.*/
+    test_param_fn param_fn; /**< Used for parameterized tests.*/
+    fuzz_fn fuzz_fn; /**< Used for fuzz targets.*/
 } test_fn;
 
 /**
@@ -288,6 +846,8 @@ typedef enum Test_Type {
     TEST_VOID,
     TEST_INT,
     TEST_BOOL,
+    TEST_PARAMETERIZED,
+    TEST_FUZZ,
 } Test_Type;
 
 /**
@@ -300,13 +860,129 @@ typedef struct Test {
     Test_Type type; /**< Used to tag the func field.*/
     test_fn func; /**< Holds the proper test function pointer*/
     const char* name; /**< Name of the test.*/
+    int timeout_ms; /**< Timeout for the test when piped, 0 to use the one of its suite, negative for none.*/
+    bool unsafe; /**< When true, the test is always forked, even with TestRunOptions.in_process.*/
+    fixture_setup_fn setup; /**< Run before the test by run_test(), from the per-test fixture of its suite.*/
+    fixture_teardown_fn teardown; /**< Run after the test by run_test(), from the per-test fixture of its suite.*/
+    const void* params; /**< Table of cases of a TEST_PARAM test, NULL for index only tests.*/
+    size_t param_size; /**< Size of each case of the table.*/
+    int param_count; /**< Number of cases run by the test, 1 once expanded.*/
+    int param_idx; /**< Index of the first case run by the test, with params pointing to it.*/
 } Test;
 
 /**
- * Defines max number of tests in each suite.
+ * Defines initial capacity for the tests array of a suite, and for the
+ *  suites array of a registry. Both grow by doubling when full.
  * @see TestSuite
+ * @see TestRegistry
+ */
+#ifndef SPZ_INITIAL_CAPACITY
+#define SPZ_INITIAL_CAPACITY 8
+#endif // SPZ_INITIAL_CAPACITY
+
+/**
+ * Represents a named benchmark.
+ * @see BENCH
+ * @see REGISTER_BENCH
+ */
+typedef struct Bench {
+    bench_fn func; /**< The benchmark function.*/
+    const char* name; /**< Name of the benchmark.*/
+} Bench;
+
+/**
+ * Defines the number of samples taken by run_bench().
+ */
+#ifndef SPZ_BENCH_SAMPLES
+#define SPZ_BENCH_SAMPLES 50
+#endif // SPZ_BENCH_SAMPLES
+
+/**
+ * Defines the duration each run_bench() sample is calibrated to, in milliseconds.
+ */
+#ifndef SPZ_BENCH_SAMPLE_MS
+#define SPZ_BENCH_SAMPLE_MS 5
+#endif // SPZ_BENCH_SAMPLE_MS
+
+/**
+ * Defines the minimum time run_bench() spends running a benchmark before
+ *  sampling it, in milliseconds.
+ */
+#ifndef SPZ_BENCH_WARMUP_MS
+#define SPZ_BENCH_WARMUP_MS 50
+#endif // SPZ_BENCH_WARMUP_MS
+
+/**
+ * Defines the suffix of the baseline files written by bench-record.
+ */
+#ifndef SPZ_BENCH_SUFFIX
+#define SPZ_BENCH_SUFFIX ".bench"
+#endif // SPZ_BENCH_SUFFIX
+
+/**
+ * Defines the default percent slowdown of the median tolerated by bench-check.
+ * @see TestRunOptions
+ */
+#ifndef SPZ_BENCH_THRESHOLD
+#define SPZ_BENCH_THRESHOLD 5.0
+#endif // SPZ_BENCH_THRESHOLD
+
+/**
+ * Defines the z score over which bench-check finds a slowdown significant.
+ * The default is the one-sided critical value at 1% significance.
  */
-#define MAX_TESTS 100
+#ifndef SPZ_BENCH_CHECK_Z
+#define SPZ_BENCH_CHECK_Z 2.326
+#endif // SPZ_BENCH_CHECK_Z
+
+/**
+ * Tags the hardware counters collected with SPZ_RUN_OPTIONS__.perf.
+ * @see TestCounters
+ */
+typedef enum TestCounter {
+    SPZ_COUNTER_CYCLES, /**< CPU cycles.*/
+    SPZ_COUNTER_INSTRUCTIONS, /**< Retired instructions.*/
+    SPZ_COUNTER_CACHE_MISSES, /**< Last level cache misses.*/
+    SPZ_COUNTER_BRANCH_MISSES, /**< Mispredicted branches.*/
+    SPZ_COUNTERS_COUNT, /**< Number of counters.*/
+} TestCounter;
+
+/**
+ * Represents the hardware counters collected for a test or a benchmark, in
+ *  user space only. Needs Linux and a permissive perf_event_paranoid.
+ * @see TestCounter
+ */
+typedef struct TestCounters {
+    uint64_t values[SPZ_COUNTERS_COUNT]; /**< Counts indexed by TestCounter, scaled when the counter was multiplexed.*/
+    unsigned valid; /**< Has bit (1 << TestCounter) set for each collected counter.*/
+} TestCounters;
+
+/**
+ * Represents the statistics of a run_bench() call. Times are in ns/op.
+ * @see run_bench
+ */
+typedef struct BenchResult {
+    uint64_t iters; /**< Iterations run for each sample, found by calibration.*/
+    int samples; /**< Number of samples taken.*/
+    double min_ns; /**< Fastest sample.*/
+    double median_ns; /**< Median sample.*/
+    double p99_ns; /**< 99th percentile sample.*/
+    double mean_ns; /**< Mean of the samples.*/
+    double stddev_ns; /**< Standard deviation of the samples.*/
+    double mad_ns; /**< Median absolute deviation of the samples.*/
+    double samples_ns[SPZ_BENCH_SAMPLES]; /**< All samples, sorted.*/
+    TestCounters counters; /**< Counters over all samples, for iters * samples ops.*/
+} BenchResult;
+
+/**
+ * Used to select what run_benches_record_filter() does with each result.
+ * @see run_benches_record_filter
+ */
+typedef enum BenchMode {
+    SPZ_BENCH_RUN, /**< Only report the statistics.*/
+    SPZ_BENCH_RECORD, /**< Write the results as baselines.*/
+    SPZ_BENCH_CHECK, /**< Compare the results against the baselines.*/
+} BenchMode;
 
 /**
  * Represents a named test suite.
@@ -314,26 +990,46 @@ typedef struct Test {
  * @see REGISTER_SUITE
  */
 typedef struct TestSuite {
-    Test tests[MAX_TESTS]; /**< Holds all tests of the suite.*/
+    Test* tests; /**< Holds all tests of the suite, allocated on registration.*/
     int test_count; /**< Counts how many tests are registered.*/
+    int tests_capacity; /**< Counts how many tests fit in the tests array.*/
     const char* name; /**< Name of the suite.*/
+    int timeout_ms; /**< Timeout for the tests of the suite when piped, 0 to use the one from TestRunOptions, negative for none.*/
+    struct Bench* benches; /**< Holds all benchmarks of the suite, allocated on registration.*/
+    int bench_count; /**< Counts how many benchmarks are registered.*/
+    int benches_capacity; /**< Counts how many benchmarks fit in the benches array.*/
+    fixture_setup_fn setup; /**< Run once before the tests of the suite, NULL for none.*/
+    fixture_teardown_fn teardown; /**< Run once after the tests of the suite, NULL for none.*/
+    fixture_setup_fn test_setup; /**< Copied to each Test registered to the suite.*/
+    fixture_teardown_fn test_teardown; /**< Copied to each Test registered to the suite.*/
+    char* case_names; /**< Names of the cases of parameterized tests, allocated by expand_testregistry().*/
 } TestSuite;
 
 /**
- * Defines max number of suites in each test registry.
- * @see TestRegistry
+ * Represents a slot of the name index of a TestRegistry.
+ * @see index_testregistry
+ * @see lookup_testregistry
  */
-#define MAX_SUITES 100
+typedef struct TestIndexEntry {
+    uint64_t hash; /**< Hash of the suite name, or of SUITE::TEST.*/
+    int suite_idx; /**< Index of the suite, -1 for empty slots.*/
+    int test_idx; /**< Index of the test, -1 for entries naming a whole suite.*/
+} TestIndexEntry;
 
 /**
  * Represents a group of test suites.
+ * Memory is allocated on registration, and is released by free_testregistry().
  * @see TestSuite
  * @see REGISTER_SUITE_TOREG
  * @see REGISTER_TEST_TOREG
+ * @see free_testregistry
  */
 typedef struct TestRegistry {
-    TestSuite suites[MAX_SUITES]; /**< Holds all test suites of the registry.*/
+    TestSuite* suites; /**< Holds all test suites of the registry.*/
     int suites_count; /**< Counts how many suites are registered.*/
+    int suites_capacity; /**< Counts how many suites fit in the suites array.*/
+    TestIndexEntry* index; /**< Name index, built by index_testregistry() and dropped on registration.*/
+    int index_capacity; /**< Number of slots in the index, always a power of 2.*/
 } TestRegistry;
 
 /**
@@ -346,6 +1042,49 @@ typedef struct TestRegistry {
  */
 extern TestRegistry SPZ_TEST_REGISTRY__;
 
+/**
+ * Used to select where the output of piped tests is captured.
+ * @see TestRunOptions
+ */
+typedef enum TestCapture {
+    SPZ_CAPTURE_TMPFILE, /**< Capture onto files from tmpfile(), in TMPDIR.*/
+    SPZ_CAPTURE_MEMFD, /**< Capture onto anonymous in-memory files, falling back to tmpfile() where unavailable.*/
+} TestCapture;
+
+/**
+ * Represents the runtime options used when running tests.
+ * @see SPZ_RUN_OPTIONS__
+ * @see spz_parse_args
+ */
+typedef struct TestRunOptions {
+    int jobs; /**< Max number of piped tests running at the same time.*/
+    TestCapture capture; /**< Where the output of piped tests is captured.*/
+    int timeout_ms; /**< Timeout for piped tests with no timeout of their own, 0 for none.*/
+    bool fork_server; /**< When true, main() starts the fork server after registering tests.*/
+    bool in_process; /**< When true, suite and registry runs call piped tests in the runner, unless unsafe.*/
+    double bench_threshold; /**< Percent slowdown of the median tolerated by bench-check.*/
+    int slowest; /**< Number of slowest piped tests listed at the end of a registry run, 0 for none.*/
+    bool perf; /**< When true, hardware counters are collected for piped tests and benchmarks.*/
+    int shard_index; /**< Index of the shard run by registry runs, from 0.*/
+    int shard_count; /**< Number of shards registry runs are split into, <= 1 for none.*/
+    const char* shard_durations; /**< Durations file used to balance shards, NULL to split them by hash.*/
+    uint64_t seed; /**< Seed of property checks, mixed with the name of each property.*/
+    bool seed_set; /**< Set when the seed was passed rather than drawn at random.*/
+    int prop_iters; /**< Number of inputs properties are checked against, unless they set their own.*/
+    long long fuzz_runs; /**< Number of inputs tried by fuzz_testregistry(), 0 to go on until one fails.*/
+    int fuzz_max_len; /**< Length of the longest input generated by fuzz_testregistry().*/
+    bool changed; /**< When true, piped suite and registry runs skip the tests which passed with the same cache key.*/
+    const char* cache_path; /**< File holding the cache keys used by changed.*/
+} TestRunOptions;
+
+/**
+ * Global default TestRunOptions.
+ * Filled by spz_parse_args(), used by run_suite_record().
+ * @see TestRunOptions
+ * @see spz_parse_args
+ */
+extern TestRunOptions SPZ_RUN_OPTIONS__;
+
 #ifndef _WIN32
 #define SPZ_PATH_SEPARATOR "/"
 #else
@@ -362,34 +1101,120 @@ void register_bool_test_toreg(TestRegistry *tr, const char* name, test_bool_fn f
 void register_int_test_toreg(TestRegistry *tr, const char* name, test_int_fn func);
 void register_void_test_toreg(TestRegistry *tr, const char* name, test_void_fn func);
 void register_test_suite_toreg(TestRegistry *tr, const char* name);
+// Functions to register parameterized tests
+void register_param_test(const char* name, test_param_fn func, const void* params, size_t param_size, int param_count);
+void register_param_test_toreg(TestRegistry *tr, const char* name, test_param_fn func, const void* params, size_t param_size, int param_count);
+// Functions to register fuzz targets
+void register_fuzz_test(const char* name, fuzz_fn func);
+void register_fuzz_test_toreg(TestRegistry *tr, const char* name, fuzz_fn func);
+// Functions to set timeouts for the last registered suite or test
+void set_test_timeout_toreg(TestRegistry *tr, int timeout_ms);
+void set_suite_timeout_toreg(TestRegistry *tr, int timeout_ms);
+// Function to mark the last registered test as unsafe to run in-process
+void set_test_unsafe_toreg(TestRegistry *tr, bool unsafe);
+// Functions to set the fixtures of the last registered suite
+void set_suite_fixture_toreg(TestRegistry *tr, fixture_setup_fn setup, fixture_teardown_fn teardown);
+void set_test_fixture_toreg(TestRegistry *tr, fixture_setup_fn setup, fixture_teardown_fn teardown);
+// Functions to register benchmarks
+void register_bench(const char* name, bench_fn func);
+void register_bench_toreg(TestRegistry *tr, const char* name, bench_fn func);
+// Function to release memory held by a registry
+void free_testregistry(TestRegistry *tr);
+// Function to expand parameterized tests into one test per case
+void expand_testregistry(TestRegistry *tr);
+// Functions to look up suites and tests by name
+void index_testregistry(TestRegistry *tr);
+bool lookup_testregistry(const TestRegistry *tr, const char* name, int* suite_idx, int* test_idx);
 // Function to run a single test (see also run_test_piped())
 int run_test(Test t);
+// Functions to check properties, and to draw their inputs
+int check_property(const char* name, prop_fn func, int iters);
+int64_t spz_gen_int(SpzProp* prop, int64_t min, int64_t max);
+size_t spz_gen_bytes(SpzProp* prop, unsigned char* buf, size_t max_len);
+size_t spz_gen_string(SpzProp* prop, char* buf, size_t max_len, const char* alphabet);
 // Functions to run all tests in a suite
 int run_suite(TestSuite suite, int piped);
 int run_suite_record(TestSuite suite, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix);
+int run_suite_ptr(const TestSuite* suite, int piped);
+int run_suite_record_ptr(const TestSuite* suite, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix);
 // Functions to run all tests in global SPZ_TEST_REGISTRY__
 int run_tests(int piped);
 int run_tests_record(int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix);
 // Functions to run all tests in a specific registry
 int run_testregistry(TestRegistry tr, int piped);
 int run_testregistry_record(TestRegistry tr, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix);
+int run_testregistry_ptr(const TestRegistry* tr, int piped);
+int run_testregistry_record_ptr(const TestRegistry* tr, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix);
+// Function to run the tests matching a list of names or patterns in a specific registry
+int run_testregistry_filter(const TestRegistry* tr, const char** filters, int filters_count, int piped);
+int list_testregistry(const TestRegistry* tr, const char** filters, int filters_count, bool json);
+// Functions to run benchmarks (see also run_bench())
+int run_benches(void);
+int run_benches_filter(const TestRegistry* tr, const char** filters, int filters_count);
+int run_benches_record_filter(const TestRegistry* tr, const char** filters, int filters_count, BenchMode mode, const char* bench_record_suffix);
+// Function to fuzz a target
+int fuzz_testregistry(const TestRegistry* tr, const char* name, const char* corpus_dir);
+// Function to parse runner options into global SPZ_RUN_OPTIONS__
+int spz_parse_args(int argc, char** argv);
 
 #ifndef SPZ_NOPIPE
 
+/**
+ * Represents the resources used by a piped test, from wait4() or getrusage().
+ * @see TestResult
+ */
+typedef struct TestUsage {
+    double wall_s; /**< Wall time from spawn to reap, in seconds.*/
+    double user_s; /**< User CPU time, in seconds.*/
+    double sys_s; /**< System CPU time, in seconds.*/
+    long max_rss_kb; /**< Max resident set size, in KiB.*/
+    long minor_faults; /**< Page faults served without I/O.*/
+    long major_faults; /**< Page faults requiring I/O.*/
+    long voluntary_switches; /**< Context switches from blocking.*/
+    long involuntary_switches; /**< Context switches from preemption.*/
+} TestUsage;
+
 /**
  * Represents the result of a run_test_piped() call.
  * @see run_test_piped
+ * @see TestUsage
  */
 typedef struct TestResult {
     int exit_code; /**< Exit code of the test.*/
     FILE *stdout_fp; /**< Pointer to temporary FILE used for test stdout.*/
     FILE *stderr_fp; /**< Pointer to temporary FILE used for test stderr.*/
     int signum; /**< Signal number that interrupted the test.*/
+    const char* stdout_buf; /**< Read-only mapping of the captured stdout, NULL when empty or until testresult_map().*/
+    size_t stdout_len; /**< Length of the captured stdout, once mapped.*/
+    const char* stderr_buf; /**< Read-only mapping of the captured stderr, NULL when empty or until testresult_map().*/
+    size_t stderr_len; /**< Length of the captured stderr, once mapped.*/
+    bool timed_out; /**< Set when the test was killed for running past its timeout.*/
+    TestUsage usage; /**< Resources used by the test, zero when unknown.*/
+    TestCounters counters; /**< Hardware counters of the test, when SPZ_RUN_OPTIONS__.perf is set.*/
+    bool cached; /**< Set when the test was not run, having passed with the same cache key.*/
+    bool setup_failed; /**< Set when the test was not run, the setup of its suite having failed.*/
 } TestResult;
 
+/**
+ * Releases the captured output of a TestResult, unmapping the buffers and
+ *  closing the FILE* fields.
+ * @see TestResult
+ * @param r The result to release.
+ */
+void testresult_close(TestResult* r);
+
+/**
+ * Maps the captured output of a TestResult into its stdout_buf and
+ *  stderr_buf fields, if not mapped yet. Results are not mapped when
+ *  created, so that passing tests never pay for it.
+ * @see TestResult
+ * @param r The result to map.
+ */
+void testresult_map(TestResult* r);
+
 /**
  * Run a Test while redirecting its stdout and stderr onto two tempfiles.
- * Caller must close result.stdout_fp and result.stderr_fp after.
+ * Caller must release the result with testresult_close() after.
  * @see Test
  * @see TestResult
  * @see run_test
@@ -407,13 +1232,87 @@ typedef TestResult CmdResult;
 
 /**
  * Run a cmd while redirecting its stdout and stderr onto two tempfiles.
- * Caller must close result.stdout_fp and result.stderr_fp after.
+ * Caller must release the result with testresult_close() after.
  * @see CmdResult
  * @see run_cmd
  * @param cmd The cmd to run.
  * @return The result of the test.
  */
-CmdResult run_cmd_piped(const char* cmd); // Caller must close CmdResult.stdout_fp and CmdResult.stderr_fp
+CmdResult run_cmd_piped(const char* cmd); // Caller must release CmdResult with testresult_close()
+
+/**
+ * Starts the fork server: a helper process, forked from the caller, which
+ *  then forks the children for piped tests run by suite and registry runs.
+ * Forking from a process which did not grow since startup keeps the cost of
+ *  each fork() low, no matter how big the runner gets.
+ * Call it right after registering tests. The server is stopped at exit.
+ * @see spz_fork_server_stop
+ * @return True if the server is running.
+ */
+bool spz_fork_server_start(void);
+
+/**
+ * Stops the fork server, if running, and waits for it to exit.
+ * @see spz_fork_server_start
+ */
+void spz_fork_server_stop(void);
+
+/**
+ * Defines the max number of TestReporter added with add_test_reporter().
+ */
+#ifndef SPZ_MAX_REPORTERS
+#define SPZ_MAX_REPORTERS 8
+#endif // SPZ_MAX_REPORTERS
+
+typedef struct TestReporter TestReporter;
+
+/**
+ * Represents a set of callbacks receiving the events of suite and registry
+ *  runs of piped tests, as they happen. Any callback can be NULL.
+ * Tests are reported in registration order, as soon as they are done and
+ *  before their captured output is released.
+ * @see add_test_reporter
+ */
+struct TestReporter {
+    void (*begin)(TestReporter* r, int tests); /**< Called once at the start of a run, with its number of tests.*/
+    void (*suite_begin)(TestReporter* r, const char* suite, int tests); /**< Called when a suite starts.*/
+    void (*test)(TestReporter* r, const char* suite, const Test* t, const TestResult* res); /**< Called when a test is done.*/
+    void (*suite_end)(TestReporter* r, const char* suite, int passed, int failed); /**< Called when a suite ends.*/
+    void (*end)(TestReporter* r, int failures); /**< Called once at the end of a run.*/
+    FILE* out; /**< Where the report is written.*/
+    void* ctx; /**< Free for use by the callbacks.*/
+    int count; /**< Tests reported in the current run, kept by the runner.*/
+};
+
+/**
+ * Adds a TestReporter to the ones used by suite and registry runs.
+ * @see TestReporter
+ * @param r The reporter to add.
+ * @return True on success, false when SPZ_MAX_REPORTERS are in use.
+ */
+bool add_test_reporter(TestReporter r);
+
+/**
+ * Returns a TestReporter writing JUnit XML to the passed FILE*.
+ * Suite elements carry no counts, so that the report is streamed.
+ */
+TestReporter spz_junit_reporter(FILE* out);
+
+/**
+ * Returns a TestReporter writing one JSON object per event to the passed FILE*.
+ */
+TestReporter spz_jsonl_reporter(FILE* out);
+
+/**
+ * Returns a TestReporter writing TAP version 13 to the passed FILE*.
+ */
+TestReporter spz_tap_reporter(FILE* out);
+
+/**
+ * Returns a TestReporter writing the duration of each test to the passed
+ *  FILE*, as read by SPZ_RUN_OPTIONS__.shard_durations.
+ */
+TestReporter spz_durations_reporter(FILE* out);
 #endif // SPZ_NOPIPE
 
 #ifndef SPZ_NOTIMER
@@ -464,7 +1363,18 @@ DumbTimer dt_new(void);
 double dt_elapsed(DumbTimer* dt);
 double dt_stop(DumbTimer* dt);
 #endif // DUMBTIMER_H_
-#endif // SPZ_NOTIMER
+
+/**
+ * Run a Bench, calibrating the iterations of each sample to
+ *  SPZ_BENCH_SAMPLE_MS, warming up for SPZ_BENCH_WARMUP_MS and then taking
+ *  SPZ_BENCH_SAMPLES samples.
+ * @see Bench
+ * @see BenchResult
+ * @param b The benchmark to run.
+ * @return The statistics of the samples.
+ */
+BenchResult run_bench(Bench b);
+#endif // SPZ_NOTIMER
 
 #endif // SUPOZI_H
 
@@ -477,6 +1387,47 @@ double dt_stop(DumbTimer* dt);
  */
 TestRegistry SPZ_TEST_REGISTRY__ = { .suites_count = -1, };
 
+/**
+ * Default global TestRunOptions.
+ * The jobs field starts from 1, so that piped tests run one at a time.
+ */
+TestRunOptions SPZ_RUN_OPTIONS__ = { .jobs = 1, .capture = SPZ_CAPTURE_MEMFD, .timeout_ms = SPZ_DEFAULT_TIMEOUT_MS, .bench_threshold = SPZ_BENCH_THRESHOLD, .slowest = SPZ_SLOWEST, .prop_iters = SPZ_PROP_ITERS, .fuzz_runs = SPZ_FUZZ_RUNS, .fuzz_max_len = SPZ_FUZZ_MAX_LEN, };
+
+/**
+ * Appends a Test to a TestSuite, growing its tests array when full.
+ * @see TestSuite
+ * @param suite The suite to add to.
+ * @param t The test to add.
+ * @return True on success, false if the array could not grow.
+ */
+static bool spz_suite_push_test(TestSuite* suite, Test t)
+{
+    if (suite->test_count == suite->tests_capacity) {
+        int new_capacity = (suite->tests_capacity > 0 ? suite->tests_capacity * 2 : SPZ_INITIAL_CAPACITY);
+        Test* new_tests = realloc(suite->tests, new_capacity * sizeof(Test));
+        if (!new_tests) {
+            return false;
+        }
+        suite->tests = new_tests;
+        suite->tests_capacity = new_capacity;
+    }
+    suite->tests[suite->test_count] = t;
+    suite->test_count++;
+    return true;
+}
+
+/**
+ * Drops the name index of a TestRegistry, which becomes stale on registration.
+ * @see index_testregistry
+ * @param tr The TestRegistry to update.
+ */
+static void spz_drop_index(TestRegistry *tr)
+{
+    free(tr->index);
+    tr->index = NULL;
+    tr->index_capacity = 0;
+}
+
 /**
  * Internal macro used to implement proper register_X_test_toreg functions for each test_fn kind.
  * Should be undefined by the implementation before the end of the
@@ -493,21 +1444,29 @@ TestRegistry SPZ_TEST_REGISTRY__ = { .suites_count = -1, };
  * @param func The actual test_fn function.
  */
 #define register_test(registry, test_type, name, func) do { \
+    if (registry->suites_count < 0) { \
+        fprintf(stderr, "%s(): can't accept {%s}, no suite registered\n", __func__, name); \
+        break; \
+    } \
     TestSuite* curr_suite = &(registry->suites[registry->suites_count]); \
     /* printf("%s(): Registering test {%s} to suite {%s}\n", __func__, name, curr_suite->name); */\
-    if (curr_suite->test_count < MAX_TESTS) { \
-        curr_suite->tests[curr_suite->test_count].type = _Generic(((test_type)0), \
-                void*: TEST_VOID, \
-                int: TEST_INT, \
-                bool: TEST_BOOL, \
-                default: TEST_VOID \
-                ); \
-        curr_suite->tests[curr_suite->test_count].func.test_type##_fn = func; \
-        curr_suite->tests[curr_suite->test_count].name = name; \
-        curr_suite->test_count++; \
-    } else { \
-        fprintf(stderr, "%s(): can't accept {%s}, suite {%s} is full\n", __func__, name, curr_suite->name); \
+    Test t = { \
+        .type = _Generic(((test_type)0), \
+            void*: TEST_VOID, \
+            int: TEST_INT, \
+            bool: TEST_BOOL, \
+            default: TEST_VOID \
+            ), \
+        .func.test_type##_fn = func, \
+        .name = name, \
+        .setup = curr_suite->test_setup, \
+        .teardown = curr_suite->test_teardown, \
+    }; \
+    if (!spz_suite_push_test(curr_suite, t)) { \
+        fprintf(stderr, "%s(): can't accept {%s}, failed growing suite {%s}\n", __func__, name, curr_suite->name); \
+        break; \
     } \
+    spz_drop_index(registry); \
 } while (0)
 
 /**
@@ -582,20 +1541,502 @@ void register_int_test(const char* name, test_int_fn func) {
     register_int_test_toreg(&SPZ_TEST_REGISTRY__, name, func);
 }
 
+/**
+ * Registers a parameterized test to the passed TestRegistry, as a single
+ *  Test running all of its cases until expand_testregistry() is called.
+ * @see TestRegistry
+ * @see test_param_fn
+ * @see expand_testregistry
+ * @param tr The TestRegistry to add to.
+ * @param name The name for the test.
+ * @param func The actual test function.
+ * @param params The table of cases, or NULL to only pass the index.
+ * @param param_size The size of each case of the table.
+ * @param param_count The number of cases.
+ */
+void register_param_test_toreg(TestRegistry *tr, const char* name, test_param_fn func, const void* params, size_t param_size, int param_count) {
+    if (tr->suites_count < 0) {
+        fprintf(stderr, "%s(): can't accept {%s}, no suite registered\n", __func__, name);
+        return;
+    }
+    if (param_count < 0) {
+        fprintf(stderr, "%s(): can't accept {%s}, negative case count {%i}\n", __func__, name, param_count);
+        return;
+    }
+    TestSuite* curr_suite = &tr->suites[tr->suites_count];
+    Test t = {
+        .type = TEST_PARAMETERIZED,
+        .func.param_fn = func,
+        .name = name,
+        .setup = curr_suite->test_setup,
+        .teardown = curr_suite->test_teardown,
+        .params = params,
+        .param_size = param_size,
+        .param_count = param_count,
+    };
+    if (!spz_suite_push_test(curr_suite, t)) {
+        fprintf(stderr, "%s(): can't accept {%s}, failed growing suite {%s}\n", __func__, name, curr_suite->name);
+        return;
+    }
+    spz_drop_index(tr);
+}
+
+/**
+ * Registers a parameterized test to the default global TestRegistry.
+ * @see TestRegistry
+ * @see SPZ_TEST_REGISTRY__
+ * @see register_param_test_toreg
+ */
+void register_param_test(const char* name, test_param_fn func, const void* params, size_t param_size, int param_count) {
+    register_param_test_toreg(&SPZ_TEST_REGISTRY__, name, func, params, param_size, param_count);
+}
+
+/**
+ * Registers a fuzz target to the passed TestRegistry.
+ * @see TestRegistry
+ * @see FUZZ
+ * @param tr The TestRegistry to add to.
+ * @param name The name for the target.
+ * @param func The actual fuzz target.
+ */
+void register_fuzz_test_toreg(TestRegistry *tr, const char* name, fuzz_fn func) {
+    if (tr->suites_count < 0) {
+        fprintf(stderr, "%s(): can't accept {%s}, no suite registered\n", __func__, name);
+        return;
+    }
+    TestSuite* curr_suite = &tr->suites[tr->suites_count];
+    Test t = {
+        .type = TEST_FUZZ,
+        .func.fuzz_fn = func,
+        .name = name,
+        .setup = curr_suite->test_setup,
+        .teardown = curr_suite->test_teardown,
+    };
+    if (!spz_suite_push_test(curr_suite, t)) {
+        fprintf(stderr, "%s(): can't accept {%s}, failed growing suite {%s}\n", __func__, name, curr_suite->name);
+        return;
+    }
+    spz_drop_index(tr);
+}
+
+/**
+ * Registers a fuzz target to the default global TestRegistry.
+ * @see TestRegistry
+ * @see SPZ_TEST_REGISTRY__
+ * @see register_fuzz_test_toreg
+ */
+void register_fuzz_test(const char* name, fuzz_fn func) {
+    register_fuzz_test_toreg(&SPZ_TEST_REGISTRY__, name, func);
+}
+
 /**
  * Registers a new TestSuite to the passed TestRegistry.
+ * A zero-initialized TestRegistry is taken as empty.
  * @see TestRegistry
  * @see TestSuite
  * @param tr The TestRegistry to add to.
  * @param name The name for the suite.
  */
 void register_test_suite_toreg(TestRegistry *tr, const char* name) {
-    if (tr->suites_count < MAX_SUITES) {
-        tr->suites_count++;
-        tr->suites[tr->suites_count].name = name;
-    } else {
-        fprintf(stderr, "%s(): can't accept suite {%s}, registry is full\n", __func__, name);
+    if (!tr->suites) {
+        tr->suites_count = -1;
+        tr->suites_capacity = 0;
+    }
+    if (tr->suites_count+1 >= tr->suites_capacity) {
+        int new_capacity = (tr->suites_capacity > 0 ? tr->suites_capacity * 2 : SPZ_INITIAL_CAPACITY);
+        TestSuite* new_suites = realloc(tr->suites, new_capacity * sizeof(TestSuite));
+        if (!new_suites) {
+            fprintf(stderr, "%s(): can't accept suite {%s}, failed growing registry\n", __func__, name);
+            return;
+        }
+        tr->suites = new_suites;
+        tr->suites_capacity = new_capacity;
+    }
+    tr->suites_count++;
+    tr->suites[tr->suites_count] = (TestSuite) {
+        .name = name,
+    };
+    spz_drop_index(tr);
+}
+
+/**
+ * Sets the timeout of the last test registered to the passed TestRegistry.
+ * @see Test
+ * @see REGISTER_TEST_TIMEOUT_TOREG
+ * @param tr The TestRegistry to update.
+ * @param timeout_ms The timeout in milliseconds, 0 to inherit the one of the suite, negative for none.
+ */
+void set_test_timeout_toreg(TestRegistry *tr, int timeout_ms) {
+    if (tr->suites_count < 0 || tr->suites[tr->suites_count].test_count == 0) {
+        fprintf(stderr, "%s(): no test registered\n", __func__);
+        return;
+    }
+    TestSuite* curr_suite = &tr->suites[tr->suites_count];
+    curr_suite->tests[curr_suite->test_count-1].timeout_ms = timeout_ms;
+}
+
+/**
+ * Marks the last test registered to the passed TestRegistry as unsafe, so
+ *  that it's forked even when TestRunOptions.in_process is set.
+ * @see Test
+ * @see REGISTER_UNSAFE_TEST_TOREG
+ * @param tr The TestRegistry to update.
+ * @param unsafe True to always fork the test.
+ */
+void set_test_unsafe_toreg(TestRegistry *tr, bool unsafe) {
+    if (tr->suites_count < 0 || tr->suites[tr->suites_count].test_count == 0) {
+        fprintf(stderr, "%s(): no test registered\n", __func__);
+        return;
+    }
+    TestSuite* curr_suite = &tr->suites[tr->suites_count];
+    curr_suite->tests[curr_suite->test_count-1].unsafe = unsafe;
+}
+
+/**
+ * Sets the timeout of the last suite registered to the passed TestRegistry.
+ * @see TestSuite
+ * @see REGISTER_SUITE_TIMEOUT_TOREG
+ * @param tr The TestRegistry to update.
+ * @param timeout_ms The timeout in milliseconds, 0 to inherit the one from TestRunOptions, negative for none.
+ */
+void set_suite_timeout_toreg(TestRegistry *tr, int timeout_ms) {
+    if (tr->suites_count < 0) {
+        fprintf(stderr, "%s(): no suite registered\n", __func__);
+        return;
+    }
+    tr->suites[tr->suites_count].timeout_ms = timeout_ms;
+}
+
+/**
+ * Sets the suite fixture of the last suite registered to the passed TestRegistry.
+ * @see TestSuite
+ * @see REGISTER_SUITE_FIXTURE_TOREG
+ * @param tr The TestRegistry to update.
+ * @param setup Run once before the tests of the suite, NULL for none.
+ * @param teardown Run once after the tests of the suite, NULL for none.
+ */
+void set_suite_fixture_toreg(TestRegistry *tr, fixture_setup_fn setup, fixture_teardown_fn teardown) {
+    if (tr->suites_count < 0) {
+        fprintf(stderr, "%s(): no suite registered\n", __func__);
+        return;
+    }
+    tr->suites[tr->suites_count].setup = setup;
+    tr->suites[tr->suites_count].teardown = teardown;
+}
+
+/**
+ * Sets the per-test fixture of the last suite registered to the passed
+ *  TestRegistry, for the tests it already holds and the ones registered next.
+ * @see Test
+ * @see REGISTER_TEST_FIXTURE_TOREG
+ * @param tr The TestRegistry to update.
+ * @param setup Run before each test of the suite, NULL for none.
+ * @param teardown Run after each test of the suite, NULL for none.
+ */
+void set_test_fixture_toreg(TestRegistry *tr, fixture_setup_fn setup, fixture_teardown_fn teardown) {
+    if (tr->suites_count < 0) {
+        fprintf(stderr, "%s(): no suite registered\n", __func__);
+        return;
+    }
+    TestSuite* curr_suite = &tr->suites[tr->suites_count];
+    curr_suite->test_setup = setup;
+    curr_suite->test_teardown = teardown;
+    for (int i = 0; i < curr_suite->test_count; i++) {
+        curr_suite->tests[i].setup = setup;
+        curr_suite->tests[i].teardown = teardown;
+    }
+}
+
+/**
+ * Releases all memory held by the passed TestRegistry, leaving it empty.
+ * @see TestRegistry
+ * @param tr The TestRegistry to free.
+ */
+void free_testregistry(TestRegistry *tr) {
+    if (!tr) return;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        free(tr->suites[i].tests);
+        free(tr->suites[i].benches);
+        free(tr->suites[i].case_names);
+    }
+    free(tr->suites);
+    tr->suites = NULL;
+    tr->suites_count = -1;
+    tr->suites_capacity = 0;
+    spz_drop_index(tr);
+}
+
+/**
+ * Starting value of a 64-bit FNV-1a hash, to pass to spz_hash_bytes().
+ */
+#define SPZ_FNV_OFFSET 0xcbf29ce484222325ULL
+
+/**
+ * Mixes a buffer into a 64-bit FNV-1a hash. All the hashes of names,
+ *  lines, cache keys and fuzz inputs are built with it.
+ * @see SPZ_FNV_OFFSET
+ * @param hash The hash so far, SPZ_FNV_OFFSET for a new one.
+ * @param data The buffer.
+ * @param len The length of the buffer.
+ * @return The new hash.
+ */
+static inline uint64_t spz_hash_bytes(uint64_t hash, const void* data, size_t len)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * Hashes a suite name, or a SUITE::TEST name when test_name is not NULL,
+ *  using 64-bit FNV-1a. The result is the same as hashing the formatted
+ *  "SUITE::TEST" string, without formatting it. It only depends on the
+ *  names, so it is stable across builds and machines, and is also used for
+ *  test IDs and sharding.
+ * @param suite_name The name of the suite.
+ * @param test_name The name of the test, or NULL.
+ * @return The hash of the name.
+ */
+static inline uint64_t spz_name_hash(const char* suite_name, const char* test_name)
+{
+    uint64_t hash = spz_hash_bytes(SPZ_FNV_OFFSET, suite_name, strlen(suite_name));
+    if (test_name) {
+        hash = spz_hash_bytes(hash, "::", 2);
+        hash = spz_hash_bytes(hash, test_name, strlen(test_name));
+    }
+    return hash;
+}
+
+/**
+ * Checks if a name refers to the passed suite, or to SUITE::TEST when
+ *  test_idx is not -1, without formatting the candidate name.
+ * @param tr The TestRegistry holding the suite.
+ * @param name The name to check.
+ * @param suite_idx Index of the suite.
+ * @param test_idx Index of the test, or -1.
+ * @return True if the name matches.
+ */
+static bool spz_name_matches(const TestRegistry *tr, const char* name, int suite_idx, int test_idx)
+{
+    const TestSuite* suite = &tr->suites[suite_idx];
+    if (test_idx == -1) {
+        return !strcmp(name, suite->name);
+    }
+    size_t suite_len = strlen(suite->name);
+    return (!strncmp(name, suite->name, suite_len)
+            && name[suite_len] == ':' && name[suite_len+1] == ':'
+            && !strcmp(name + suite_len + 2, suite->tests[test_idx].name));
+}
+
+/**
+ * Inserts an entry in the name index of a TestRegistry, using linear probing.
+ * Entries inserted first are found first, so earlier registrations win.
+ * @see index_testregistry
+ */
+static void spz_index_insert(TestRegistry *tr, uint64_t hash, int suite_idx, int test_idx)
+{
+    size_t mask = tr->index_capacity - 1;
+    size_t slot = hash & mask;
+    while (tr->index[slot].suite_idx != -1) {
+        slot = (slot + 1) & mask;
+    }
+    tr->index[slot] = (TestIndexEntry) {
+        .hash = hash,
+        .suite_idx = suite_idx,
+        .test_idx = test_idx,
+    };
+}
+
+/**
+ * Replaces each parameterized test of a TestRegistry with one Test per case,
+ *  named TEST/IDX, so that cases are run, reported and selected on their
+ *  own. Cases only cost a Test and a name at run time, with all their names
+ *  held in a single allocation per suite.
+ * Should be called once after all tests are registered, before
+ *  index_testregistry(). Suites already expanded are skipped.
+ * @see TEST_PARAM
+ * @see index_testregistry
+ * @param tr The TestRegistry to expand.
+ */
+void expand_testregistry(TestRegistry *tr) {
+    if (!tr) return;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        TestSuite* suite = &tr->suites[i];
+        if (suite->case_names) continue;
+        int param_tests = 0;
+        size_t cases = 0;
+        size_t names_size = 0;
+        for (int j = 0; j < suite->test_count; j++) {
+            const Test* t = &suite->tests[j];
+            if (t->type != TEST_PARAMETERIZED) continue;
+            param_tests++;
+            cases += t->param_count;
+            /* Room for the name, a slash, up to 10 digits and the terminator */
+            names_size += (size_t) t->param_count * (strlen(t->name) + 12);
+        }
+        if (param_tests == 0) continue;
+        size_t count = suite->test_count - param_tests + cases;
+        if (count > INT32_MAX) {
+            fprintf(stderr, "%s(): can't expand suite {%s}, too many cases\n", __func__, suite->name);
+            continue;
+        }
+        Test* tests = malloc((count > 0 ? count : 1) * sizeof(Test));
+        char* names = malloc(names_size > 0 ? names_size : 1);
+        if (!tests || !names) {
+            perror("failed expanding parameterized tests");
+            exit(EXIT_FAILURE);
+        }
+        size_t next = 0;
+        char* name = names;
+        for (int j = 0; j < suite->test_count; j++) {
+            const Test* t = &suite->tests[j];
+            if (t->type != TEST_PARAMETERIZED) {
+                tests[next++] = *t;
+                continue;
+            }
+            for (int k = 0; k < t->param_count; k++) {
+                Test c = *t;
+                c.params = (t->params ? (const char*) t->params + (size_t) k * t->param_size : NULL);
+                c.param_count = 1;
+                c.param_idx = t->param_idx + k;
+                int len = sprintf(name, "%s/%i", t->name, c.param_idx);
+                c.name = name;
+                name += len + 1;
+                tests[next++] = c;
+            }
+        }
+        free(suite->tests);
+        suite->tests = tests;
+        suite->test_count = (int) count;
+        suite->tests_capacity = (int) (count > 0 ? count : 1);
+        suite->case_names = names;
+    }
+    spz_drop_index(tr);
+}
+
+/**
+ * Builds the name index of a TestRegistry, used by lookup_testregistry().
+ * Should be called once after all tests are registered, since any new
+ *  registration drops the index.
+ * @see TestRegistry
+ * @see lookup_testregistry
+ * @param tr The TestRegistry to index.
+ */
+void index_testregistry(TestRegistry *tr) {
+    if (!tr) return;
+    spz_drop_index(tr);
+    size_t entries = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        entries += 1 + tr->suites[i].test_count;
+    }
+    size_t capacity = SPZ_INITIAL_CAPACITY;
+    while (capacity < entries * 2) {
+        capacity *= 2;
+    }
+    tr->index = malloc(capacity * sizeof(TestIndexEntry));
+    if (!tr->index) {
+        fprintf(stderr, "%s(): failed allocating index, lookups will scan the registry\n", __func__);
+        return;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        tr->index[i].suite_idx = -1;
+    }
+    tr->index_capacity = capacity;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        const TestSuite* suite = &tr->suites[i];
+        spz_index_insert(tr, spz_name_hash(suite->name, NULL), i, -1);
+        for (int j = 0; j < suite->test_count; j++) {
+            spz_index_insert(tr, spz_name_hash(suite->name, suite->tests[j].name), i, j);
+        }
+    }
+}
+
+/**
+ * Looks up a SUITE or SUITE::TEST name in a TestRegistry.
+ * Uses the index built by index_testregistry() when available, and falls
+ *  back to scanning the registry otherwise.
+ * @see index_testregistry
+ * @param tr The TestRegistry to search.
+ * @param name The name to look up.
+ * @param suite_idx Set to the index of the found suite.
+ * @param test_idx Set to the index of the found test, or -1 when name is a suite.
+ * @return True if the name was found.
+ */
+bool lookup_testregistry(const TestRegistry *tr, const char* name, int* suite_idx, int* test_idx) {
+    if (!tr || !name || !suite_idx || !test_idx) return false;
+    if (tr->index) {
+        uint64_t hash = spz_name_hash(name, NULL);
+        size_t mask = tr->index_capacity - 1;
+        for (size_t slot = hash & mask; tr->index[slot].suite_idx != -1; slot = (slot + 1) & mask) {
+            const TestIndexEntry* entry = &tr->index[slot];
+            if (entry->hash == hash && spz_name_matches(tr, name, entry->suite_idx, entry->test_idx)) {
+                *suite_idx = entry->suite_idx;
+                *test_idx = entry->test_idx;
+                return true;
+            }
+        }
+        return false;
+    }
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        if (spz_name_matches(tr, name, i, -1)) {
+            *suite_idx = i;
+            *test_idx = -1;
+            return true;
+        }
+        for (int j = 0; j < tr->suites[i].test_count; j++) {
+            if (spz_name_matches(tr, name, i, j)) {
+                *suite_idx = i;
+                *test_idx = j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * Registers a bench_fn to the passed TestRegistry.
+ * @see TestRegistry
+ * @see Bench
+ * @param tr The TestRegistry to add to.
+ * @param name The name for the benchmark.
+ * @param func The actual benchmark function.
+ */
+void register_bench_toreg(TestRegistry *tr, const char* name, bench_fn func) {
+    if (tr->suites_count < 0) {
+        fprintf(stderr, "%s(): can't accept {%s}, no suite registered\n", __func__, name);
+        return;
+    }
+    TestSuite* curr_suite = &tr->suites[tr->suites_count];
+    if (curr_suite->bench_count == curr_suite->benches_capacity) {
+        int new_capacity = (curr_suite->benches_capacity > 0 ? curr_suite->benches_capacity * 2 : SPZ_INITIAL_CAPACITY);
+        Bench* new_benches = realloc(curr_suite->benches, new_capacity * sizeof(Bench));
+        if (!new_benches) {
+            fprintf(stderr, "%s(): can't accept {%s}, failed growing suite {%s}\n", __func__, name, curr_suite->name);
+            return;
+        }
+        curr_suite->benches = new_benches;
+        curr_suite->benches_capacity = new_capacity;
     }
+    curr_suite->benches[curr_suite->bench_count] = (Bench) {
+        .func = func,
+        .name = name,
+    };
+    curr_suite->bench_count++;
+}
+
+/**
+ * Registers a bench_fn to the default global TestRegistry.
+ * @see TestRegistry
+ * @see SPZ_TEST_REGISTRY__
+ * @param name The name for the benchmark.
+ * @param func The actual benchmark function.
+ */
+void register_bench(const char* name, bench_fn func) {
+    register_bench_toreg(&SPZ_TEST_REGISTRY__, name, func);
 }
 
 /**
@@ -609,9 +2050,95 @@ void register_test_suite(const char* name) {
     register_test_suite_toreg(&SPZ_TEST_REGISTRY__, name);
 }
 
+#ifndef SPZ_NOPIPE
+/**
+ * Reads a whole regular file into a new buffer.
+ * @param path The file to read.
+ * @param len Set to the length of the file.
+ * @return The contents, to free, or NULL when the file can't be read.
+ */
+static unsigned char* spz_read_file(const char* path, size_t* len)
+{
+    *len = 0;
+    FILE* fp = fopen(path, "rb");
+    if (!fp) return NULL;
+    struct stat st = {0};
+    if (fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode)) {
+        fclose(fp);
+        return NULL;
+    }
+    unsigned char* buf = malloc(st.st_size > 0 ? (size_t) st.st_size : 1);
+    if (!buf) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    *len = fread(buf, 1, st.st_size, fp);
+    fclose(fp);
+    return buf;
+}
+
+/**
+ * Formats the path of a file of a corpus directory.
+ * @param pathbuf The buffer to fill.
+ * @param size The size of the buffer.
+ * @param dir The corpus directory.
+ * @param file The name of the file.
+ * @return false when the path does not fit.
+ */
+static bool spz_corpus_path(char* pathbuf, size_t size, const char* dir, const char* file)
+{
+    int len = snprintf(pathbuf, size, "%s%s%s", dir, SPZ_PATH_SEPARATOR, file);
+    return (len >= 0 && (size_t) len < size);
+}
+
+/**
+ * Used by scandir() to skip hidden entries of corpus directories.
+ */
+static int spz_corpus_entry(const struct dirent* entry)
+{
+    return entry->d_name[0] != '.';
+}
+#endif // SPZ_NOPIPE
+
+/**
+ * Runs a fuzz target on the empty input and on each file of its corpus
+ *  directory, in the current directory.
+ * @see FUZZ
+ * @param t The fuzz target.
+ * @return 0 when all inputs are accepted, 1 otherwise.
+ */
+static int spz_fuzz_replay(Test t)
+{
+    int res = (t.func.fuzz_fn((const uint8_t*) "", 0) ? 0 : 1);
+#ifndef SPZ_NOPIPE
+    char dirbuf[FILENAME_MAX] = {0};
+    snprintf(dirbuf, sizeof(dirbuf), ".%s%s%s", SPZ_PATH_SEPARATOR, t.name, SPZ_FUZZ_SUFFIX);
+    struct dirent** entries = NULL;
+    int count = scandir(dirbuf, &entries, &spz_corpus_entry, &alphasort);
+    for (int i = 0; i < count; i++) {
+        char pathbuf[FILENAME_MAX] = {0};
+        size_t len = 0;
+        unsigned char* data = NULL;
+        if (spz_corpus_path(pathbuf, sizeof(pathbuf), dirbuf, entries[i]->d_name)) {
+            data = spz_read_file(pathbuf, &len);
+        }
+        if (data && !t.func.fuzz_fn(data, len)) {
+            fprintf(stderr, "%s(): fuzz target {%s} failed on {%s}\n", __func__, t.name, pathbuf);
+            res = 1;
+        }
+        free(data);
+        free(entries[i]);
+    }
+    free(entries);
+#endif // SPZ_NOPIPE
+    return res;
+}
+
 /**
  * Run a Test. Checks inner type field to dispatch the proper function pointer
  *  in the test_fn union.
+ * The per-test fixture runs around the call. When its setup fails the test
+ *  is not called and fails, while the teardown still runs.
  * @see Test
  * @see test_fn
  * @param t The test to run.
@@ -619,6 +2146,11 @@ void register_test_suite(const char* name) {
  */
 int run_test(Test t) {
     int res = 0;
+    if (t.setup && !t.setup()) {
+        fprintf(stderr, "%s(): setup of test {%s} failed\n", __func__, t.name);
+        if (t.teardown) t.teardown();
+        return 1;
+    }
     switch (t.type) {
         case TEST_VOID: {
             t.func.void_fn();
@@ -634,48 +2166,604 @@ int run_test(Test t) {
             res = !bres;
         }
         break;
+        case TEST_PARAMETERIZED: {
+            /* Tests not expanded yet run all their cases, failing if any does */
+            for (int i = 0; i < t.param_count; i++) {
+                const void* param = (t.params ? (const char*) t.params + (size_t) i * t.param_size : NULL);
+                if (!t.func.param_fn(param, t.param_idx + i)) {
+                    res = 1;
+                }
+            }
+        }
+        break;
+        case TEST_FUZZ: {
+            res = spz_fuzz_replay(t);
+        }
+        break;
         default: {
 
         }
         break;
     }
+    if (t.teardown) t.teardown();
     return res;
 }
 
-#ifndef SPZ_NOPIPE
-static inline int spz_call_cmd(const char* x) {
-    return execlp(x, x, (char*) NULL);
-}
-
-static inline int spz_call_test(Test x) {
-    return run_test(x);
+/**
+ * Advances a splitmix64 state, returning the next random value.
+ * @param state The state to advance.
+ * @return The next value.
+ */
+static inline uint64_t spz_rand_next(uint64_t* state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
 }
 
-#define log_err(...) fprintf(stderr, __VA_ARGS__)
-
-struct TempFile {
-    FILE* tmp;
+/**
+ * Holds the state of a property check, not exported in the header.
+ * Generators build their values from a sequence of choices, drawn at random
+ *  when generating, and replayed from a recorded sequence when shrinking.
+ *  Shrinking works the same for all generators, by deleting choices and
+ *  making them smaller, and smaller choices always mean simpler values.
+ * @see check_property
+ */
+struct SpzProp {
+    uint64_t rng; /**< State of the random generator.*/
+    const uint64_t* replay; /**< Choices to replay, NULL when generating.*/
+    int replay_count; /**< Number of choices to replay, the ones after them are 0.*/
+    int replay_pos; /**< Index of the next choice to replay.*/
+    uint64_t* choices; /**< Choices made by the current call, after clamping.*/
+    int count; /**< Number of choices made.*/
+    int capacity; /**< Number of choices fitting in the array.*/
+    bool print; /**< When true, generators print the values they return.*/
 };
 
-typedef struct TempFile TempFile;
+/**
+ * Makes a choice in [0, max], taking the passed random value when
+ *  generating, or the next replayed one, and records it.
+ * @param prop The property check.
+ * @param max The largest valid choice.
+ * @param value The random choice, used when generating.
+ * @return The choice.
+ */
+static uint64_t spz_prop_choice(SpzProp* prop, uint64_t max, uint64_t value)
+{
+    if (prop->replay) {
+        value = (prop->replay_pos < prop->replay_count ? prop->replay[prop->replay_pos++] : 0);
+    }
+    if (value > max) value = max;
+    if (prop->count == prop->capacity) {
+        int new_capacity = (prop->capacity > 0 ? prop->capacity * 2 : SPZ_INITIAL_CAPACITY);
+        uint64_t* new_choices = realloc(prop->choices, new_capacity * sizeof(uint64_t));
+        if (!new_choices) {
+            perror("failed growing property choices");
+            exit(EXIT_FAILURE);
+        }
+        prop->choices = new_choices;
+        prop->capacity = new_capacity;
+    }
+    prop->choices[prop->count++] = value;
+    return value;
+}
 
-static inline TempFile tempfile_new(void)
+/**
+ * Draws a random value in [0, max], biased towards 0, small values and max
+ *  to hit edge cases more often.
+ * @param prop The property check.
+ * @param max The largest value.
+ * @return The value.
+ */
+static uint64_t spz_prop_random(SpzProp* prop, uint64_t max)
 {
-    TempFile res = {0};
-    FILE* tmp = tmpfile();
+    switch (spz_rand_next(&prop->rng) & 15) {
+        case 0: return 0;
+        case 1: return max;
+        case 2: return spz_rand_next(&prop->rng) % (max < 16 ? max + 1 : 17);
+    }
+    uint64_t r = spz_rand_next(&prop->rng);
+    return (max == UINT64_MAX ? r : r % (max + 1));
+}
 
-    if (tmp) {
-        res.tmp = tmp;
-    } else {
-        fprintf(stderr, "Failed creating temp file\n");
-        switch(errno) {
-            case EACCES: {
-                log_err("Permission denied\n");
+/**
+ * Draws an int in [min, max]. Values shrink towards 0, or towards the bound
+ *  closest to it when 0 is out of range. When the range spans both sides of
+ *  the origin, a first choice picks the side, and shrinks towards the upper
+ *  one, so that the distance from the origin shrinks on its own.
+ * @see PROPERTY
+ * @param prop The property check.
+ * @param min The smallest value.
+ * @param max The largest value.
+ * @return The value.
+ */
+int64_t spz_gen_int(SpzProp* prop, int64_t min, int64_t max)
+{
+    if (min > max) {
+        fprintf(stderr, "%s(): empty range [%lld, %lld]\n", __func__, (long long) min, (long long) max);
+        return min;
+    }
+    int64_t origin = (min > 0 ? min : (max < 0 ? max : 0));
+    uint64_t up = (uint64_t) max - (uint64_t) origin;
+    uint64_t down = (uint64_t) origin - (uint64_t) min;
+    bool below = (up == 0 || (down > 0 && spz_prop_choice(prop, 1, spz_rand_next(&prop->rng) & 1)));
+    uint64_t side = (below ? down : up);
+    uint64_t d = spz_prop_choice(prop, side, spz_prop_random(prop, side));
+    int64_t res = (int64_t) (below ? (uint64_t) origin - d : (uint64_t) origin + d);
+    if (prop->print) {
+        printf("    int: %lld\n", (long long) res);
+    }
+    return res;
+}
 
-            }
-            break;
-            case EEXIST: {
-                log_err("Unable to generate a unique filename\n");
+/**
+ * Draws a byte buffer of up to max_len bytes. Buffers shrink towards fewer
+ *  bytes, and bytes towards 0.
+ * @see PROPERTY
+ * @param prop The property check.
+ * @param buf Filled with the bytes, must hold max_len bytes.
+ * @param max_len The max number of bytes.
+ * @return The number of bytes.
+ */
+size_t spz_gen_bytes(SpzProp* prop, unsigned char* buf, size_t max_len)
+{
+    /* A continue flag before each byte lets shrinking drop bytes anywhere */
+    size_t target = (size_t) spz_prop_random(prop, max_len);
+    size_t len = 0;
+    while (len < max_len && spz_prop_choice(prop, 1, len < target)) {
+        buf[len++] = (unsigned char) spz_prop_choice(prop, 255, spz_prop_random(prop, 255));
+    }
+    if (prop->print) {
+        printf("    bytes[%zu]:", len);
+        for (size_t i = 0; i < len; i++) {
+            printf(" %02x", buf[i]);
+        }
+        printf("\n");
+    }
+    return len;
+}
+
+/**
+ * Draws a string of up to max_len characters from an alphabet. Strings
+ *  shrink towards fewer characters, and characters towards the start of the
+ *  alphabet.
+ * @see PROPERTY
+ * @see SPZ_PROP_ALPHABET
+ * @param prop The property check.
+ * @param buf Filled with the string, must hold max_len + 1 chars.
+ * @param max_len The max number of characters.
+ * @param alphabet The characters to draw, NULL for SPZ_PROP_ALPHABET.
+ * @return The length of the string.
+ */
+size_t spz_gen_string(SpzProp* prop, char* buf, size_t max_len, const char* alphabet)
+{
+    if (!alphabet || !*alphabet) {
+        alphabet = SPZ_PROP_ALPHABET;
+    }
+    uint64_t last = strlen(alphabet) - 1;
+    size_t target = (size_t) spz_prop_random(prop, max_len);
+    size_t len = 0;
+    while (len < max_len && spz_prop_choice(prop, 1, len < target)) {
+        buf[len++] = alphabet[spz_prop_choice(prop, last, spz_prop_random(prop, last))];
+    }
+    buf[len] = '\0';
+    if (prop->print) {
+        printf("    string[%zu]: \"", len);
+        for (size_t i = 0; i < len; i++) {
+            unsigned char c = buf[i];
+            if (c == '"' || c == '\\') {
+                printf("\\%c", c);
+            } else if (c >= 0x20 && c < 0x7f) {
+                putchar(c);
+            } else {
+                printf("\\x%02x", c);
+            }
+        }
+        printf("\"\n");
+    }
+    return len;
+}
+
+/**
+ * Replays a sequence of choices, keeping the choices made when the property
+ *  still fails with them and they are simpler than the best ones: fewer, or
+ *  as many and smaller in order.
+ * @param prop The property check.
+ * @param func The property.
+ * @param cand The choices to replay.
+ * @param count The number of choices to replay.
+ * @param best The simplest failing choices, updated.
+ * @param best_count The number of simplest failing choices, updated.
+ * @return True when the best choices were updated.
+ */
+static bool spz_prop_shrink_try(SpzProp* prop, prop_fn func, const uint64_t* cand, int count, uint64_t* best, int* best_count)
+{
+    prop->replay = cand;
+    prop->replay_count = count;
+    prop->replay_pos = 0;
+    prop->count = 0;
+    if (func(prop)) return false;
+    if (prop->count > *best_count) return false;
+    if (prop->count == *best_count) {
+        int i = 0;
+        while (i < prop->count && prop->choices[i] == best[i]) i++;
+        if (i == prop->count || prop->choices[i] > best[i]) return false;
+    }
+    memcpy(best, prop->choices, prop->count * sizeof(uint64_t));
+    *best_count = prop->count;
+    return true;
+}
+
+/**
+ * Checks a property against random inputs, stopping at the first failing
+ *  one, which is then shrunk to a simpler input still failing and printed.
+ * Each input gets its own random state, derived from SPZ_RUN_OPTIONS__.seed,
+ *  the name of the property and the index of the input, so that a failure
+ *  can be replayed with the printed --seed.
+ * All inputs are checked in the calling process, so a piped property costs a
+ *  single fork. A property crashing ends the test without shrinking, but the
+ *  seed still replays it.
+ * @see PROPERTY
+ * @see SPZ_PROP_SHRINK_RUNS
+ * @param name The name of the property.
+ * @param func The property.
+ * @param iters The number of inputs, <= 0 to use SPZ_RUN_OPTIONS__.prop_iters.
+ * @return 0 when the property held for all inputs, 1 otherwise.
+ */
+int check_property(const char* name, prop_fn func, int iters)
+{
+    if (iters <= 0) {
+        iters = SPZ_RUN_OPTIONS__.prop_iters;
+    }
+    uint64_t seed = SPZ_RUN_OPTIONS__.seed ^ spz_name_hash(name, NULL);
+    SpzProp prop = {0};
+    int failed_at = -1;
+    for (int i = 0; i < iters && failed_at == -1; i++) {
+        uint64_t state = seed + i;
+        prop.rng = spz_rand_next(&state);
+        prop.count = 0;
+        if (!func(&prop)) {
+            failed_at = i;
+        }
+    }
+    if (failed_at == -1) {
+        free(prop.choices);
+        return 0;
+    }
+    int best_count = prop.count;
+    uint64_t* best = malloc((best_count > 0 ? best_count : 1) * sizeof(uint64_t));
+    uint64_t* cand = malloc((best_count > 0 ? best_count : 1) * sizeof(uint64_t));
+    if (!best || !cand) {
+        perror("failed allocating property choices");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(best, prop.choices, best_count * sizeof(uint64_t));
+    int runs = 0;
+    int shrinks = 0;
+    bool improved = true;
+    while (improved && runs < SPZ_PROP_SHRINK_RUNS) {
+        improved = false;
+        /* Delete runs of choices, from the end */
+        for (int k = 8; k >= 1; k /= 2) {
+            for (int i = best_count - k; i >= 0 && runs < SPZ_PROP_SHRINK_RUNS; i--) {
+                if (i + k > best_count) continue;
+                memcpy(cand, best, i * sizeof(uint64_t));
+                memcpy(cand + i, best + i + k, (best_count - i - k) * sizeof(uint64_t));
+                runs++;
+                if (spz_prop_shrink_try(&prop, func, cand, best_count - k, best, &best_count)) {
+                    improved = true;
+                    shrinks++;
+                }
+            }
+        }
+        /* Binary search the smallest value of each choice still failing */
+        for (int i = 0; i < best_count && runs < SPZ_PROP_SHRINK_RUNS; i++) {
+            uint64_t lo = 0;
+            while (i < best_count && lo < best[i] && runs < SPZ_PROP_SHRINK_RUNS) {
+                memcpy(cand, best, best_count * sizeof(uint64_t));
+                cand[i] = lo + (best[i] - lo) / 2;
+                runs++;
+                if (spz_prop_shrink_try(&prop, func, cand, best_count, best, &best_count)) {
+                    improved = true;
+                    shrinks++;
+                } else {
+                    lo = cand[i] + 1;
+                }
+            }
+        }
+        /* Lower a choice which could be a length while deleting a later one */
+        for (int i = 0; i < best_count && runs < SPZ_PROP_SHRINK_RUNS; i++) {
+            for (int j = best_count - 1; j > i && runs < SPZ_PROP_SHRINK_RUNS; j--) {
+                if (j >= best_count || best[i] == 0 || best[i] > (uint64_t) best_count) break;
+                memcpy(cand, best, j * sizeof(uint64_t));
+                memcpy(cand + j, best + j + 1, (best_count - j - 1) * sizeof(uint64_t));
+                cand[i]--;
+                runs++;
+                if (spz_prop_shrink_try(&prop, func, cand, best_count - 1, best, &best_count)) {
+                    improved = true;
+                    shrinks++;
+                }
+            }
+        }
+        /* Move the value of a choice to one of the next ones */
+        for (int i = 0; i < best_count && runs < SPZ_PROP_SHRINK_RUNS; i++) {
+            for (int j = i + 1; j < best_count && j <= i + 8 && runs < SPZ_PROP_SHRINK_RUNS; j++) {
+                if (best[i] == 0) break;
+                if (best[j] > UINT64_MAX - best[i]) continue;
+                memcpy(cand, best, best_count * sizeof(uint64_t));
+                cand[j] += cand[i];
+                cand[i] = 0;
+                runs++;
+                if (spz_prop_shrink_try(&prop, func, cand, best_count, best, &best_count)) {
+                    improved = true;
+                    shrinks++;
+                }
+            }
+        }
+    }
+    printf("property %s falsified after %d inputs, shrunk %d times in %d runs:\n", name, failed_at + 1, shrinks, runs);
+    prop.print = true;
+    prop.replay = best;
+    prop.replay_count = best_count;
+    prop.replay_pos = 0;
+    prop.count = 0;
+    if (func(&prop)) {
+        printf("    the shrunk input passed when replayed, the property is not deterministic\n");
+    }
+    printf("replay with --seed %llu\n", (unsigned long long) SPZ_RUN_OPTIONS__.seed);
+    free(best);
+    free(cand);
+    free(prop.choices);
+    return 1;
+}
+
+/**
+ * Names of the TestCounter values, as printed in reports.
+ */
+static const char* SPZ_COUNTER_NAMES__[SPZ_COUNTERS_COUNT] = { "cycles", "instructions", "cache-misses", "branch-misses", };
+
+/**
+ * Represents the perf_event_open() counters of a process, not exported in
+ *  the header.
+ * @see TestCounters
+ */
+typedef struct SpzPerf {
+    int fds[SPZ_COUNTERS_COUNT]; /**< File descriptor of each counter, -1 when it could not be opened.*/
+    bool open; /**< Set when at least one counter is open.*/
+} SpzPerf;
+
+/**
+ * Opens the hardware counters for a process, also counting the threads and
+ *  processes it spawns later.
+ * When no counter can be opened, like in containers without access to
+ *  perf events, warns and turns off SPZ_RUN_OPTIONS__.perf, so that the
+ *  run goes on without them.
+ * @see spz_perf_close
+ * @param perf The SpzPerf to fill.
+ * @param pid The process to count, 0 for the calling one.
+ * @param enabled When false, counting starts with spz_perf_enable().
+ * @return True if at least one counter was opened.
+ */
+static inline bool spz_perf_open(SpzPerf* perf, int pid, bool enabled)
+{
+    perf->open = false;
+#ifdef SPZ_HAS_PERF
+    static const uint64_t configs[SPZ_COUNTERS_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    int err = 0;
+    for (int i = 0; i < SPZ_COUNTERS_COUNT; i++) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = !enabled;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf->fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (perf->fds[i] == -1) {
+            err = errno;
+        } else {
+            perf->open = true;
+        }
+    }
+    if (!perf->open) {
+        fprintf(stderr, "%s(): hardware counters unavailable (%s), running without them\n", __func__, strerror(err));
+        SPZ_RUN_OPTIONS__.perf = false;
+    }
+#else
+    (void) pid;
+    (void) enabled;
+    fprintf(stderr, "%s(): hardware counters not supported by this build, running without them\n", __func__);
+    SPZ_RUN_OPTIONS__.perf = false;
+#endif // SPZ_HAS_PERF
+    return perf->open;
+}
+
+/**
+ * Starts or stops the counters of an SpzPerf, if open.
+ * @param perf The counters.
+ * @param on True to start counting, false to stop.
+ */
+static inline void spz_perf_enable(SpzPerf* perf, bool on)
+{
+#ifdef SPZ_HAS_PERF
+    if (!perf->open) return;
+    for (int i = 0; i < SPZ_COUNTERS_COUNT; i++) {
+        if (perf->fds[i] != -1) {
+            ioctl(perf->fds[i], (on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE), 0);
+        }
+    }
+#else
+    (void) perf;
+    (void) on;
+#endif // SPZ_HAS_PERF
+}
+
+/**
+ * Reads and closes the counters of an SpzPerf, if open.
+ * Counts of counters multiplexed with other events are scaled by the
+ *  fraction of the time they were running.
+ * @param perf The counters.
+ * @param counters Set to the counts, or NULL to discard them.
+ */
+static inline void spz_perf_close(SpzPerf* perf, TestCounters* counters)
+{
+#ifdef SPZ_HAS_PERF
+    if (!perf->open) return;
+    for (int i = 0; i < SPZ_COUNTERS_COUNT; i++) {
+        if (perf->fds[i] == -1) continue;
+        /* value, time enabled, time running */
+        uint64_t buf[3] = {0};
+        if (counters && read(perf->fds[i], buf, sizeof(buf)) == sizeof(buf) && buf[2] > 0) {
+            counters->values[i] = (buf[2] < buf[1] ? (uint64_t) ((double) buf[0] * buf[1] / buf[2]) : buf[0]);
+            counters->valid |= 1u << i;
+        }
+        close(perf->fds[i]);
+    }
+    perf->open = false;
+#else
+    (void) perf;
+    (void) counters;
+#endif // SPZ_HAS_PERF
+}
+
+/**
+ * Prints the collected counters of a TestCounters on a single line.
+ * @param counters The counters to print. Nothing is printed when none is valid.
+ * @param ops When > 0, counts are printed divided by it, as per-op values.
+ */
+static inline void spz_print_counters(const TestCounters* counters, uint64_t ops)
+{
+    if (!counters->valid) return;
+    printf("    counters:");
+    const char* sep = " ";
+    for (int i = 0; i < SPZ_COUNTERS_COUNT; i++) {
+        if (!(counters->valid & (1u << i))) continue;
+        if (ops > 0) {
+            printf("%s%.2f %s/op", sep, (double) counters->values[i] / ops, SPZ_COUNTER_NAMES__[i]);
+        } else {
+            printf("%s%llu %s", sep, (unsigned long long) counters->values[i], SPZ_COUNTER_NAMES__[i]);
+        }
+        sep = ", ";
+    }
+    printf("\n");
+}
+
+/**
+ * Decodes the UTF-8 sequence at the start of a buffer, rejecting truncated
+ *  and overlong sequences, surrogates and code points above U+10FFFF.
+ * @param s The buffer, at least 1 byte long.
+ * @param len The length of the buffer.
+ * @param cp Set to the code point, or to U+FFFD for an invalid sequence.
+ * @return The number of bytes decoded, 1 for an invalid sequence.
+ */
+static size_t spz_utf8_decode(const unsigned char* s, size_t len, uint32_t* cp)
+{
+    static const uint32_t min_cp[] = {0, 0, 0x80, 0x800, 0x10000};
+    size_t n = 0;
+    uint32_t v = 0;
+    if (s[0] < 0x80) {
+        *cp = s[0];
+        return 1;
+    } else if ((s[0] & 0xe0) == 0xc0) {
+        n = 2;
+        v = s[0] & 0x1f;
+    } else if ((s[0] & 0xf0) == 0xe0) {
+        n = 3;
+        v = s[0] & 0x0f;
+    } else if ((s[0] & 0xf8) == 0xf0) {
+        n = 4;
+        v = s[0] & 0x07;
+    }
+    *cp = 0xfffd;
+    if (n == 0 || n > len) return 1;
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) return 1;
+        v = (v << 6) | (s[i] & 0x3f);
+    }
+    if (v < min_cp[n] || v > 0x10ffff || (v >= 0xd800 && v <= 0xdfff)) return 1;
+    *cp = v;
+    return n;
+}
+
+/**
+ * Writes a buffer as a quoted JSON string, escaping non-ASCII characters and
+ *  replacing invalid UTF-8 with U+FFFD.
+ */
+static void spz_write_json(FILE* out, const char* s, size_t len)
+{
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+            uint32_t cp = 0;
+            i += spz_utf8_decode((const unsigned char*) s + i, len - i, &cp) - 1;
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                fprintf(out, "\\u%04x\\u%04x", 0xd800 + (cp >> 10), 0xdc00 + (cp & 0x3ff));
+            } else {
+                fprintf(out, "\\u%04x", cp);
+            }
+            continue;
+        }
+        switch (c) {
+            case '"': fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default:
+                if (c < 0x20) {
+                    fprintf(out, "\\u%04x", c);
+                } else {
+                    fputc(c, out);
+                }
+        }
+    }
+    fputc('"', out);
+}
+
+#ifndef SPZ_NOPIPE
+static inline int spz_call_cmd(const char* x) {
+    return execlp(x, x, (char*) NULL);
+}
+
+static inline int spz_call_test(Test x) {
+    return run_test(x);
+}
+
+#define log_err(...) fprintf(stderr, __VA_ARGS__)
+
+struct TempFile {
+    FILE* tmp;
+};
+
+typedef struct TempFile TempFile;
+
+static inline TempFile tempfile_new(void)
+{
+    TempFile res = {0};
+    FILE* tmp = tmpfile();
+
+    if (tmp) {
+        res.tmp = tmp;
+    } else {
+        fprintf(stderr, "Failed creating temp file\n");
+        switch(errno) {
+            case EACCES: {
+                log_err("Permission denied\n");
+
+            }
+            break;
+            case EEXIST: {
+                log_err("Unable to generate a unique filename\n");
             }
             break;
             case EINTR: {
@@ -704,6 +2792,50 @@ static inline TempFile tempfile_new(void)
     return res;
 }
 
+/**
+ * Creates a TempFile backed by anonymous memory with memfd_create(), so that
+ *  captured output never touches TMPDIR. Falls back to tempfile_new() when
+ *  memfd_create() is not available.
+ * @see tempfile_new
+ */
+static inline TempFile tempfile_new_memfd(void)
+{
+#if defined(__linux__) && defined(SYS_memfd_create)
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif // MFD_CLOEXEC
+    TempFile res = {0};
+    int fd = (int) syscall(SYS_memfd_create, "supozi", MFD_CLOEXEC);
+    if (fd != -1) {
+        res.tmp = fdopen(fd, "w+");
+        if (res.tmp) {
+            return res;
+        }
+        close(fd);
+    }
+#endif // __linux__ && SYS_memfd_create
+    return tempfile_new();
+}
+
+/**
+ * Creates a TempFile for the passed TestCapture backend.
+ * @see TestCapture
+ */
+static inline TempFile tempfile_new_capture(TestCapture capture)
+{
+    switch (capture) {
+        case SPZ_CAPTURE_MEMFD: {
+            return tempfile_new_memfd();
+        }
+        break;
+        case SPZ_CAPTURE_TMPFILE:
+        default: {
+            return tempfile_new();
+        }
+        break;
+    }
+}
+
 static inline int tempfile_fd(TempFile t)
 {
     if (!t.tmp) {
@@ -735,496 +2867,5213 @@ static inline bool tempfile_close(TempFile *t)
 }
 
 /**
- * Internal macro used to implement proper run_X_piped functions for both
- *  Test and const char* (cmd).
- * Should be undefined by the implementation before the end of the
- *  SPZ_IMPLEMENTATION block.
- * Tries creating a temporary file using ad-hoc TempFile, not exported in the
- *  header.
- * @param retType The return type for the calling function.
- * @param x The actual Test/cmd to run.
+ * Represents a forked child whose stdout and stderr are redirected onto two
+ *  TempFile, not exported in the header.
+ * @see spawn_piped__
+ * @see spz_child_result
  */
-#define run_piped__(retType, x) do { \
-    TempFile stdout_tmpfile = {0}; \
-    TempFile stderr_tmpfile = {0}; \
-    stdout_tmpfile = tempfile_new(); \
-    if (!stdout_tmpfile.tmp) { \
-        perror("failed creating stdout tempfile"); \
-        exit(EXIT_FAILURE); \
-    } \
-    stderr_tmpfile = tempfile_new(); \
-    if (!stderr_tmpfile.tmp) { \
-        perror("failed creating stderr tempfile"); \
-        exit(EXIT_FAILURE); \
-    } \
-    pid_t pid = fork(); \
-    if (pid == -1) { \
-        perror("fork"); \
-        exit(EXIT_FAILURE); \
-    } \
-    if (pid == 0) { \
-        /* Child process*/ \
-        /* Redirect stdout to pipe */ \
-        int stdout_fd = tempfile_fd(stdout_tmpfile); \
-        if (stdout_fd == -1) { \
-            perror("failed getting the file descriptor for stdout_tmpfile"); \
-            exit(EXIT_FAILURE); \
-        } \
-        dup2(stdout_fd, STDOUT_FILENO); \
-        /* Redirect stderr to pipe */ \
-        int stderr_fd = tempfile_fd(stderr_tmpfile); \
-        if (stderr_fd == -1) { \
-            perror("failed getting the file descriptor for stderr_tmpfile"); \
-            exit(EXIT_FAILURE); \
-        } \
-        dup2(stderr_fd, STDERR_FILENO); \
-        int res = _Generic((x), \
-                const char*: spz_call_cmd, \
-                Test: spz_call_test, \
-                default: ERROR_UNSUPPORTED_TYPE \
-                )(x); \
-        fflush(stdout_tmpfile.tmp); \
-        fflush(stderr_tmpfile.tmp); \
-        _Exit(res); \
-    } else { \
-        /* Parent process */ \
-        /* Wait for child process to finish */ \
-        int status; \
-        if (waitpid(pid, &status, 0) == -1) { \
-            fprintf(stderr, "%s(): waitpid() failed\n", __func__); \
-            if (!tempfile_close(&stdout_tmpfile)) { \
-                perror("failed closing stdout_tmpfile"); \
-            } \
-            if (!tempfile_close(&stderr_tmpfile)) { \
-                perror("failed closing stderr_tmpfile"); \
-            } \
-            return (retType) { \
-                .exit_code = -1, \
-                .stdout_fp = NULL, \
-                .stderr_fp = NULL, \
-                .signum = -1, \
-            }; \
-        }; \
-        int es = -1; \
-        if ( WIFEXITED(status) ) { \
-            es = WEXITSTATUS(status); \
-        } \
-        int signal = -1; \
-        if (WIFSIGNALED(status)) { \
-            signal = WTERMSIG(status); \
-            printf("%s(): process was terminated by signal %i\n", __func__, signal); \
-        } \
-        rewind(stdout_tmpfile.tmp); \
-        rewind(stderr_tmpfile.tmp); \
-        return (retType) { \
-            .exit_code = es, \
-            /* Must be closed by caller */ \
-            .stdout_fp = stdout_tmpfile.tmp, \
-            /* Must be closed by caller */ \
-            .stderr_fp = stderr_tmpfile.tmp, \
-            .signum = signal, \
-        }; \
-    } \
-} while(0)
+typedef struct SpzChild {
+    pid_t pid; /**< Pid of the child process.*/
+    TempFile stdout_tmpfile; /**< TempFile used for child stdout.*/
+    TempFile stderr_tmpfile; /**< TempFile used for child stderr.*/
+    int timeout_ms; /**< Timeout for the child, set before spawning it. Values <= 0 mean none.*/
+    long long deadline_ms; /**< Monotonic time when the child expires, 0 for none.*/
+    bool timed_out; /**< Set when the child was killed by spz_child_timeout().*/
+    long long start_us; /**< Monotonic time when the child was spawned.*/
+    SpzPerf perf; /**< Hardware counters attached to the child.*/
+} SpzChild;
 
 /**
- * Run a Test and collect its stdout/stderr output into temporary files.
- * @see Test
- * @see TestResult
- * @param t The test to run.
+ * Returns the current CLOCK_MONOTONIC time in microseconds.
  */
-TestResult run_test_piped(Test t) {
-    run_piped__(TestResult, t);
+static inline long long spz_now_us(void)
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
 /**
- * Run a cmd and collect its stdout/stderr output into temporary files.
- * @see CmdResult
- * @param cmd The cmd to run.
+ * Returns the current CLOCK_MONOTONIC time in milliseconds.
  */
-CmdResult run_cmd_piped(const char* cmd) {
-    run_piped__(CmdResult, cmd);
+static inline long long spz_now_ms(void)
+{
+    return spz_now_us() / 1000;
 }
 
 /**
- * Generic macro to run both Test and char* and collect the stdout/stderr
- *  output into temporary files.
- * @see run_test_piped
- * @see run_cmd_piped
- * @param x The Test/cmd to run.
+ * Returns the timeout for a Test of the passed TestSuite, following
+ *  test, suite and then SPZ_RUN_OPTIONS__ precedence.
+ * @see Test
+ * @see TestSuite
+ * @see TestRunOptions
+ * @param suite The suite of the test, or NULL.
+ * @param t The test.
+ * @return The timeout in milliseconds, <= 0 for none.
  */
-#define run_piped(x) _Generic((x), \
-        char*: run_cmd_piped, \
-        Test: run_test_piped, \
-        default: ERROR_UNSUPPORTED_TYPE \
-        )(x)
-
-static inline void spz_print_stream_to_file(int source, FILE* dest)
+static inline int spz_test_timeout(const TestSuite* suite, const Test* t)
 {
-    if (!dest) return;
-    char buffer[256];
-    ssize_t count;
-    while ((count = read(source, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[count] = '\0';
-        fprintf(dest, "%s", buffer);
-    }
+    if (t->timeout_ms != 0) return t->timeout_ms;
+    if (suite && suite->timeout_ms != 0) return suite->timeout_ms;
+    return SPZ_RUN_OPTIONS__.timeout_ms;
 }
 
-static inline int spz_compare_stream_to_file(int source, const char *filepath)
+/**
+ * Kills the process group of an expired SpzChild. The child is still to be
+ *  reaped by the caller.
+ * @see SpzChild
+ * @param child The child to kill.
+ */
+static inline void spz_child_timeout(SpzChild* child)
 {
-    if (!filepath) return 0;
-
-    // Open the file for comparison
-    FILE *file = fopen(filepath, "rb");
-    if (!file) {
-        perror("Failed to open file");
-        return -1; // error opening file
+    /* Children with a deadline lead their own group, this also reaches anything they spawned */
+    if (kill(-child->pid, SIGKILL) == -1) {
+        kill(child->pid, SIGKILL);
     }
+    child->timed_out = true;
+    child->deadline_ms = 0;
+}
 
-    // Buffer for reading from both the source and the file
-    char source_buffer[256];
-    char file_buffer[256];
-    ssize_t source_count, file_count;
+/**
+ * Signals forwarded to the process groups of the children, which don't get
+ *  the ones sent by the terminal to the runner.
+ */
+static const int SPZ_FORWARD_SIGNALS__[] = { SIGINT, SIGTERM, };
 
-    // Compare the contents
-    while ((source_count = read(source, source_buffer, sizeof(source_buffer))) > 0) {
-        file_count = fread(file_buffer, 1, source_count, file);
+#define SPZ_FORWARD_SIGNALS_COUNT (sizeof(SPZ_FORWARD_SIGNALS__) / sizeof(SPZ_FORWARD_SIGNALS__[0]))
 
-        if (source_count != file_count || memcmp(source_buffer, file_buffer, source_count) != 0) {
-            fclose(file);
-            return 0; // contents don't match
+static pid_t* SPZ_GROUPS__ = NULL; /**< Pids of the children leading their own process group.*/
+static volatile sig_atomic_t SPZ_GROUPS_COUNT__ = 0; /**< Number of pids in SPZ_GROUPS__.*/
+static int SPZ_GROUPS_CAPACITY__ = 0; /**< Number of pids fitting in SPZ_GROUPS__.*/
+static pid_t SPZ_GROUPS_OWNER__ = 0; /**< Pid of the process which installed spz_forward_signal().*/
+static struct sigaction SPZ_FORWARD_OLD__[SPZ_FORWARD_SIGNALS_COUNT]; /**< Actions replaced by spz_forward_signal().*/
+
+/**
+ * Handler of SPZ_FORWARD_SIGNALS__, sending the signal to the process group
+ *  of each child in SPZ_GROUPS__, then to the runner with its previous
+ *  action. Forked children just take their previous action.
+ */
+static void spz_forward_signal(int signum)
+{
+    if (getpid() == SPZ_GROUPS_OWNER__) {
+        for (int i = 0; i < SPZ_GROUPS_COUNT__; i++) {
+            kill(-SPZ_GROUPS__[i], signum);
         }
     }
-
-    // Check if there are any remaining bytes in the file
-    if (fread(file_buffer, 1, sizeof(file_buffer), file) > 0) {
-        fclose(file);
-        return 0; // the file has more data left
+    for (size_t i = 0; i < SPZ_FORWARD_SIGNALS_COUNT; i++) {
+        if (SPZ_FORWARD_SIGNALS__[i] == signum) {
+            sigaction(signum, &SPZ_FORWARD_OLD__[i], NULL);
+        }
     }
-
-    fclose(file);
-    return 1; // contents match
+    raise(signum);
 }
 
 /**
- * Generic macro to run both Test and char* and print its stdout/stderr after
- *  the run ends.
- * @see run_piped
- * @param x The Test/cmd to run.
- * @param res An int* to store the exit code of the test into.
+ * Blocks or unblocks SPZ_FORWARD_SIGNALS__, so that SPZ_GROUPS__ can be
+ *  updated without spz_forward_signal() seeing it halfway.
  */
-#define spz_run(x, res) do { \
-    TestResult r = run_piped(x); \
-    printf("---- stdout ----\n"); \
-    int stdout_fd = fileno(r.stdout_fp); \
-    spz_print_stream_to_file(stdout_fd, stdout); \
-    printf("---- stderr ----\n"); \
-    int stderr_fd = fileno(r.stderr_fp); \
-    spz_print_stream_to_file(stderr_fd, stdout); \
-    fclose(r.stdout_fp); \
-    fclose(r.stderr_fp); \
-    *res = r.exit_code; \
-} while (0)
+static inline void spz_forward_block(bool block, sigset_t* old)
+{
+    if (block) {
+        sigset_t set;
+        sigemptyset(&set);
+        for (size_t i = 0; i < SPZ_FORWARD_SIGNALS_COUNT; i++) {
+            sigaddset(&set, SPZ_FORWARD_SIGNALS__[i]);
+        }
+        sigprocmask(SIG_BLOCK, &set, old);
+    } else {
+        sigprocmask(SIG_SETMASK, old, NULL);
+    }
+}
 
 /**
- * Generic macro to run both Test and char* and check if its stdout/stderr
- *  matches the passed filepath contents.
- * @see run_piped
- * @param x The Test/cmd to run.
- * @param res An int* to store the result of the checked test into.
- * @param matched A bool* to store the result of mismatch into.
- * @param record A boolean to overwrite the record file on mismatch.
- * @param stdout_filename Path to the stdout record file.
- * @param stderr_filename Path to the stderr record file.
+ * Tracks an SpzChild leading its own process group, so that
+ *  SPZ_FORWARD_SIGNALS__ reach it. spz_forward_signal() is installed on the
+ *  first call, unless the signals are ignored.
+ * @see spz_child_untrack
+ * @param child The spawned child.
  */
-#define spz_run_checked(x, res, matched, record, stdout_filename, stderr_filename) do { \
-    TestResult r = run_piped(x); \
-    int stdout_fd = fileno(r.stdout_fp); \
-    int stdout_res = spz_compare_stream_to_file(stdout_fd, stdout_filename); \
-    switch (stdout_res) { \
-        case 0: { \
-            *matched = false; \
-            FILE* stdout_file = fopen(stdout_filename, "rb"); \
-            if (!stdout_file) { \
-                fprintf(stderr, "Failed opening stdout record at {%s}\n", stdout_filename); \
-            } else { \
-                printf("Expected: {\"\n"); \
-                int stdout_record_fd = fileno(stdout_file); \
-                spz_print_stream_to_file(stdout_record_fd, stdout); \
-                printf("\"}\nFound: {\"\n"); \
-                rewind(r.stdout_fp); \
-                spz_print_stream_to_file(stdout_fd, stdout); \
-                printf("\"}\n"); \
-                if (record) { \
-                    fclose(stdout_file); \
-                    FILE* stdout_file = fopen(stdout_filename, "w"); \
-                    rewind(r.stdout_fp); \
-                    spz_print_stream_to_file(stdout_fd, stdout_file); \
-                    fclose(stdout_file); \
-                } else { \
-                    fclose(stdout_file); \
-                } \
-            } \
-        } \
-        break; \
-        case 1: { *matched = true; } \
-        break; \
-        case -1: { \
-            *matched = false; \
-            printf("stdout record {%s} not found\n", stdout_filename); \
-        } \
-        break; \
-        default: { \
-            printf("unexpected result: {%i}\n", stdout_res); \
-        } \
-        break; \
+static void spz_child_track(const SpzChild* child)
+{
+    if (child->timeout_ms <= 0) return;
+    sigset_t old;
+    spz_forward_block(true, &old);
+    if (SPZ_GROUPS_OWNER__ != getpid()) {
+        SPZ_GROUPS_OWNER__ = getpid();
+        SPZ_GROUPS_COUNT__ = 0;
+        struct sigaction sa = {0};
+        sa.sa_handler = spz_forward_signal;
+        sigemptyset(&sa.sa_mask);
+        for (size_t i = 0; i < SPZ_FORWARD_SIGNALS_COUNT; i++) {
+            sigaction(SPZ_FORWARD_SIGNALS__[i], NULL, &SPZ_FORWARD_OLD__[i]);
+            if (SPZ_FORWARD_OLD__[i].sa_handler != SIG_IGN) {
+                sigaction(SPZ_FORWARD_SIGNALS__[i], &sa, NULL);
+            }
+        }
+    }
+    if (SPZ_GROUPS_COUNT__ == SPZ_GROUPS_CAPACITY__) {
+        int new_capacity = (SPZ_GROUPS_CAPACITY__ > 0 ? SPZ_GROUPS_CAPACITY__ * 2 : SPZ_INITIAL_CAPACITY);
+        pid_t* new_groups = realloc(SPZ_GROUPS__, new_capacity * sizeof(pid_t));
+        if (!new_groups) {
+            perror("failed growing process groups");
+            exit(EXIT_FAILURE);
+        }
+        SPZ_GROUPS__ = new_groups;
+        SPZ_GROUPS_CAPACITY__ = new_capacity;
+    }
+    SPZ_GROUPS__[SPZ_GROUPS_COUNT__] = child->pid;
+    SPZ_GROUPS_COUNT__++;
+    spz_forward_block(false, &old);
+}
+
+/**
+ * Stops tracking an SpzChild, once reaped.
+ * @see spz_child_track
+ * @param child The reaped child.
+ */
+static void spz_child_untrack(const SpzChild* child)
+{
+    if (child->timeout_ms <= 0) return;
+    sigset_t old;
+    spz_forward_block(true, &old);
+    for (int i = 0; i < SPZ_GROUPS_COUNT__; i++) {
+        if (SPZ_GROUPS__[i] == child->pid) {
+            SPZ_GROUPS__[i] = SPZ_GROUPS__[SPZ_GROUPS_COUNT__ - 1];
+            SPZ_GROUPS_COUNT__--;
+            break;
+        }
+    }
+    spz_forward_block(false, &old);
+}
+
+/**
+ * Defines the max interval in milliseconds between two polls of
+ *  spz_waitpids_deadline(), where SIGCHLD can't be waited for.
+ *  Polling starts at a fraction of it and backs off.
+ */
+#ifndef SPZ_WAIT_POLL_MS
+#define SPZ_WAIT_POLL_MS 10
+#endif // SPZ_WAIT_POLL_MS
+
+/**
+ * Waits for one of the passed children like wait4(), giving up at the passed
+ *  deadline. Only the passed pids are reaped, so that children spawned by
+ *  the test code itself are left to it.
+ * A single child without a deadline is just waited for. Otherwise, on Linux,
+ *  it checks the children with WNOHANG and sleeps in sigtimedwait() until the
+ *  next SIGCHLD or the deadline, so that exits are seen right away. Elsewhere
+ *  it polls, sleeping from 100us up to SPZ_WAIT_POLL_MS between polls.
+ * @param pids The pids to wait for.
+ * @param count The number of pids, > 0.
+ * @param status Set to the status of the reaped child.
+ * @param deadline_ms Monotonic time to give up at, 0 for none.
+ * @param usage Set to the resources used by the reaped child.
+ * @return The reaped pid, 0 when the deadline passed, -1 on error.
+ */
+static inline pid_t spz_waitpids_deadline(const pid_t* pids, int count, int* status, long long deadline_ms, struct rusage* usage)
+{
+    if (count == 1 && deadline_ms <= 0) {
+        return wait4(pids[0], status, 0, usage);
+    }
+#ifdef __linux__
+    /* Keep SIGCHLD pending while blocked, so that no exit is missed between the checks and the wait */
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigset_t old;
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    pid_t res = 0;
+    for (;;) {
+        for (int i = 0; i < count && res == 0; i++) {
+            res = wait4(pids[i], status, WNOHANG, usage);
+        }
+        if (res != 0) break;
+        struct timespec ts = {0};
+        if (deadline_ms > 0) {
+            long long left_ms = deadline_ms - spz_now_ms();
+            if (left_ms <= 0) break;
+            ts.tv_sec = left_ms / 1000;
+            ts.tv_nsec = (left_ms % 1000) * 1000000;
+        }
+        if (sigtimedwait(&chld, NULL, (deadline_ms > 0 ? &ts : NULL)) == -1 && errno != EAGAIN && errno != EINTR) {
+            res = -1;
+            break;
+        }
+    }
+    int saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    errno = saved_errno;
+    return res;
+#else
+    long sleep_us = 100;
+    for (;;) {
+        for (int i = 0; i < count; i++) {
+            pid_t res = wait4(pids[i], status, WNOHANG, usage);
+            if (res != 0) return res;
+        }
+        long us = sleep_us;
+        if (deadline_ms > 0) {
+            long long left_ms = deadline_ms - spz_now_ms();
+            if (left_ms <= 0) return 0;
+            if (left_ms * 1000 < sleep_us) us = (long) left_ms * 1000;
+        }
+        struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+        if (sleep_us < SPZ_WAIT_POLL_MS * 1000) {
+            sleep_us *= 2;
+            if (sleep_us > SPZ_WAIT_POLL_MS * 1000) sleep_us = SPZ_WAIT_POLL_MS * 1000;
+        }
+    }
+#endif // __linux__
+}
+
+/**
+ * Creates the TempFile capturing the stdout and stderr of an SpzChild, with
+ *  the backend selected by SPZ_RUN_OPTIONS__.capture.
+ * @see SpzChild
+ * @param child The SpzChild to fill.
+ */
+static inline void spz_child_open_captures(SpzChild* child)
+{
+    child->stdout_tmpfile = tempfile_new_capture(SPZ_RUN_OPTIONS__.capture);
+    if (!child->stdout_tmpfile.tmp) {
+        perror("failed creating stdout tempfile");
+        exit(EXIT_FAILURE);
+    }
+    child->stderr_tmpfile = tempfile_new_capture(SPZ_RUN_OPTIONS__.capture);
+    if (!child->stderr_tmpfile.tmp) {
+        perror("failed creating stderr tempfile");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Creates the pipe used to hold a new child until its counters are
+ *  attached by spz_perf_gate_attach().
+ * @param gate Set to the pipe, or to -1 when not counting.
+ * @param enabled Whether counters are wanted for the child.
+ */
+static inline void spz_perf_gate_open(int gate[2], bool enabled)
+{
+    gate[0] = -1;
+    gate[1] = -1;
+    if (enabled && SPZ_RUN_OPTIONS__.perf && pipe(gate) == -1) {
+        perror("failed creating perf gate");
+        gate[0] = -1;
+        gate[1] = -1;
+    }
+}
+
+/**
+ * Child side of the perf gate, blocks until the parent attached counters.
+ * @param gate The pipe from spz_perf_gate_open().
+ */
+static inline void spz_perf_gate_wait(int gate[2])
+{
+    if (gate[0] == -1) return;
+    close(gate[1]);
+    char c = 0;
+    while (read(gate[0], &c, 1) == -1 && errno == EINTR);
+    close(gate[0]);
+}
+
+/**
+ * Parent side of the perf gate, attaches counters to the child and then
+ *  lets it run. Counting starts before the test call, so it includes the
+ *  little setup left in the child.
+ * @param perf Filled with the counters of the child.
+ * @param pid The child.
+ * @param gate The pipe from spz_perf_gate_open().
+ */
+static inline void spz_perf_gate_attach(SpzPerf* perf, pid_t pid, int gate[2])
+{
+    if (gate[0] == -1) return;
+    close(gate[0]);
+    spz_perf_open(perf, pid, true);
+    close(gate[1]);
+}
+
+/**
+ * Internal macro used to fork a child running either a Test or a
+ *  const char* (cmd), without waiting for it.
+ * Should be undefined by the implementation before the end of the
+ *  SPZ_IMPLEMENTATION block.
+ * Tries creating a temporary file using ad-hoc TempFile, not exported in the
+ *  header, with spz_child_open_captures().
+ * When the child has a timeout, it is moved to its own process group so
+ *  that spz_child_timeout() can kill it together with its descendants, and
+ *  tracked with spz_child_track() so that Ctrl-C still reaches it.
+ * With SPZ_RUN_OPTIONS__.perf, hardware counters are attached to the child
+ *  before it runs.
+ * @see SpzChild
+ * @see spz_child_result
+ * @param x The actual Test/cmd to run.
+ * @param child The SpzChild* to fill.
+ */
+#define spawn_piped__(x, child) do { \
+    spz_child_open_captures(child); \
+    /* Avoid the child inheriting pending output */ \
+    fflush(stdout); \
+    fflush(stderr); \
+    int perf_gate__[2]; \
+    spz_perf_gate_open(perf_gate__, true); \
+    pid_t pid__ = fork(); \
+    if (pid__ == -1) { \
+        perror("fork"); \
+        exit(EXIT_FAILURE); \
     } \
-    int stderr_fd = fileno(r.stderr_fp); \
-    int stderr_res = spz_compare_stream_to_file(stderr_fd, stderr_filename); \
-    switch (stderr_res) { \
-        case 0: { \
-            *matched = false; \
-            FILE* stderr_file = fopen(stderr_filename, "rb"); \
-            if (!stderr_file) { \
-                fprintf(stderr, "Failed opening stderr record at {%s}\n", stderr_filename); \
-            } else { \
-                printf("Expected: {\"\n"); \
-                int stderr_record_fd = fileno(stderr_file); \
-                spz_print_stream_to_file(stderr_record_fd, stdout); \
-                printf("\"}\nFound: {\"\n"); \
-                rewind(r.stderr_fp); \
-                spz_print_stream_to_file(stderr_fd, stdout); \
-                printf("\"}\n"); \
-                if (record) { \
-                    fclose(stderr_file); \
-                    FILE* stderr_file = fopen(stderr_filename, "w"); \
-                    rewind(r.stderr_fp); \
-                    spz_print_stream_to_file(stderr_fd, stderr_file); \
-                    fclose(stderr_file); \
-                } else { \
-                    fclose(stderr_file); \
-                } \
-            } \
+    if (pid__ == 0) { \
+        /* Child process*/ \
+        if ((child)->timeout_ms > 0) { \
+            setpgid(0, 0); \
         } \
-        break; \
-        case 1: { *matched = true; } \
-        break; \
-        case -1: { \
-            *matched = false; \
-            printf("stderr record {%s} not found\n", stderr_filename); \
+        /* Redirect stdout to pipe */ \
+        int stdout_fd = tempfile_fd((child)->stdout_tmpfile); \
+        if (stdout_fd == -1) { \
+            perror("failed getting the file descriptor for stdout_tmpfile"); \
+            exit(EXIT_FAILURE); \
         } \
-        break; \
-        default: { \
-            printf("unexpected result: {%i}\n", stderr_res); \
+        dup2(stdout_fd, STDOUT_FILENO); \
+        /* Redirect stderr to pipe */ \
+        int stderr_fd = tempfile_fd((child)->stderr_tmpfile); \
+        if (stderr_fd == -1) { \
+            perror("failed getting the file descriptor for stderr_tmpfile"); \
+            exit(EXIT_FAILURE); \
         } \
-        break; \
+        dup2(stderr_fd, STDERR_FILENO); \
+        spz_perf_gate_wait(perf_gate__); \
+        int res = _Generic((x), \
+                const char*: spz_call_cmd, \
+                Test: spz_call_test, \
+                default: ERROR_UNSUPPORTED_TYPE \
+                )(x); \
+        /* _Exit() does not flush stdio */ \
+        fflush(stdout); \
+        fflush(stderr); \
+        _Exit(res); \
+    } \
+    (child)->pid = pid__; \
+    spz_perf_gate_attach(&(child)->perf, pid__, perf_gate__); \
+    (child)->start_us = spz_now_us(); \
+    if ((child)->timeout_ms > 0) { \
+        /* Also set it from the parent, so that it's done before any kill */ \
+        setpgid(pid__, pid__); \
+        (child)->deadline_ms = spz_now_ms() + (child)->timeout_ms; \
+        spz_child_track(child); \
     } \
-    fclose(r.stdout_fp); \
-    fclose(r.stderr_fp); \
-    *res = r.exit_code; \
 } while (0)
 
-#endif // SPZ_NOPIPE
+/**
+ * Maps the output captured in a FILE* read-only, so that it can be used as a
+ *  buffer without copying it.
+ * @param fp The capture file.
+ * @param len Set to the length of the captured output.
+ * @return The mapping, or NULL when the output is empty or can't be mapped.
+ */
+static inline const char* spz_map_capture(FILE* fp, size_t* len)
+{
+    *len = 0;
+    struct stat st = {0};
+    if (fstat(fileno(fp), &st) == -1 || st.st_size <= 0) {
+        return NULL;
+    }
+    void* buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (buf == MAP_FAILED) {
+        fprintf(stderr, "%s(): failed mapping captured output\n", __func__);
+        return NULL;
+    }
+    *len = st.st_size;
+    return buf;
+}
+
+/**
+ * Fills the TestUsage fields taken from a struct rusage.
+ * @see TestUsage
+ * @param usage The usage to fill.
+ * @param ru The resources used, as returned by wait4() or getrusage().
+ */
+static inline void spz_usage_from_rusage(TestUsage* usage, const struct rusage* ru)
+{
+    usage->user_s = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    usage->sys_s = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    /* Linux reports it in KiB */
+    usage->max_rss_kb = ru->ru_maxrss;
+    usage->minor_faults = ru->ru_minflt;
+    usage->major_faults = ru->ru_majflt;
+    usage->voluntary_switches = ru->ru_nvcsw;
+    usage->involuntary_switches = ru->ru_nivcsw;
+}
+
+/**
+ * Builds the TestResult for a finished SpzChild. Its captures are left
+ *  unmapped, see testresult_map().
+ * @see SpzChild
+ * @see TestResult
+ * @param child The finished child.
+ * @param es The exit code, -1 when killed.
+ * @param signal The signal which killed the child, or -1.
+ * @param ru The resources used by the child, or NULL when unknown.
+ * @return The result of the child. Caller must release it with testresult_close().
+ */
+static inline TestResult spz_capture_result(SpzChild* child, int es, int signal, const struct rusage* ru)
+{
+    rewind(child->stdout_tmpfile.tmp);
+    rewind(child->stderr_tmpfile.tmp);
+    TestResult res = {
+        .exit_code = es,
+        /* Must be closed by caller */
+        .stdout_fp = child->stdout_tmpfile.tmp,
+        /* Must be closed by caller */
+        .stderr_fp = child->stderr_tmpfile.tmp,
+        .signum = signal,
+        .timed_out = child->timed_out,
+    };
+    if (ru) {
+        spz_usage_from_rusage(&res.usage, ru);
+    }
+    if (child->start_us > 0) {
+        res.usage.wall_s = (spz_now_us() - child->start_us) / 1e6;
+    }
+    spz_perf_close(&child->perf, &res.counters);
+    return res;
+}
+
+/**
+ * Builds the TestResult for a reaped SpzChild, given its wait status.
+ * @see SpzChild
+ * @see TestResult
+ * @param child The reaped child.
+ * @param status The status returned by waitpid().
+ * @param ru The resources used by the child, or NULL when unknown.
+ * @return The result of the child. Caller must release it with testresult_close().
+ */
+static inline TestResult spz_child_result(SpzChild* child, int status, const struct rusage* ru)
+{
+    spz_child_untrack(child);
+    int es = -1;
+    if ( WIFEXITED(status) ) {
+        es = WEXITSTATUS(status);
+    }
+    int signal = -1;
+    if (WIFSIGNALED(status)) {
+        signal = WTERMSIG(status);
+    }
+    return spz_capture_result(child, es, signal, ru);
+}
+
+/**
+ * Maps the captured output of a TestResult, if not mapped yet.
+ * @see TestResult
+ * @param r The result to map.
+ */
+void testresult_map(TestResult* r)
+{
+    if (!r) return;
+    if (!r->stdout_buf && r->stdout_fp) r->stdout_buf = spz_map_capture(r->stdout_fp, &r->stdout_len);
+    if (!r->stderr_buf && r->stderr_fp) r->stderr_buf = spz_map_capture(r->stderr_fp, &r->stderr_len);
+}
+
+/**
+ * Releases the captured output of a TestResult, unmapping the buffers and
+ *  closing the FILE* fields.
+ * @see TestResult
+ * @param r The result to release.
+ */
+void testresult_close(TestResult* r)
+{
+    if (!r) return;
+    if (r->stdout_buf) munmap((void*) r->stdout_buf, r->stdout_len);
+    if (r->stderr_buf) munmap((void*) r->stderr_buf, r->stderr_len);
+    if (r->stdout_fp) fclose(r->stdout_fp);
+    if (r->stderr_fp) fclose(r->stderr_fp);
+    r->stdout_buf = NULL;
+    r->stderr_buf = NULL;
+    r->stdout_len = 0;
+    r->stderr_len = 0;
+    r->stdout_fp = NULL;
+    r->stderr_fp = NULL;
+}
+
+/**
+ * Closes the TempFile of an SpzChild which could not be waited for.
+ * @see SpzChild
+ * @param child The child to discard.
+ * @return A TestResult representing the failure.
+ */
+static inline TestResult spz_child_discard(SpzChild* child)
+{
+    spz_child_untrack(child);
+    spz_perf_close(&child->perf, NULL);
+    if (!tempfile_close(&child->stdout_tmpfile)) {
+        perror("failed closing stdout_tmpfile");
+    }
+    if (!tempfile_close(&child->stderr_tmpfile)) {
+        perror("failed closing stderr_tmpfile");
+    }
+    return (TestResult) {
+        .exit_code = -1,
+        .stdout_fp = NULL,
+        .stderr_fp = NULL,
+        .signum = -1,
+    };
+}
+
+/**
+ * Tags the messages sent by the fork server.
+ * @see SpzForkMsg
+ */
+typedef enum SpzForkMsgKind {
+    SPZ_FORK_SPAWNED, /**< Reply to a request, pid is -1 when fork() failed.*/
+    SPZ_FORK_EXITED, /**< A child was reaped, with the passed status.*/
+    SPZ_FORK_FIXTURE, /**< Reply to a fixture request, status is 0 when the setup failed.*/
+} SpzForkMsgKind;
+
+/**
+ * Represents a message sent by the fork server to the runner.
+ * @see spz_fork_server_main
+ */
+typedef struct SpzForkMsg {
+    SpzForkMsgKind kind; /**< Tags the message.*/
+    pid_t pid; /**< Pid of the child.*/
+    int status; /**< Status from waitpid(), for SPZ_FORK_EXITED.*/
+    struct rusage usage; /**< Resources used by the child, for SPZ_FORK_EXITED.*/
+    TestCounters counters; /**< Hardware counters of the child, for SPZ_FORK_EXITED.*/
+} SpzForkMsg;
+
+/**
+ * Tags the requests sent to the fork server.
+ * @see SpzForkReq
+ */
+typedef enum SpzForkReqKind {
+    SPZ_FORK_REQ_SPAWN, /**< Fork a child running the test.*/
+    SPZ_FORK_REQ_SETUP, /**< Run a suite setup in the server, so that its next children inherit it.*/
+    SPZ_FORK_REQ_TEARDOWN, /**< Run a suite teardown in the server.*/
+} SpzForkReqKind;
+
+/**
+ * Represents a request to spawn a Test, sent by the runner to the fork
+ *  server along with the stdout and stderr capture file descriptors, or to
+ *  run a suite fixture, sent alone.
+ * The server is a fork of the runner, so the pointers in the Test are valid
+ *  there too.
+ */
+typedef struct SpzForkReq {
+    SpzForkReqKind kind; /**< Tags the request.*/
+    fixture_setup_fn setup; /**< Setup to run, for SPZ_FORK_REQ_SETUP.*/
+    fixture_teardown_fn teardown; /**< Teardown to run, for SPZ_FORK_REQ_TEARDOWN.*/
+    Test test; /**< The test to run.*/
+    int timeout_ms; /**< Timeout of the child, only used to set its process group.*/
+    bool perf; /**< When true, the server attaches hardware counters to the child.*/
+} SpzForkReq;
+
+/**
+ * Represents the runner side of the fork server, not exported in the header.
+ * @see spz_fork_server_start
+ */
+typedef struct SpzForkServer {
+    pid_t pid; /**< Pid of the server, 0 when not running.*/
+    int fd; /**< Socket connected to the server.*/
+    SpzForkMsg* exited; /**< Exit messages received while waiting for something else.*/
+    int exited_count; /**< Number of queued exit messages.*/
+    int exited_capacity; /**< Number of exit messages fitting in the queue.*/
+    bool at_exit; /**< Set once spz_fork_server_stop() is registered with atexit().*/
+} SpzForkServer;
+
+static SpzForkServer SPZ_FORK_SERVER__ = { .fd = -1, };
+
+/**
+ * Write end of the pipe woken up by spz_fork_server_sigchld().
+ */
+static int SPZ_FORK_SERVER_WAKE__ = -1;
+
+/**
+ * Reads exactly len bytes from a file descriptor, retrying on EINTR.
+ * @return True on success, false on errors or end of file.
+ */
+static bool spz_read_full(int fd, void* buf, size_t len)
+{
+    char* dest = buf;
+    while (len > 0) {
+        ssize_t res = read(fd, dest, len);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        dest += res;
+        len -= res;
+    }
+    return true;
+}
+
+/**
+ * Writes exactly len bytes to a file descriptor, retrying on EINTR.
+ * @return True on success.
+ */
+static bool spz_write_full(int fd, const void* buf, size_t len)
+{
+    const char* src = buf;
+    while (len > 0) {
+        ssize_t res = write(fd, src, len);
+        if (res == -1 && errno == EINTR) continue;
+        if (res <= 0) return false;
+        src += res;
+        len -= res;
+    }
+    return true;
+}
+
+/**
+ * SIGCHLD handler of the fork server, waking up its poll() loop.
+ */
+static void spz_fork_server_sigchld(int signum)
+{
+    (void) signum;
+    int saved_errno = errno;
+    char c = 0;
+    ssize_t res = write(SPZ_FORK_SERVER_WAKE__, &c, 1);
+    (void) res;
+    errno = saved_errno;
+}
+
+/**
+ * Receives a SpzForkReq, and its two file descriptors for spawn requests.
+ * @return True on success, false when the runner went away.
+ */
+static bool spz_fork_server_recv(int sock, SpzForkReq* req, int fds[2])
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctrl;
+    struct iovec iov = { .iov_base = req, .iov_len = sizeof(*req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof(ctrl.buf),
+    };
+    ssize_t res = -1;
+    do {
+        res = recvmsg(sock, &msg, 0);
+    } while (res == -1 && errno == EINTR);
+    if (res <= 0) return false;
+    /* The rest of a stream message may come apart from the descriptors */
+    if ((size_t) res < sizeof(*req) && !spz_read_full(sock, (char*) req + res, sizeof(*req) - res)) {
+        return false;
+    }
+    if (req->kind != SPZ_FORK_REQ_SPAWN) return true;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        fprintf(stderr, "%s(): request without file descriptors\n", __func__);
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    return true;
+}
+
+/**
+ * Represents a child of the fork server, with the counters attached to it.
+ */
+typedef struct SpzForkChild {
+    pid_t pid; /**< The child.*/
+    SpzPerf perf; /**< Its counters.*/
+} SpzForkChild;
+
+/**
+ * Main loop of the fork server, never returns.
+ * Forks a child for each request, replying with its pid, and reports the
+ *  status of each reaped child. Only the children it forked are reaped.
+ *  Suite fixtures are run in the server itself, so that they are inherited
+ *  by the children forked after them.
+ * Exits when the runner closes the socket.
+ * @param sock The socket connected to the runner.
+ */
+static void spz_fork_server_main(int sock)
+{
+    SpzForkChild* children = NULL;
+    int children_count = 0;
+    int children_capacity = 0;
+    int wake[2] = {-1, -1};
+    if (pipe(wake) == -1) {
+        perror("pipe");
+        _Exit(EXIT_FAILURE);
+    }
+    fcntl(wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake[1], F_SETFL, O_NONBLOCK);
+    SPZ_FORK_SERVER_WAKE__ = wake[1];
+    struct sigaction sa = {0};
+    sa.sa_handler = spz_fork_server_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    for (;;) {
+        struct pollfd pfds[2] = {
+            { .fd = sock, .events = POLLIN, },
+            { .fd = wake[0], .events = POLLIN, },
+        };
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake[0], drain, sizeof(drain)) > 0);
+        }
+        int status = 0;
+        pid_t reaped = 0;
+        struct rusage usage = {0};
+        for (int i = 0; i < children_count; ) {
+            reaped = wait4(children[i].pid, &status, WNOHANG, &usage);
+            if (reaped <= 0) {
+                i++;
+                continue;
+            }
+            SpzForkMsg msg = { .kind = SPZ_FORK_EXITED, .pid = reaped, .status = status, .usage = usage, };
+            spz_perf_close(&children[i].perf, &msg.counters);
+            children[i] = children[--children_count];
+            if (!spz_write_full(sock, &msg, sizeof(msg))) _Exit(EXIT_FAILURE);
+        }
+        if (!(pfds[0].revents & (POLLIN | POLLHUP))) continue;
+        SpzForkReq req = {0};
+        int fds[2] = {-1, -1};
+        if (!spz_fork_server_recv(sock, &req, fds)) break;
+        if (req.kind != SPZ_FORK_REQ_SPAWN) {
+            SpzForkMsg msg = { .kind = SPZ_FORK_FIXTURE, .status = 1, };
+            if (req.kind == SPZ_FORK_REQ_SETUP) {
+                msg.status = req.setup();
+            } else {
+                req.teardown();
+            }
+            fflush(stdout);
+            fflush(stderr);
+            if (!spz_write_full(sock, &msg, sizeof(msg))) _Exit(EXIT_FAILURE);
+            continue;
+        }
+        int gate[2];
+        spz_perf_gate_open(gate, req.perf);
+        pid_t pid = fork();
+        if (pid == 0) {
+            /* Child process */
+            close(sock);
+            close(wake[0]);
+            close(wake[1]);
+            signal(SIGCHLD, SIG_DFL);
+            if (req.timeout_ms > 0) {
+                setpgid(0, 0);
+            }
+            dup2(fds[0], STDOUT_FILENO);
+            dup2(fds[1], STDERR_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            spz_perf_gate_wait(gate);
+            int res = spz_call_test(req.test);
+            /* _Exit() does not flush stdio */
+            fflush(stdout);
+            fflush(stderr);
+            _Exit(res);
+        }
+        if (pid > 0 && req.timeout_ms > 0) {
+            setpgid(pid, pid);
+        }
+        if (pid > 0) {
+            SpzPerf perf = {0};
+            spz_perf_gate_attach(&perf, pid, gate);
+            if (children_count == children_capacity) {
+                children_capacity = (children_capacity > 0 ? children_capacity * 2 : SPZ_INITIAL_CAPACITY);
+                SpzForkChild* new_children = realloc(children, children_capacity * sizeof(SpzForkChild));
+                if (!new_children) {
+                    perror("failed growing fork server children");
+                    _Exit(EXIT_FAILURE);
+                }
+                children = new_children;
+            }
+            children[children_count++] = (SpzForkChild) { .pid = pid, .perf = perf, };
+        } else if (gate[0] != -1) {
+            close(gate[0]);
+            close(gate[1]);
+        }
+        close(fds[0]);
+        close(fds[1]);
+        SpzForkMsg msg = { .kind = SPZ_FORK_SPAWNED, .pid = pid, };
+        if (!spz_write_full(sock, &msg, sizeof(msg))) _Exit(EXIT_FAILURE);
+    }
+    _Exit(EXIT_SUCCESS);
+}
+
+/**
+ * Starts the fork server, if not running yet.
+ * @see spz_fork_server_stop
+ * @return True if the server is running.
+ */
+bool spz_fork_server_start(void)
+{
+    if (SPZ_FORK_SERVER__.pid > 0) return true;
+    int sv[2] = {-1, -1};
+    /* Processes exec'd by the runner must not keep the server alive */
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("failed creating fork server socket");
+        return false;
+    }
+    /* Avoid the server inheriting pending output */
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        spz_fork_server_main(sv[1]);
+    }
+    close(sv[1]);
+    SPZ_FORK_SERVER__.pid = pid;
+    SPZ_FORK_SERVER__.fd = sv[0];
+    if (!SPZ_FORK_SERVER__.at_exit) {
+        atexit(spz_fork_server_stop);
+        SPZ_FORK_SERVER__.at_exit = true;
+    }
+    return true;
+}
+
+/**
+ * Stops the fork server, if running, and waits for it to exit.
+ * @see spz_fork_server_start
+ */
+void spz_fork_server_stop(void)
+{
+    if (SPZ_FORK_SERVER__.pid <= 0) return;
+    /* Children forked by the runner may still hold the socket, don't wait for them to close it */
+    shutdown(SPZ_FORK_SERVER__.fd, SHUT_RDWR);
+    close(SPZ_FORK_SERVER__.fd);
+    while (waitpid(SPZ_FORK_SERVER__.pid, NULL, 0) == -1 && errno == EINTR);
+    free(SPZ_FORK_SERVER__.exited);
+    SPZ_FORK_SERVER__ = (SpzForkServer) { .fd = -1, .at_exit = SPZ_FORK_SERVER__.at_exit, };
+}
+
+/**
+ * Reads a message from the fork server, queueing exit messages.
+ * @param msg Set to the message read.
+ * @return True on success, false when the server went away.
+ */
+static bool spz_fork_server_read(SpzForkMsg* msg)
+{
+    if (!spz_read_full(SPZ_FORK_SERVER__.fd, msg, sizeof(*msg))) return false;
+    if (msg->kind != SPZ_FORK_EXITED) return true;
+    SpzForkServer* fs = &SPZ_FORK_SERVER__;
+    if (fs->exited_count == fs->exited_capacity) {
+        int new_capacity = (fs->exited_capacity > 0 ? fs->exited_capacity * 2 : SPZ_INITIAL_CAPACITY);
+        SpzForkMsg* new_exited = realloc(fs->exited, new_capacity * sizeof(SpzForkMsg));
+        if (!new_exited) {
+            perror("failed growing fork server queue");
+            exit(EXIT_FAILURE);
+        }
+        fs->exited = new_exited;
+        fs->exited_capacity = new_capacity;
+    }
+    fs->exited[fs->exited_count++] = *msg;
+    return true;
+}
+
+/**
+ * Spawns a piped Test through the fork server.
+ * Like spawn_piped__, exits on failure.
+ * @see spawn_piped__
+ * @param t The test to run.
+ * @param child The SpzChild* to fill.
+ */
+static void spz_fork_server_spawn(Test t, SpzChild* child)
+{
+    spz_child_open_captures(child);
+    SpzForkReq req = { .test = t, .timeout_ms = child->timeout_ms, .perf = SPZ_RUN_OPTIONS__.perf, };
+    int fds[2] = { tempfile_fd(child->stdout_tmpfile), tempfile_fd(child->stderr_tmpfile), };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctrl;
+    memset(&ctrl, 0, sizeof(ctrl));
+    struct iovec iov = { .iov_base = &req, .iov_len = sizeof(req) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl.buf,
+        .msg_controllen = sizeof(ctrl.buf),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif // MSG_NOSIGNAL
+    ssize_t sent = -1;
+    do {
+        sent = sendmsg(SPZ_FORK_SERVER__.fd, &msg, flags);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1 || ((size_t) sent < sizeof(req) && !spz_write_full(SPZ_FORK_SERVER__.fd, (char*) &req + sent, sizeof(req) - sent))) {
+        perror("failed sending to fork server");
+        exit(EXIT_FAILURE);
+    }
+    SpzForkMsg reply = {0};
+    do {
+        if (!spz_fork_server_read(&reply)) {
+            fprintf(stderr, "%s(): fork server went away\n", __func__);
+            exit(EXIT_FAILURE);
+        }
+    } while (reply.kind != SPZ_FORK_SPAWNED);
+    if (reply.pid == -1) {
+        fprintf(stderr, "%s(): fork server failed forking\n", __func__);
+        exit(EXIT_FAILURE);
+    }
+    child->pid = reply.pid;
+    child->start_us = spz_now_us();
+    if (child->timeout_ms > 0) {
+        child->deadline_ms = spz_now_ms() + child->timeout_ms;
+        spz_child_track(child);
+    }
+}
+
+/**
+ * Runs a suite fixture in the fork server, and waits for it to be done.
+ * @see SpzForkReqKind
+ * @param kind SPZ_FORK_REQ_SETUP or SPZ_FORK_REQ_TEARDOWN.
+ * @param setup The setup to run, for SPZ_FORK_REQ_SETUP.
+ * @param teardown The teardown to run, for SPZ_FORK_REQ_TEARDOWN.
+ * @return False when the setup failed, or the server went away.
+ */
+static bool spz_fork_server_fixture(SpzForkReqKind kind, fixture_setup_fn setup, fixture_teardown_fn teardown)
+{
+    SpzForkReq req = { .kind = kind, .setup = setup, .teardown = teardown, };
+    /* Keep the runner output before the one of the fixture */
+    fflush(stdout);
+    fflush(stderr);
+    if (!spz_write_full(SPZ_FORK_SERVER__.fd, &req, sizeof(req))) {
+        fprintf(stderr, "%s(): failed sending to fork server\n", __func__);
+        return false;
+    }
+    SpzForkMsg reply = {0};
+    do {
+        if (!spz_fork_server_read(&reply)) {
+            fprintf(stderr, "%s(): fork server went away\n", __func__);
+            return false;
+        }
+    } while (reply.kind != SPZ_FORK_FIXTURE);
+    return reply.status != 0;
+}
+
+/**
+ * Waits for a child of the fork server, like spz_waitpids_deadline().
+ * @see spz_waitpids_deadline
+ * @param pid The pid to wait for, or -1 for any child.
+ * @param status Set to the status of the reaped child.
+ * @param deadline_ms Monotonic time to give up at, 0 for none.
+ * @param usage Set to the resources used by the reaped child.
+ * @param counters Set to the hardware counters of the reaped child.
+ * @return The reaped pid, 0 when the deadline passed, -1 on error.
+ */
+static pid_t spz_fork_server_wait(pid_t pid, int* status, long long deadline_ms, struct rusage* usage, TestCounters* counters)
+{
+    SpzForkServer* fs = &SPZ_FORK_SERVER__;
+    for (;;) {
+        for (int i = 0; i < fs->exited_count; i++) {
+            if (pid != -1 && fs->exited[i].pid != pid) continue;
+            pid_t reaped = fs->exited[i].pid;
+            *status = fs->exited[i].status;
+            *usage = fs->exited[i].usage;
+            *counters = fs->exited[i].counters;
+            memmove(&fs->exited[i], &fs->exited[i+1], (fs->exited_count - i - 1) * sizeof(SpzForkMsg));
+            fs->exited_count--;
+            return reaped;
+        }
+        int timeout = -1;
+        if (deadline_ms > 0) {
+            long long left_ms = deadline_ms - spz_now_ms();
+            if (left_ms <= 0) return 0;
+            timeout = (left_ms > INT32_MAX ? INT32_MAX : (int) left_ms);
+        }
+        struct pollfd pfd = { .fd = fs->fd, .events = POLLIN, };
+        int res = poll(&pfd, 1, timeout);
+        if (res == -1 && errno != EINTR) return -1;
+        if (res <= 0) continue;
+        SpzForkMsg msg = {0};
+        if (!spz_fork_server_read(&msg)) {
+            errno = ECHILD;
+            return -1;
+        }
+    }
+}
+
+/**
+ * Defines the size of the alternate signal stack used by
+ *  spz_run_in_process(), so that it can also recover from stack overflows.
+ */
+#ifndef SPZ_ALTSTACK_SIZE
+#define SPZ_ALTSTACK_SIZE (64 * 1024)
+#endif // SPZ_ALTSTACK_SIZE
+
+/**
+ * Jump buffer set by spz_run_in_process() around the test call.
+ */
+static sigjmp_buf SPZ_IN_PROCESS_JMP__;
+
+/**
+ * Signals caught by spz_run_in_process(). SIGALRM is used for timeouts.
+ */
+static const int SPZ_IN_PROCESS_SIGNALS__[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGALRM, };
+
+#define SPZ_IN_PROCESS_SIGNALS_COUNT (sizeof(SPZ_IN_PROCESS_SIGNALS__) / sizeof(SPZ_IN_PROCESS_SIGNALS__[0]))
+
+/**
+ * Signal handler used by spz_run_in_process(), jumping back out of the test.
+ */
+static void spz_in_process_signal(int signum)
+{
+    siglongjmp(SPZ_IN_PROCESS_JMP__, signum);
+}
+
+/**
+ * Run a Test in the calling process, capturing its stdout and stderr like a
+ *  piped test, by pointing file descriptors 1 and 2 to the SpzChild captures.
+ * Crashes from SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT are caught and
+ *  reported like a child killed by that signal, and the child timeout is
+ *  enforced with SIGALRM. Resource usage is the difference of getrusage()
+ *  around the call, except for max RSS, which is the peak of the runner.
+ * Recovery is best-effort: a crashed test may leave
+ *  leaked memory, held locks or broken global state behind, and exit() still
+ *  ends the runner. Register such tests with REGISTER_UNSAFE_TEST.
+ * @see SpzChild
+ * @see REGISTER_UNSAFE_TEST
+ * @param t The test to run.
+ * @param child The SpzChild holding the timeout, its captures get opened.
+ * @return The result of the test. Caller must release it with testresult_close().
+ */
+static TestResult spz_run_in_process(Test t, SpzChild* child)
+{
+    static char* altstack = NULL;
+    if (!altstack) {
+        altstack = malloc(SPZ_ALTSTACK_SIZE);
+        if (!altstack) {
+            perror("failed allocating signal stack");
+            exit(EXIT_FAILURE);
+        }
+    }
+    spz_child_open_captures(child);
+    if (SPZ_RUN_OPTIONS__.perf) {
+        spz_perf_open(&child->perf, 0, false);
+    }
+    stack_t ss = { .ss_sp = altstack, .ss_size = SPZ_ALTSTACK_SIZE, };
+    stack_t old_ss = {0};
+    sigaltstack(&ss, &old_ss);
+    struct sigaction sa = {0};
+    sa.sa_handler = spz_in_process_signal;
+    sa.sa_flags = SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    struct sigaction old_sa[SPZ_IN_PROCESS_SIGNALS_COUNT];
+    for (size_t i = 0; i < SPZ_IN_PROCESS_SIGNALS_COUNT; i++) {
+        sigaction(SPZ_IN_PROCESS_SIGNALS__[i], &sa, &old_sa[i]);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    if (saved_stdout == -1 || saved_stderr == -1) {
+        perror("dup");
+        exit(EXIT_FAILURE);
+    }
+    dup2(tempfile_fd(child->stdout_tmpfile), STDOUT_FILENO);
+    dup2(tempfile_fd(child->stderr_tmpfile), STDERR_FILENO);
+    struct rusage before = {0};
+    getrusage(RUSAGE_SELF, &before);
+    child->start_us = spz_now_us();
+    volatile int exit_code = -1;
+    volatile int signum = -1;
+    /* The signal mask is saved, since handlers jump out with it blocked */
+    int jumped = sigsetjmp(SPZ_IN_PROCESS_JMP__, 1);
+    if (jumped == 0) {
+        if (child->timeout_ms > 0) {
+            struct itimerval it = {
+                .it_value = { .tv_sec = child->timeout_ms / 1000, .tv_usec = (child->timeout_ms % 1000) * 1000, },
+            };
+            setitimer(ITIMER_REAL, &it, NULL);
+        }
+        spz_perf_enable(&child->perf, true);
+        /* Truncate like the exit status of a child */
+        exit_code = run_test(t) & 0xff;
+    } else if (jumped == SIGALRM) {
+        child->timed_out = true;
+    } else {
+        signum = jumped;
+    }
+    struct itimerval off = {0};
+    setitimer(ITIMER_REAL, &off, NULL);
+    spz_perf_enable(&child->perf, false);
+    struct rusage after = {0};
+    getrusage(RUSAGE_SELF, &after);
+    after.ru_utime.tv_sec -= before.ru_utime.tv_sec;
+    after.ru_utime.tv_usec -= before.ru_utime.tv_usec;
+    after.ru_stime.tv_sec -= before.ru_stime.tv_sec;
+    after.ru_stime.tv_usec -= before.ru_stime.tv_usec;
+    after.ru_minflt -= before.ru_minflt;
+    after.ru_majflt -= before.ru_majflt;
+    after.ru_nvcsw -= before.ru_nvcsw;
+    after.ru_nivcsw -= before.ru_nivcsw;
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+    for (size_t i = 0; i < SPZ_IN_PROCESS_SIGNALS_COUNT; i++) {
+        sigaction(SPZ_IN_PROCESS_SIGNALS__[i], &old_sa[i], NULL);
+    }
+    sigaltstack(&old_ss, NULL);
+    return spz_capture_result(child, exit_code, signum, &after);
+}
+
+/**
+ * Internal macro used to implement proper run_X_piped functions for both
+ *  Test and const char* (cmd).
+ * Should be undefined by the implementation before the end of the
+ *  SPZ_IMPLEMENTATION block.
+ * @see spawn_piped__
+ * @param retType The return type for the calling function.
+ * @param x The actual Test/cmd to run.
+ * @param timeout The timeout in milliseconds, <= 0 for none.
+ */
+#define run_piped__(retType, x, timeout) do { \
+    SpzChild child__ = { .timeout_ms = (timeout), }; \
+    spawn_piped__(x, &child__); \
+    /* Parent process */ \
+    /* Wait for child process to finish */ \
+    int status; \
+    struct rusage usage__ = {0}; \
+    pid_t waited__ = 0; \
+    while ((waited__ = spz_waitpids_deadline(&child__.pid, 1, &status, child__.deadline_ms, &usage__)) <= 0) { \
+        if (waited__ == 0) { \
+            spz_child_timeout(&child__); \
+        } else if (errno != EINTR) { \
+            fprintf(stderr, "%s(): waitpid() failed\n", __func__); \
+            return spz_child_discard(&child__); \
+        } \
+    } \
+    retType res__ = spz_child_result(&child__, status, &usage__); \
+    if (res__.timed_out) { \
+        printf("%s(): process timed out after %i ms\n", __func__, child__.timeout_ms); \
+    } else if (res__.signum != -1) { \
+        printf("%s(): process was terminated by signal %i\n", __func__, res__.signum); \
+    } \
+    return res__; \
+} while(0)
+
+/**
+ * Run a Test and collect its stdout/stderr output into temporary files.
+ * The test is killed if it runs past its timeout, or the one from
+ *  SPZ_RUN_OPTIONS__ when it has none.
+ * @see Test
+ * @see TestResult
+ * @param t The test to run.
+ */
+TestResult run_test_piped(Test t) {
+    run_piped__(TestResult, t, spz_test_timeout(NULL, &t));
+}
+
+/**
+ * Run a cmd and collect its stdout/stderr output into temporary files.
+ * The cmd is killed if it runs past the timeout from SPZ_RUN_OPTIONS__.
+ * @see CmdResult
+ * @param cmd The cmd to run.
+ */
+CmdResult run_cmd_piped(const char* cmd) {
+    run_piped__(CmdResult, cmd, SPZ_RUN_OPTIONS__.timeout_ms);
+}
+
+/**
+ * Generic macro to run both Test and char* and collect the stdout/stderr
+ *  output into temporary files.
+ * @see run_test_piped
+ * @see run_cmd_piped
+ * @param x The Test/cmd to run.
+ */
+#define run_piped(x) _Generic((x), \
+        char*: run_cmd_piped, \
+        Test: run_test_piped, \
+        default: ERROR_UNSUPPORTED_TYPE \
+        )(x)
+
+/**
+ * Defines the size of the buffer used by spz_print_stream_to_file() when the
+ *  stream can't be transferred in bulk.
+ */
+#ifndef SPZ_STREAM_BUFSIZE
+#define SPZ_STREAM_BUFSIZE 65536
+#endif // SPZ_STREAM_BUFSIZE
+
+/**
+ * Copies everything left in a file descriptor, from its current offset, to
+ *  the passed FILE. The copy is binary-safe.
+ * When both ends have a file descriptor, uses sendfile() where available, so
+ *  that the data never goes through userspace. Otherwise falls back to
+ *  read() and fwrite() with a SPZ_STREAM_BUFSIZE buffer.
+ * @param source The file descriptor to copy from.
+ * @param dest The FILE to copy to.
+ */
+static inline void spz_print_stream_to_file(int source, FILE* dest)
+{
+    if (!dest) return;
+    fflush(dest);
+#ifdef __linux__
+    int dest_fd = fileno(dest);
+    struct stat st = {0};
+    if (dest_fd != -1 && fstat(source, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t pos = lseek(source, 0, SEEK_CUR);
+        while (pos != -1 && pos < st.st_size) {
+            ssize_t sent = sendfile(dest_fd, source, NULL, st.st_size - pos);
+            if (sent == -1 && errno == EINTR) continue;
+            if (sent <= 0) break;
+            pos += sent;
+        }
+        /* On errors, copy whatever is left with the buffered path */
+    }
+#endif // __linux__
+    char* buffer = malloc(SPZ_STREAM_BUFSIZE);
+    if (!buffer) {
+        fprintf(stderr, "%s(): failed allocating buffer\n", __func__);
+        return;
+    }
+    ssize_t count;
+    while ((count = read(source, buffer, SPZ_STREAM_BUFSIZE)) != 0) {
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fwrite(buffer, 1, count, dest) != (size_t) count) break;
+    }
+    free(buffer);
+    fflush(dest);
+}
+
+/**
+ * Compares everything left in a file descriptor, from its current offset,
+ *  with the contents of the file at filepath. The comparison is binary-safe.
+ * When both are regular files, sizes are checked first and then both are
+ *  mapped and compared with memcmp(), without copying. Otherwise both are
+ *  read in SPZ_STREAM_BUFSIZE chunks, retrying short reads.
+ * The offset of source is left unchanged when it is seekable.
+ * @param source The file descriptor to compare.
+ * @param filepath Path to the file to compare with.
+ * @return 1 if the contents match, 0 if they don't, -1 if the file can't be opened.
+ */
+static inline int spz_compare_stream_to_file(int source, const char *filepath)
+{
+    if (!filepath) return 0;
+
+    // Open the file for comparison
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        perror("Failed to open file");
+        return -1; // error opening file
+    }
+
+    int res = -1;
+    off_t source_pos = lseek(source, 0, SEEK_CUR);
+    struct stat source_st = {0};
+    struct stat file_st = {0};
+    if (source_pos != -1
+            && fstat(source, &source_st) == 0 && S_ISREG(source_st.st_mode)
+            && fstat(fileno(file), &file_st) == 0 && S_ISREG(file_st.st_mode)) {
+        off_t source_len = (source_st.st_size > source_pos ? source_st.st_size - source_pos : 0);
+        if (source_len != file_st.st_size) {
+            res = 0; // sizes don't match
+        } else if (source_len == 0) {
+            res = 1; // both empty
+        } else {
+            char* source_map = mmap(NULL, source_st.st_size, PROT_READ, MAP_PRIVATE, source, 0);
+            char* file_map = mmap(NULL, file_st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            if (source_map != MAP_FAILED && file_map != MAP_FAILED) {
+                res = (memcmp(source_map + source_pos, file_map, source_len) == 0);
+            }
+            if (source_map != MAP_FAILED) munmap(source_map, source_st.st_size);
+            if (file_map != MAP_FAILED) munmap(file_map, file_st.st_size);
+        }
+    }
+    if (res != -1) {
+        fclose(file);
+        return res;
+    }
+
+    // Fall back to reading both, for pipes or when mapping fails
+    char* source_buffer = malloc(SPZ_STREAM_BUFSIZE);
+    char* file_buffer = malloc(SPZ_STREAM_BUFSIZE);
+    if (!source_buffer || !file_buffer) {
+        fprintf(stderr, "%s(): failed allocating buffers\n", __func__);
+        free(source_buffer);
+        free(file_buffer);
+        fclose(file);
+        return -1;
+    }
+    res = 1;
+    while (res == 1) {
+        size_t source_count = 0;
+        while (source_count < SPZ_STREAM_BUFSIZE) {
+            ssize_t count = read(source, source_buffer + source_count, SPZ_STREAM_BUFSIZE - source_count);
+            if (count == -1 && errno == EINTR) continue;
+            if (count <= 0) break;
+            source_count += count;
+        }
+        size_t file_count = fread(file_buffer, 1, SPZ_STREAM_BUFSIZE, file);
+        if (source_count != file_count || memcmp(source_buffer, file_buffer, source_count) != 0) {
+            res = 0; // contents don't match
+        } else if (source_count < SPZ_STREAM_BUFSIZE) {
+            break; // both ended
+        }
+    }
+    free(source_buffer);
+    free(file_buffer);
+    if (source_pos != -1) {
+        lseek(source, source_pos, SEEK_SET);
+    }
+    fclose(file);
+    return res;
+}
+
+/**
+ * Defines the max number of lines printed by spz_print_diff().
+ */
+#ifndef SPZ_DIFF_MAX_LINES
+#define SPZ_DIFF_MAX_LINES 200
+#endif // SPZ_DIFF_MAX_LINES
+
+/**
+ * Defines the number of context lines around each hunk printed by spz_print_diff().
+ */
+#ifndef SPZ_DIFF_CONTEXT
+#define SPZ_DIFF_CONTEXT 3
+#endif // SPZ_DIFF_CONTEXT
+
+/**
+ * Defines the max number of line edits searched by spz_print_diff().
+ * Bigger differences only report the first mismatch.
+ */
+#ifndef SPZ_DIFF_MAX_EDITS
+#define SPZ_DIFF_MAX_EDITS 1000
+#endif // SPZ_DIFF_MAX_EDITS
+
+/**
+ * Represents a line of a buffer compared by spz_print_diff(), not exported
+ *  in the header.
+ */
+typedef struct SpzLine {
+    const char* start; /**< Start of the line.*/
+    size_t len; /**< Length of the line, without the newline.*/
+    uint64_t hash; /**< FNV-1a hash of the line.*/
+    bool newline; /**< Set when the line ends with a newline.*/
+} SpzLine;
+
+/**
+ * Represents an entry of the edit script built by spz_print_diff().
+ */
+typedef struct SpzEdit {
+    char op; /**< One of ' ', '-', '+'.*/
+    const SpzLine* line; /**< The line to print.*/
+} SpzEdit;
+
+/**
+ * Splits a buffer into an array of SpzLine. Caller must free the result.
+ * @param buf The buffer to split.
+ * @param len Length of the buffer.
+ * @param count Set to the number of lines.
+ * @return The lines, or NULL when empty or on allocation failure.
+ */
+static inline SpzLine* spz_split_lines(const char* buf, size_t len, size_t* count)
+{
+    *count = 0;
+    size_t lines = 0;
+    for (const char* c = buf; c && c < buf + len; lines++) {
+        const char* nl = memchr(c, '\n', buf + len - c);
+        c = (nl ? nl + 1 : buf + len);
+    }
+    if (lines == 0) return NULL;
+    SpzLine* res = malloc(lines * sizeof(SpzLine));
+    if (!res) return NULL;
+    const char* c = buf;
+    for (size_t i = 0; i < lines; i++) {
+        const char* nl = memchr(c, '\n', buf + len - c);
+        const char* end = (nl ? nl : buf + len);
+        res[i] = (SpzLine) {
+            .start = c,
+            .len = end - c,
+            .hash = spz_hash_bytes(SPZ_FNV_OFFSET, c, end - c),
+            .newline = (nl != NULL),
+        };
+        c = (nl ? nl + 1 : buf + len);
+    }
+    *count = lines;
+    return res;
+}
+
+static inline bool spz_lines_equal(const SpzLine* a, const SpzLine* b)
+{
+    return a->hash == b->hash && a->len == b->len && a->newline == b->newline && !memcmp(a->start, b->start, a->len);
+}
+
+/**
+ * Computes a shortest edit script between two arrays of SpzLine, using the
+ *  greedy Myers algorithm, giving up past max_edits edits.
+ * @param a The expected lines.
+ * @param n Number of expected lines.
+ * @param b The found lines.
+ * @param m Number of found lines.
+ * @param max_edits Max number of edits to search.
+ * @param count Set to the length of the script.
+ * @return The script, NULL when too big or on allocation failure. Caller must free it.
+ */
+static inline SpzEdit* spz_myers_diff(const SpzLine* a, int n, const SpzLine* b, int m, int max_edits, size_t* count)
+{
+    *count = 0;
+    int max = (n + m < max_edits ? n + m : max_edits);
+    int* v = malloc((2 * max + 3) * sizeof(int));
+    /* trace holds v[-d..d] after each round d, so round d starts at d*d */
+    int* trace = malloc((size_t) (max + 1) * (max + 1) * sizeof(int));
+    SpzEdit* script = malloc((n + m + 1) * sizeof(SpzEdit));
+    if (!v || !trace || !script) {
+        free(v);
+        free(trace);
+        free(script);
+        return NULL;
+    }
+    int off = max + 1;
+    v[off + 1] = 0;
+    int found_d = -1;
+    for (int d = 0; d <= max && found_d == -1; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = 0;
+            if (k == -d || (k != d && v[off + k - 1] < v[off + k + 1])) {
+                x = v[off + k + 1];
+            } else {
+                x = v[off + k - 1] + 1;
+            }
+            int y = x - k;
+            while (x < n && y < m && spz_lines_equal(&a[x], &b[y])) {
+                x++;
+                y++;
+            }
+            v[off + k] = x;
+            if (x >= n && y >= m) {
+                found_d = d;
+            }
+        }
+        memcpy(trace + (size_t) d * d, v + off - d, (2 * d + 1) * sizeof(int));
+    }
+    free(v);
+    if (found_d == -1) {
+        free(trace);
+        free(script);
+        return NULL;
+    }
+    /* Walk back from (n, m), filling the script from its end */
+    size_t len = 0;
+    int x = n;
+    int y = m;
+    for (int d = found_d; d > 0; d--) {
+        const int* prev = trace + (size_t) (d - 1) * (d - 1) + (d - 1);
+        int k = x - y;
+        int prev_k = ((k == -d || (k != d && prev[k - 1] < prev[k + 1])) ? k + 1 : k - 1);
+        int prev_x = prev[prev_k];
+        int prev_y = prev_x - prev_k;
+        while (x > prev_x && y > prev_y) {
+            script[len++] = (SpzEdit) { .op = ' ', .line = &a[--x] };
+            y--;
+        }
+        if (prev_k == k + 1) {
+            script[len++] = (SpzEdit) { .op = '+', .line = &b[--y] };
+        } else {
+            script[len++] = (SpzEdit) { .op = '-', .line = &a[--x] };
+        }
+    }
+    while (x > 0 && y > 0) {
+        script[len++] = (SpzEdit) { .op = ' ', .line = &a[--x] };
+        y--;
+    }
+    free(trace);
+    for (size_t i = 0; i < len / 2; i++) {
+        SpzEdit tmp = script[i];
+        script[i] = script[len - 1 - i];
+        script[len - 1 - i] = tmp;
+    }
+    *count = len;
+    return script;
+}
+
+/**
+ * Prints a line of a diff, counting it against SPZ_DIFF_MAX_LINES.
+ * @return False when the limit was reached.
+ */
+static inline bool spz_print_diff_line(FILE* dest, char op, const SpzLine* line, int* printed)
+{
+    if (*printed >= SPZ_DIFF_MAX_LINES) return false;
+    fputc(op, dest);
+    fwrite(line->start, 1, line->len, dest);
+    fputc('\n', dest);
+    if (!line->newline) {
+        fprintf(dest, "\\ No newline at end of file\n");
+    }
+    (*printed)++;
+    return true;
+}
+
+/**
+ * Prints where two buffers first differ, followed by a unified diff of their
+ *  lines with SPZ_DIFF_CONTEXT lines of context.
+ * Common leading and trailing lines are skipped before diffing, the search
+ *  stops past SPZ_DIFF_MAX_EDITS edits, and at most SPZ_DIFF_MAX_LINES
+ *  lines are printed, so reporting stays cheap for big outputs.
+ * @param expected The expected contents.
+ * @param expected_len Length of the expected contents.
+ * @param found The found contents.
+ * @param found_len Length of the found contents.
+ * @param dest The FILE to print to.
+ */
+static inline void spz_print_diff(const char* expected, size_t expected_len, const char* found, size_t found_len, FILE* dest)
+{
+    if (!dest) return;
+    size_t min_len = (expected_len < found_len ? expected_len : found_len);
+    size_t first = 0;
+    while (first < min_len && expected[first] == found[first]) {
+        first++;
+    }
+    if (first == expected_len && first == found_len) return;
+    /* Find the line holding the first difference */
+    size_t line_start = first;
+    while (line_start > 0 && expected[line_start - 1] != '\n') {
+        line_start--;
+    }
+    size_t line_no = 1;
+    for (const char* c = expected; c && c < expected + line_start; line_no++) {
+        c = memchr(c, '\n', expected + line_start - c);
+        if (!c) break;
+        c++;
+    }
+    fprintf(dest, "First difference at byte offset {%zu}, line {%zu}, column {%zu}\n", first, line_no, first - line_start + 1);
+
+    /* Skip the common tail, keeping whole lines of both buffers */
+    size_t tail = 0;
+    while (tail < min_len - line_start && expected[expected_len - 1 - tail] == found[found_len - 1 - tail]) {
+        tail++;
+    }
+    while (tail > 0 && ((expected_len > tail && expected[expected_len - tail - 1] != '\n') || (found_len > tail && found[found_len - tail - 1] != '\n'))) {
+        tail--;
+    }
+    /* Keep up to SPZ_DIFF_CONTEXT lines around the differing region */
+    size_t head_start = line_start;
+    for (int i = 0; i < SPZ_DIFF_CONTEXT && head_start > 0; i++) {
+        head_start--;
+        while (head_start > 0 && expected[head_start - 1] != '\n') {
+            head_start--;
+        }
+    }
+    size_t tail_end = tail;
+    for (int i = 0; i < SPZ_DIFF_CONTEXT && tail_end > 0; i++) {
+        const char* nl = memchr(expected + expected_len - tail_end, '\n', tail_end);
+        tail_end = (nl ? (size_t) (expected + expected_len - nl - 1) : 0);
+    }
+    size_t head_lines = 0;
+    for (size_t i = head_start; i < line_start; i++) {
+        if (expected[i] == '\n') head_lines++;
+    }
+    size_t tail_lines = 0;
+    for (size_t i = expected_len - tail; i < expected_len - tail_end; i++) {
+        if (expected[i] == '\n') tail_lines++;
+    }
+
+    size_t a_count = 0;
+    size_t b_count = 0;
+    SpzLine* a = spz_split_lines(expected + head_start, expected_len - tail_end - head_start, &a_count);
+    SpzLine* b = spz_split_lines(found + head_start, found_len - tail_end - head_start, &b_count);
+    size_t script_len = 0;
+    SpzEdit* script = NULL;
+    if ((a || a_count == 0) && (b || b_count == 0)) {
+        /* Diff only the lines between the shared head and tail */
+        size_t a_mid = a_count - head_lines - tail_lines;
+        size_t b_mid = b_count - head_lines - tail_lines;
+        size_t mid_len = 0;
+        SpzEdit* mid = spz_myers_diff(a + head_lines, a_mid, b + head_lines, b_mid, SPZ_DIFF_MAX_EDITS, &mid_len);
+        if (mid) {
+            script = malloc((head_lines + mid_len + tail_lines) * sizeof(SpzEdit) + 1);
+            if (script) {
+                for (size_t i = 0; i < head_lines; i++) {
+                    script[script_len++] = (SpzEdit) { .op = ' ', .line = &a[i] };
+                }
+                memcpy(script + script_len, mid, mid_len * sizeof(SpzEdit));
+                script_len += mid_len;
+                for (size_t i = 0; i < tail_lines; i++) {
+                    script[script_len++] = (SpzEdit) { .op = ' ', .line = &a[a_count - tail_lines + i] };
+                }
+            }
+            free(mid);
+        }
+    }
+    int printed = 0;
+    if (!script) {
+        fprintf(dest, "(more than %i line edits, showing the first differing line)\n", SPZ_DIFF_MAX_EDITS);
+        if (a && head_lines < a_count) spz_print_diff_line(dest, '-', &a[head_lines], &printed);
+        if (b && head_lines < b_count) spz_print_diff_line(dest, '+', &b[head_lines], &printed);
+        free(a);
+        free(b);
+        return;
+    }
+    fprintf(dest, "--- expected\n+++ found\n");
+    size_t base_line = line_no - head_lines;
+    size_t i = 0;
+    bool truncated = false;
+    while (i < script_len && !truncated) {
+        while (i < script_len && script[i].op == ' ') i++;
+        if (i == script_len) break;
+        /* Extend the hunk while changes are close enough to share context */
+        size_t hunk_start = (i > SPZ_DIFF_CONTEXT ? i - SPZ_DIFF_CONTEXT : 0);
+        size_t hunk_end = i;
+        size_t j = i;
+        while (j < script_len) {
+            if (script[j].op != ' ') {
+                hunk_end = j + 1;
+            } else if (j - hunk_end >= 2 * SPZ_DIFF_CONTEXT) {
+                break;
+            }
+            j++;
+        }
+        hunk_end = (hunk_end + SPZ_DIFF_CONTEXT < script_len ? hunk_end + SPZ_DIFF_CONTEXT : script_len);
+        size_t a_start = base_line;
+        size_t b_start = base_line;
+        for (size_t k = 0; k < hunk_start; k++) {
+            if (script[k].op != '+') a_start++;
+            if (script[k].op != '-') b_start++;
+        }
+        size_t a_len = 0;
+        size_t b_len = 0;
+        for (size_t k = hunk_start; k < hunk_end; k++) {
+            if (script[k].op != '+') a_len++;
+            if (script[k].op != '-') b_len++;
+        }
+        if (printed >= SPZ_DIFF_MAX_LINES) {
+            truncated = true;
+            break;
+        }
+        /* Empty ranges refer to the line before, as in diff -u */
+        fprintf(dest, "@@ -%zu,%zu +%zu,%zu @@\n", a_start - (a_len == 0), a_len, b_start - (b_len == 0), b_len);
+        for (size_t k = hunk_start; k < hunk_end; k++) {
+            if (!spz_print_diff_line(dest, script[k].op, script[k].line, &printed)) {
+                truncated = true;
+                break;
+            }
+        }
+        i = hunk_end;
+    }
+    if (truncated) {
+        fprintf(dest, "(diff truncated after %i lines)\n", SPZ_DIFF_MAX_LINES);
+    }
+    free(script);
+    free(a);
+    free(b);
+}
+
+/**
+ * Prints the diff between a record file and the found contents.
+ * @see spz_print_diff
+ * @param filepath Path to the record file.
+ * @param found The found contents.
+ * @param found_len Length of the found contents.
+ * @param dest The FILE to print to.
+ */
+static inline void spz_print_record_diff(const char* filepath, const char* found, size_t found_len, FILE* dest)
+{
+    FILE* file = fopen(filepath, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed opening record at {%s}\n", filepath);
+        return;
+    }
+    size_t expected_len = 0;
+    const char* expected = spz_map_capture(file, &expected_len);
+    spz_print_diff(expected, expected_len, found, found_len, dest);
+    if (expected) munmap((void*) expected, expected_len);
+    fclose(file);
+}
+
+/**
+ * Generic macro to run both Test and char* and print its stdout/stderr after
+ *  the run ends.
+ * @see run_piped
+ * @param x The Test/cmd to run.
+ * @param res An int* to store the exit code of the test into.
+ */
+#define spz_run(x, res) do { \
+    TestResult r = run_piped(x); \
+    printf("---- stdout ----\n"); \
+    int stdout_fd = fileno(r.stdout_fp); \
+    spz_print_stream_to_file(stdout_fd, stdout); \
+    printf("---- stderr ----\n"); \
+    int stderr_fd = fileno(r.stderr_fp); \
+    spz_print_stream_to_file(stderr_fd, stdout); \
+    testresult_close(&r); \
+    *res = r.exit_code; \
+} while (0)
+
+/**
+ * Generic macro to run both Test and char* and check if its stdout/stderr
+ *  matches the passed filepath contents.
+ * On mismatch, prints the first differing offset and a bounded diff.
+ * @see spz_print_diff
+ * @see run_piped
+ * @param x The Test/cmd to run.
+ * @param res An int* to store the result of the checked test into.
+ * @param matched A bool* to store the result of mismatch into.
+ * @param record A boolean to overwrite the record file on mismatch.
+ * @param stdout_filename Path to the stdout record file.
+ * @param stderr_filename Path to the stderr record file.
+ */
+#define spz_run_checked(x, res, matched, record, stdout_filename, stderr_filename) do { \
+    TestResult r = run_piped(x); \
+    *matched = true; \
+    int stdout_fd = fileno(r.stdout_fp); \
+    int stdout_res = spz_compare_stream_to_file(stdout_fd, stdout_filename); \
+    switch (stdout_res) { \
+        case 0: { \
+            *matched = false; \
+            printf("stdout mismatch for record {%s}:\n", stdout_filename); \
+            testresult_map(&r); \
+            spz_print_record_diff(stdout_filename, r.stdout_buf, r.stdout_len, stdout); \
+            if (record) { \
+                FILE* stdout_file = fopen(stdout_filename, "w"); \
+                if (!stdout_file) { \
+                    fprintf(stderr, "Failed opening stdout record at {%s}\n", stdout_filename); \
+                } else { \
+                    rewind(r.stdout_fp); \
+                    spz_print_stream_to_file(stdout_fd, stdout_file); \
+                    fclose(stdout_file); \
+                } \
+            } \
+        } \
+        break; \
+        case 1: \
+        break; \
+        case -1: { \
+            *matched = false; \
+            printf("stdout record {%s} not found\n", stdout_filename); \
+        } \
+        break; \
+        default: { \
+            printf("unexpected result: {%i}\n", stdout_res); \
+        } \
+        break; \
+    } \
+    int stderr_fd = fileno(r.stderr_fp); \
+    int stderr_res = spz_compare_stream_to_file(stderr_fd, stderr_filename); \
+    switch (stderr_res) { \
+        case 0: { \
+            *matched = false; \
+            printf("stderr mismatch for record {%s}:\n", stderr_filename); \
+            testresult_map(&r); \
+            spz_print_record_diff(stderr_filename, r.stderr_buf, r.stderr_len, stdout); \
+            if (record) { \
+                FILE* stderr_file = fopen(stderr_filename, "w"); \
+                if (!stderr_file) { \
+                    fprintf(stderr, "Failed opening stderr record at {%s}\n", stderr_filename); \
+                } else { \
+                    rewind(r.stderr_fp); \
+                    spz_print_stream_to_file(stderr_fd, stderr_file); \
+                    fclose(stderr_file); \
+                } \
+            } \
+        } \
+        break; \
+        case 1: \
+        break; \
+        case -1: { \
+            *matched = false; \
+            printf("stderr record {%s} not found\n", stderr_filename); \
+        } \
+        break; \
+        default: { \
+            printf("unexpected result: {%i}\n", stderr_res); \
+        } \
+        break; \
+    } \
+    testresult_close(&r); \
+    *res = r.exit_code; \
+} while (0)
+
+/**
+ * Represents a piped Test scheduled by spz_run_jobs(), not exported in the
+ *  header.
+ * @see spz_run_jobs
+ */
+typedef struct SpzJob {
+    Test test; /**< The test to run.*/
+    int suite_idx; /**< Index of the SpzSuiteRun the test belongs to.*/
+    SpzChild child; /**< The child running the test.*/
+    TestResult result; /**< The result of the test, valid when done is true.*/
+    bool done; /**< Set when the child has been reaped.*/
+    bool skipped; /**< Set when the job was done by the SPZ_JOB_PREPARE callback, without running.*/
+    uint64_t cache_key; /**< Key of the test in the SpzCache, when SPZ_RUN_OPTIONS__.changed is set.*/
+#ifndef SPZ_NOTIMER
+    DumbTimer timer; /**< Started at spawn, stopped at reap.*/
+#endif // SPZ_NOTIMER
+} SpzJob;
+
+/**
+ * Tags the events passed to a spz_job_cb.
+ * @see spz_job_cb
+ */
+typedef enum SpzJobEvent {
+    SPZ_JOB_PREPARE, /**< Job is about to be spawned. The callback may skip it by setting its result and done.*/
+    SPZ_JOB_STARTED, /**< Job is about to be spawned. Only sent when running one job at a time.*/
+    SPZ_JOB_DONE, /**< Job is done, sent in scheduling order.*/
+} SpzJobEvent;
+
+/**
+ * Defines the callback used by spz_run_jobs() to report job events.
+ * @see SpzJobEvent
+ */
+typedef void (*spz_job_cb)(SpzJob* job, SpzJobEvent ev, void* ctx);
+
+/**
+ * Checks if a Test run by spz_run_jobs() gets its own process.
+ * @param t The test to check.
+ * @return False when the test runs in the calling process.
+ */
+static inline bool spz_test_forked(const Test* t)
+{
+    return !(SPZ_RUN_OPTIONS__.in_process && !t->unsafe);
+}
+
+/**
+ * Run an array of SpzJob, keeping up to max_jobs children in flight.
+ * Children are reaped by pid as they finish, but SPZ_JOB_DONE is always
+ *  reported in array order, as soon as all previous jobs are done.
+ * Children running past their deadline are killed, and reported as timed out.
+ * When the fork server is running, children are spawned and reaped through it.
+ * With SPZ_RUN_OPTIONS__.in_process, tests not marked unsafe are run right
+ *  away in the calling process, while forked ones keep running.
+ * Jobs marked done by the SPZ_JOB_PREPARE callback are not run.
+ * @see SpzJob
+ * @see spz_job_cb
+ * @param jobs The jobs to run.
+ * @param count The number of jobs.
+ * @param max_jobs The max number of children running at once.
+ * @param cb The callback receiving job events.
+ * @param ctx Passed to cb.
+ */
+static void spz_run_jobs(SpzJob* jobs, int count, int max_jobs, spz_job_cb cb, void* ctx)
+{
+    if (max_jobs < 1) max_jobs = 1;
+    bool use_server = (SPZ_FORK_SERVER__.pid > 0);
+    pid_t* pids = malloc(max_jobs * sizeof(pid_t));
+    if (!pids) {
+        perror("failed allocating job pids");
+        exit(EXIT_FAILURE);
+    }
+    int next = 0;
+    int emitted = 0;
+    int running = 0;
+    while (emitted < count) {
+        while (running < max_jobs && next < count) {
+            cb(&jobs[next], SPZ_JOB_PREPARE, ctx);
+            jobs[next].skipped = jobs[next].done;
+            if (max_jobs == 1) cb(&jobs[next], SPZ_JOB_STARTED, ctx);
+#ifndef SPZ_NOTIMER
+            jobs[next].timer = dt_new();
+#endif // SPZ_NOTIMER
+            if (jobs[next].done || !spz_test_forked(&jobs[next].test)) {
+                if (!jobs[next].done) {
+                    jobs[next].result = spz_run_in_process(jobs[next].test, &jobs[next].child);
+                    jobs[next].done = true;
+                }
+#ifndef SPZ_NOTIMER
+                dt_stop(&jobs[next].timer);
+#endif // SPZ_NOTIMER
+                next++;
+                /* Report it right away when nothing before it is pending */
+                if (max_jobs == 1 || running == 0) break;
+                continue;
+            }
+            if (use_server) {
+                spz_fork_server_spawn(jobs[next].test, &jobs[next].child);
+            } else {
+                spawn_piped__(jobs[next].test, &jobs[next].child);
+            }
+            running++;
+            next++;
+        }
+        if (running == 0) {
+            while (emitted < next && jobs[emitted].done) {
+                cb(&jobs[emitted], SPZ_JOB_DONE, ctx);
+                emitted++;
+            }
+            continue;
+        }
+        int status = 0;
+        struct rusage usage = {0};
+        TestCounters counters = {0};
+        long long deadline_ms = 0;
+        int pids_count = 0;
+        for (int i = emitted; i < next; i++) {
+            if (jobs[i].done) continue;
+            pids[pids_count++] = jobs[i].child.pid;
+            long long d = jobs[i].child.deadline_ms;
+            if (d > 0 && (deadline_ms == 0 || d < deadline_ms)) {
+                deadline_ms = d;
+            }
+        }
+        pid_t wait_pid = (max_jobs == 1 ? jobs[next-1].child.pid : -1);
+        pid_t pid = (use_server ? spz_fork_server_wait(wait_pid, &status, deadline_ms, &usage, &counters) : spz_waitpids_deadline(pids, pids_count, &status, deadline_ms, &usage));
+        if (pid == 0) {
+            /* Kill the expired children, they are reaped on the next rounds */
+            long long now_ms = spz_now_ms();
+            for (int i = emitted; i < next; i++) {
+                long long d = jobs[i].child.deadline_ms;
+                if (!jobs[i].done && d > 0 && d <= now_ms) {
+                    spz_child_timeout(&jobs[i].child);
+                }
+            }
+            continue;
+        } else if (pid == -1) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "%s(): waitpid() failed\n", __func__);
+            for (int i = emitted; i < next; i++) {
+                if (!jobs[i].done) {
+                    jobs[i].result = spz_child_discard(&jobs[i].child);
+                    jobs[i].done = true;
+#ifndef SPZ_NOTIMER
+                    dt_stop(&jobs[i].timer);
+#endif // SPZ_NOTIMER
+                }
+            }
+            running = 0;
+        } else {
+            for (int i = emitted; i < next; i++) {
+                if (!jobs[i].done && jobs[i].child.pid == pid) {
+#ifndef SPZ_NOTIMER
+                    dt_stop(&jobs[i].timer);
+#endif // SPZ_NOTIMER
+                    jobs[i].result = spz_child_result(&jobs[i].child, status, &usage);
+                    if (use_server) {
+                        jobs[i].result.counters = counters;
+                    }
+                    jobs[i].done = true;
+                    running--;
+                    break;
+                }
+            }
+        }
+        while (emitted < next && jobs[emitted].done) {
+            cb(&jobs[emitted], SPZ_JOB_DONE, ctx);
+            emitted++;
+        }
+    }
+    free(pids);
+}
+
+/**
+ * Formats the path of a record file in the current directory, writing the
+ *  cases of parameterized tests as TEST.IDX instead of TEST/IDX.
+ * @param pathbuf The buffer to fill.
+ * @param size The size of the buffer.
+ * @param name The name of the test.
+ * @param suffix The suffix of the record.
+ */
+static void spz_record_path(char* pathbuf, size_t size, const char* name, const char* suffix)
+{
+    int prefix = snprintf(pathbuf, size, ".%s", SPZ_PATH_SEPARATOR);
+    snprintf(pathbuf + prefix, size - prefix, "%s%s", name, suffix);
+    for (char* c = pathbuf + prefix; *c; c++) {
+        if (*c == '/') *c = '.';
+    }
+}
+
+/**
+ * Writes the stdout/stderr of a TestResult to the record files for the
+ *  passed test name.
+ * @see TestResult
+ * @param name The name of the test.
+ * @param res The result to record.
+ * @param stdout_record_suffix Suffix used for stdout record.
+ * @param stderr_record_suffix Suffix used for stderr record.
+ */
+static void spz_record_result(const char* name, TestResult res, const char* stdout_record_suffix, const char* stderr_record_suffix)
+{
+    char pathbuf[FILENAME_MAX] = {0};
+    const char* stdout_pb_suffix = NULL;
+    if (!stdout_record_suffix) {
+        stdout_pb_suffix = ".stdout";
+    } else {
+        stdout_pb_suffix = stdout_record_suffix;
+    }
+    spz_record_path(pathbuf, sizeof(pathbuf), name, stdout_pb_suffix);
+    FILE* stdout_record_file = fopen(pathbuf, "w");
+    int stdout_fd = fileno(res.stdout_fp);
+    spz_print_stream_to_file(stdout_fd, stdout_record_file);
+    fclose(stdout_record_file);
+
+    const char* stderr_pb_suffix = NULL;
+    if (!stderr_record_suffix) {
+        stderr_pb_suffix = ".stderr";
+    } else {
+        stderr_pb_suffix = stderr_record_suffix;
+    }
+    spz_record_path(pathbuf, sizeof(pathbuf), name, stderr_pb_suffix);
+    FILE* stderr_record_file = fopen(pathbuf, "w");
+    int stderr_fd = fileno(res.stderr_fp);
+    spz_print_stream_to_file(stderr_fd, stderr_record_file);
+    fclose(stderr_record_file);
+}
+
+static TestReporter SPZ_REPORTERS__[SPZ_MAX_REPORTERS];
+static int SPZ_REPORTERS_COUNT__ = 0;
+
+/**
+ * Adds a TestReporter to the ones used by suite and registry runs.
+ * @see TestReporter
+ * @param r The reporter to add.
+ * @return True on success, false when SPZ_MAX_REPORTERS are in use.
+ */
+bool add_test_reporter(TestReporter r)
+{
+    if (SPZ_REPORTERS_COUNT__ >= SPZ_MAX_REPORTERS) {
+        fprintf(stderr, "%s(): can't add more than {%i} reporters\n", __func__, SPZ_MAX_REPORTERS);
+        return false;
+    }
+    SPZ_REPORTERS__[SPZ_REPORTERS_COUNT__++] = r;
+    return true;
+}
+
+/**
+ * Closes the files of the reporters added by spz_parse_args(), registered
+ *  with atexit().
+ */
+static void spz_close_reporters(void)
+{
+    for (int i = 0; i < SPZ_REPORTERS_COUNT__; i++) {
+        FILE* out = SPZ_REPORTERS__[i].out;
+        if (out && out != stdout && out != stderr) {
+            fclose(out);
+        }
+        SPZ_REPORTERS__[i].out = NULL;
+    }
+    SPZ_REPORTERS_COUNT__ = 0;
+}
+
+/**
+ * Writes a buffer as XML character data, replacing the control characters
+ *  not allowed in XML 1.0, writing non-ASCII characters as references and
+ *  replacing invalid UTF-8 with U+FFFD.
+ */
+static void spz_write_xml(FILE* out, const char* s, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+            uint32_t cp = 0;
+            i += spz_utf8_decode((const unsigned char*) s + i, len - i, &cp) - 1;
+            if (cp == 0xfffe || cp == 0xffff) cp = 0xfffd;
+            fprintf(out, "&#x%x;", cp);
+            continue;
+        }
+        switch (c) {
+            case '&': fputs("&amp;", out); break;
+            case '<': fputs("&lt;", out); break;
+            case '>': fputs("&gt;", out); break;
+            case '"': fputs("&quot;", out); break;
+            default:
+                fputc((c < 0x20 && c != '\t' && c != '\n' && c != '\r') ? '?' : c, out);
+        }
+    }
+}
+
+/**
+ * Writes a buffer as the lines of a YAML block scalar with the passed
+ *  indentation, replacing control characters and invalid UTF-8.
+ */
+static void spz_write_yaml_block(FILE* out, const char* s, size_t len, const char* indent)
+{
+    bool line_start = true;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (line_start) {
+            fputs(indent, out);
+            line_start = false;
+        }
+        if (c >= 0x80) {
+            uint32_t cp = 0;
+            size_t n = spz_utf8_decode((const unsigned char*) s + i, len - i, &cp);
+            if (cp == 0xfffd && n == 1) {
+                fputs("\xef\xbf\xbd", out);
+            } else {
+                fwrite(s + i, 1, n, out);
+            }
+            i += n - 1;
+            continue;
+        }
+        if (c == '\n') {
+            line_start = true;
+        } else if (c < 0x20 && c != '\t') {
+            c = '?';
+        }
+        fputc(c, out);
+    }
+    if (!line_start) fputc('\n', out);
+}
+
+/**
+ * Returns the failure message of a TestResult, or NULL when it passed.
+ * @param res The result.
+ * @param buf Buffer for the message.
+ * @param size Size of buf.
+ */
+static const char* spz_result_failure(const TestResult* res, char* buf, size_t size)
+{
+    if (res->setup_failed) {
+        snprintf(buf, size, "suite setup failed");
+    } else if (res->timed_out) {
+        snprintf(buf, size, "timed out");
+    } else if (res->signum != -1) {
+        snprintf(buf, size, "exit code %i, signal %i", res->exit_code, res->signum);
+    } else if (res->exit_code != 0) {
+        snprintf(buf, size, "exit code %i", res->exit_code);
+    } else {
+        return NULL;
+    }
+    return buf;
+}
+
+static void spz_junit_begin(TestReporter* r, int tests)
+{
+    (void) tests;
+    fprintf(r->out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n");
+    fflush(r->out);
+}
+
+static void spz_junit_suite_begin(TestReporter* r, const char* suite, int tests)
+{
+    fprintf(r->out, "  <testsuite name=\"");
+    spz_write_xml(r->out, suite, strlen(suite));
+    fprintf(r->out, "\" tests=\"%i\">\n", tests);
+    fflush(r->out);
+}
+
+static void spz_junit_test(TestReporter* r, const char* suite, const Test* t, const TestResult* res)
+{
+    fprintf(r->out, "    <testcase classname=\"");
+    spz_write_xml(r->out, suite, strlen(suite));
+    fprintf(r->out, "\" name=\"");
+    spz_write_xml(r->out, t->name, strlen(t->name));
+    fprintf(r->out, "\" time=\"%.6f\">\n", res->usage.wall_s);
+    char msg[64];
+    const char* failure = spz_result_failure(res, msg, sizeof(msg));
+    if (failure) {
+        fprintf(r->out, "      <failure message=\"%s\"/>\n", failure);
+    } else if (res->cached) {
+        fprintf(r->out, "      <skipped message=\"cached\"/>\n");
+    }
+    if (res->stdout_len > 0) {
+        fprintf(r->out, "      <system-out>");
+        spz_write_xml(r->out, res->stdout_buf, res->stdout_len);
+        fprintf(r->out, "</system-out>\n");
+    }
+    if (res->stderr_len > 0) {
+        fprintf(r->out, "      <system-err>");
+        spz_write_xml(r->out, res->stderr_buf, res->stderr_len);
+        fprintf(r->out, "</system-err>\n");
+    }
+    fprintf(r->out, "    </testcase>\n");
+    fflush(r->out);
+}
+
+static void spz_junit_suite_end(TestReporter* r, const char* suite, int passed, int failed)
+{
+    (void) suite;
+    (void) passed;
+    (void) failed;
+    fprintf(r->out, "  </testsuite>\n");
+    fflush(r->out);
+}
+
+static void spz_junit_end(TestReporter* r, int failures)
+{
+    (void) failures;
+    fprintf(r->out, "</testsuites>\n");
+    fflush(r->out);
+}
+
+/**
+ * Returns a TestReporter writing JUnit XML to the passed FILE*.
+ * Suite elements carry no counts, so that the report is streamed.
+ * @see TestReporter
+ * @param out Where to write the report.
+ * @return The reporter.
+ */
+TestReporter spz_junit_reporter(FILE* out)
+{
+    return (TestReporter) {
+        .begin = spz_junit_begin,
+        .suite_begin = spz_junit_suite_begin,
+        .test = spz_junit_test,
+        .suite_end = spz_junit_suite_end,
+        .end = spz_junit_end,
+        .out = out,
+    };
+}
+
+static void spz_jsonl_begin(TestReporter* r, int tests)
+{
+    fprintf(r->out, "{\"event\":\"begin\",\"tests\":%i}\n", tests);
+    fflush(r->out);
+}
+
+static void spz_jsonl_suite_begin(TestReporter* r, const char* suite, int tests)
+{
+    fprintf(r->out, "{\"event\":\"suite_begin\",\"suite\":");
+    spz_write_json(r->out, suite, strlen(suite));
+    fprintf(r->out, ",\"tests\":%i}\n", tests);
+    fflush(r->out);
+}
+
+static void spz_jsonl_test(TestReporter* r, const char* suite, const Test* t, const TestResult* res)
+{
+    fprintf(r->out, "{\"event\":\"test\",\"suite\":");
+    spz_write_json(r->out, suite, strlen(suite));
+    fprintf(r->out, ",\"name\":");
+    spz_write_json(r->out, t->name, strlen(t->name));
+    const char* status = (res->setup_failed ? "setup_failed" : (res->timed_out ? "timeout" : (res->exit_code != 0 ? "failed" : (res->cached ? "cached" : "passed"))));
+    fprintf(r->out, ",\"status\":\"%s\",\"exit_code\":%i,\"signal\":", status, res->exit_code);
+    if (res->signum != -1) {
+        fprintf(r->out, "%i", res->signum);
+    } else {
+        fprintf(r->out, "null");
+    }
+    const TestUsage* u = &res->usage;
+    fprintf(r->out, ",\"duration_s\":%.6f,\"usage\":{\"user_s\":%.6f,\"sys_s\":%.6f,\"max_rss_kb\":%ld,\"minor_faults\":%ld,\"major_faults\":%ld,\"voluntary_switches\":%ld,\"involuntary_switches\":%ld}", u->wall_s, u->user_s, u->sys_s, u->max_rss_kb, u->minor_faults, u->major_faults, u->voluntary_switches, u->involuntary_switches);
+    if (res->counters.valid) {
+        fprintf(r->out, ",\"counters\":{");
+        const char* sep = "";
+        for (int i = 0; i < SPZ_COUNTERS_COUNT; i++) {
+            if (!(res->counters.valid & (1u << i))) continue;
+            fprintf(r->out, "%s\"%s\":%llu", sep, SPZ_COUNTER_NAMES__[i], (unsigned long long) res->counters.values[i]);
+            sep = ",";
+        }
+        fprintf(r->out, "}");
+    }
+    fprintf(r->out, ",\"stdout\":");
+    spz_write_json(r->out, res->stdout_buf, res->stdout_len);
+    fprintf(r->out, ",\"stderr\":");
+    spz_write_json(r->out, res->stderr_buf, res->stderr_len);
+    fprintf(r->out, "}\n");
+    fflush(r->out);
+}
+
+static void spz_jsonl_suite_end(TestReporter* r, const char* suite, int passed, int failed)
+{
+    fprintf(r->out, "{\"event\":\"suite_end\",\"suite\":");
+    spz_write_json(r->out, suite, strlen(suite));
+    fprintf(r->out, ",\"passed\":%i,\"failed\":%i}\n", passed, failed);
+    fflush(r->out);
+}
+
+static void spz_jsonl_end(TestReporter* r, int failures)
+{
+    fprintf(r->out, "{\"event\":\"end\",\"failures\":%i}\n", failures);
+    fflush(r->out);
+}
+
+/**
+ * Returns a TestReporter writing one JSON object per event to the passed FILE*.
+ * @see TestReporter
+ * @param out Where to write the report.
+ * @return The reporter.
+ */
+TestReporter spz_jsonl_reporter(FILE* out)
+{
+    return (TestReporter) {
+        .begin = spz_jsonl_begin,
+        .suite_begin = spz_jsonl_suite_begin,
+        .test = spz_jsonl_test,
+        .suite_end = spz_jsonl_suite_end,
+        .end = spz_jsonl_end,
+        .out = out,
+    };
+}
+
+static void spz_tap_begin(TestReporter* r, int tests)
+{
+    fprintf(r->out, "TAP version 13\n1..%i\n", tests);
+    fflush(r->out);
+}
+
+static void spz_tap_suite_begin(TestReporter* r, const char* suite, int tests)
+{
+    fprintf(r->out, "# suite %s, %i tests\n", suite, tests);
+    fflush(r->out);
+}
+
+static void spz_tap_test(TestReporter* r, const char* suite, const Test* t, const TestResult* res)
+{
+    char msg[64];
+    const char* failure = spz_result_failure(res, msg, sizeof(msg));
+    fprintf(r->out, "%sok %i - %s::%s%s\n", (failure ? "not " : ""), r->count + 1, suite, t->name, (res->cached ? " # SKIP cached" : ""));
+    fprintf(r->out, "  ---\n  duration_s: %.6f\n  exit_code: %i\n", res->usage.wall_s, res->exit_code);
+    if (res->signum != -1) {
+        fprintf(r->out, "  signal: %i\n", res->signum);
+    }
+    if (failure) {
+        fprintf(r->out, "  message: \"%s\"\n", failure);
+    }
+    if (res->stdout_len > 0) {
+        fprintf(r->out, "  stdout: |\n");
+        spz_write_yaml_block(r->out, res->stdout_buf, res->stdout_len, "    ");
+    }
+    if (res->stderr_len > 0) {
+        fprintf(r->out, "  stderr: |\n");
+        spz_write_yaml_block(r->out, res->stderr_buf, res->stderr_len, "    ");
+    }
+    fprintf(r->out, "  ...\n");
+    fflush(r->out);
+}
+
+/**
+ * Returns a TestReporter writing TAP version 13 to the passed FILE*.
+ * Each test has a YAML block with its duration, exit code and output.
+ * @see TestReporter
+ * @param out Where to write the report.
+ * @return The reporter.
+ */
+TestReporter spz_tap_reporter(FILE* out)
+{
+    return (TestReporter) {
+        .begin = spz_tap_begin,
+        .suite_begin = spz_tap_suite_begin,
+        .test = spz_tap_test,
+        .out = out,
+    };
+}
+
+static void spz_durations_test(TestReporter* r, const char* suite, const Test* t, const TestResult* res)
+{
+    /* Tests not run took no time, which would unbalance shards */
+    if (res->cached || res->setup_failed) return;
+    fprintf(r->out, "%s::%s %.6f\n", suite, t->name, res->usage.wall_s);
+    fflush(r->out);
+}
+
+/**
+ * Returns a TestReporter writing the duration of each test to the passed
+ *  FILE*, as read by SPZ_RUN_OPTIONS__.shard_durations.
+ * Each line has a SUITE::TEST name followed by its duration in seconds.
+ * @see TestReporter
+ * @param out Where to write the report.
+ * @return The reporter.
+ */
+TestReporter spz_durations_reporter(FILE* out)
+{
+    return (TestReporter) {
+        .test = spz_durations_test,
+        .out = out,
+    };
+}
+
+/**
+ * Represents a test which passed in a previous run, as held by a SpzCache.
+ */
+typedef struct SpzCacheEntry {
+    uint64_t key; /**< Cache key of the test.*/
+    char* name; /**< SUITE::TEST name of the test, allocated.*/
+} SpzCacheEntry;
+
+/**
+ * Holds the keys of the tests which passed in previous runs, for
+ *  SPZ_RUN_OPTIONS__.changed.
+ * Keys mix the hash of the test binary with the name of the test, the
+ *  contents of its inputs and the options changing how it runs, so that any
+ *  change to them runs it again.
+ * @see spz_cache_key
+ */
+typedef struct SpzCache {
+    uint64_t binary; /**< Hash of the test binary.*/
+    SpzCacheEntry* entries; /**< Tests which passed, sorted by key.*/
+    int count; /**< Number of entries.*/
+} SpzCache;
+
+/**
+ * Mixes the contents of a file into a FNV-1a hash. A missing file mixes a
+ *  different value than an empty one.
+ * @param hash The hash so far.
+ * @param path The file.
+ * @param found Set to false when the file can't be read, may be NULL.
+ * @return The new hash.
+ */
+static uint64_t spz_hash_file(uint64_t hash, const char* path, bool* found)
+{
+    FILE* fp = fopen(path, "rb");
+    if (found) *found = (fp != NULL);
+    hash = spz_hash_bytes(hash, (fp ? "+" : "-"), 1);
+    if (!fp) return hash;
+    unsigned char buf[16384];
+    size_t len = 0;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        hash = spz_hash_bytes(hash, buf, len);
+    }
+    fclose(fp);
+    return hash;
+}
+
+/**
+ * Computes the cache key of a test: the hash of the binary, the SUITE::TEST
+ *  name, the options changing how it runs, the stdout/stderr records of the
+ *  test, and for fuzz targets the names of the files of their corpus, which
+ *  are hashes of their contents.
+ * The options are the effective timeout of the test, the number of property
+ *  inputs, the fuzzing limits, --in-process, and the seed when it was
+ *  passed. Random seeds are left out, or no run would ever be cached.
+ * @param cache The cache, holding the hash of the binary.
+ * @param suite The suite of the test.
+ * @param t The test.
+ * @param stdout_record_suffix Suffix used for stdout record, SPZ_STDOUT_SUFFIX when NULL.
+ * @param stderr_record_suffix Suffix used for stderr record, SPZ_STDERR_SUFFIX when NULL.
+ * @return The key.
+ */
+static uint64_t spz_cache_key(const SpzCache* cache, const TestSuite* suite, const Test* t, const char* stdout_record_suffix, const char* stderr_record_suffix)
+{
+    uint64_t name = spz_name_hash(suite->name, t->name);
+    uint64_t key = spz_hash_bytes(SPZ_FNV_OFFSET, &cache->binary, sizeof(cache->binary));
+    key = spz_hash_bytes(key, &name, sizeof(name));
+    int timeout_ms = spz_test_timeout(suite, t);
+    key = spz_hash_bytes(key, &timeout_ms, sizeof(timeout_ms));
+    key = spz_hash_bytes(key, &SPZ_RUN_OPTIONS__.prop_iters, sizeof(SPZ_RUN_OPTIONS__.prop_iters));
+    key = spz_hash_bytes(key, &SPZ_RUN_OPTIONS__.fuzz_runs, sizeof(SPZ_RUN_OPTIONS__.fuzz_runs));
+    key = spz_hash_bytes(key, &SPZ_RUN_OPTIONS__.fuzz_max_len, sizeof(SPZ_RUN_OPTIONS__.fuzz_max_len));
+    key = spz_hash_bytes(key, &SPZ_RUN_OPTIONS__.in_process, sizeof(SPZ_RUN_OPTIONS__.in_process));
+    uint64_t seed = (SPZ_RUN_OPTIONS__.seed_set ? SPZ_RUN_OPTIONS__.seed : 0);
+    key = spz_hash_bytes(key, &SPZ_RUN_OPTIONS__.seed_set, sizeof(SPZ_RUN_OPTIONS__.seed_set));
+    key = spz_hash_bytes(key, &seed, sizeof(seed));
+    char pathbuf[FILENAME_MAX] = {0};
+    spz_record_path(pathbuf, sizeof(pathbuf), t->name, (stdout_record_suffix ? stdout_record_suffix : SPZ_STDOUT_SUFFIX));
+    key = spz_hash_file(key, pathbuf, NULL);
+    spz_record_path(pathbuf, sizeof(pathbuf), t->name, (stderr_record_suffix ? stderr_record_suffix : SPZ_STDERR_SUFFIX));
+    key = spz_hash_file(key, pathbuf, NULL);
+    if (t->type == TEST_FUZZ) {
+        spz_record_path(pathbuf, sizeof(pathbuf), t->name, SPZ_FUZZ_SUFFIX);
+        struct dirent** entries = NULL;
+        int count = scandir(pathbuf, &entries, &spz_corpus_entry, &alphasort);
+        for (int i = 0; i < count; i++) {
+            key = spz_hash_bytes(key, entries[i]->d_name, strlen(entries[i]->d_name) + 1);
+            free(entries[i]);
+        }
+        free(entries);
+    }
+    return key;
+}
+
+/**
+ * Compares two cache keys.
+ */
+static int spz_cmp_cache_key(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Compares two SpzCacheEntry by key.
+ */
+static int spz_cmp_cache_entry(const void* a, const void* b)
+{
+    return spz_cmp_cache_key(&((const SpzCacheEntry*) a)->key, &((const SpzCacheEntry*) b)->key);
+}
+
+/**
+ * Checks if a cache holds a key.
+ * @param cache The cache.
+ * @param key The key.
+ * @return True when the test with that key passed before.
+ */
+static inline bool spz_cache_has(const SpzCache* cache, uint64_t key)
+{
+    SpzCacheEntry wanted = { .key = key, };
+    return (cache->count > 0 && bsearch(&wanted, cache->entries, cache->count, sizeof(SpzCacheEntry), spz_cmp_cache_entry) != NULL);
+}
+
+/**
+ * Frees the entries read by spz_cache_read().
+ * @param entries The entries.
+ * @param count The number of entries.
+ */
+static void spz_cache_free_entries(SpzCacheEntry* entries, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+/**
+ * Reads the entries of a cache file, sorted by key.
+ * The file starts with a "supozi-cache 2 BINARY" line, followed by a
+ *  "KEY SUITE::TEST" line for each test which passed, with hex hashes.
+ *  Files written for another binary, or in another version, have no
+ *  entries.
+ * @param fp The cache file.
+ * @param binary The hash of the test binary.
+ * @param entries Set to the entries, to free with spz_cache_free_entries().
+ * @return The number of entries.
+ */
+static int spz_cache_read(FILE* fp, uint64_t binary, SpzCacheEntry** entries)
+{
+    *entries = NULL;
+    unsigned long long file_binary = 0;
+    if (fscanf(fp, "supozi-cache 2 %llx", &file_binary) != 1 || file_binary != binary) {
+        return 0;
+    }
+    int count = 0;
+    int capacity = 0;
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t len = 0;
+    while ((len = getline(&line, &size, fp)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        unsigned long long key = 0;
+        int name_at = 0;
+        if (sscanf(line, "%llx %n", &key, &name_at) != 1 || name_at == 0 || line[name_at] == '\0') continue;
+        if (count == capacity) {
+            capacity = (capacity ? capacity * 2 : SPZ_INITIAL_CAPACITY);
+            SpzCacheEntry* grown = realloc(*entries, capacity * sizeof(SpzCacheEntry));
+            if (!grown) {
+                perror("failed growing cache");
+                exit(EXIT_FAILURE);
+            }
+            *entries = grown;
+        }
+        char* name = strdup(line + name_at);
+        if (!name) {
+            perror("failed copying cache entry");
+            exit(EXIT_FAILURE);
+        }
+        (*entries)[count++] = (SpzCacheEntry) { .key = key, .name = name, };
+    }
+    free(line);
+    if (count > 0) {
+        qsort(*entries, count, sizeof(SpzCacheEntry), spz_cmp_cache_entry);
+    }
+    return count;
+}
+
+/**
+ * Opens the cache of SPZ_RUN_OPTIONS__.changed, hashing the test binary
+ *  and reading the entries of the cache file. Entries written by another
+ *  binary are dropped.
+ * @see spz_cache_read
+ * @param cache The cache to fill.
+ * @param path The cache file.
+ * @return False when the binary can't be hashed, and caching is off.
+ */
+static bool spz_cache_open(SpzCache* cache, const char* path)
+{
+    *cache = (SpzCache) {0};
+    bool found = false;
+    cache->binary = spz_hash_file(SPZ_FNV_OFFSET, "/proc/self/exe", &found);
+    if (!found) {
+        fprintf(stderr, "%s(): can't read the test binary, running all tests\n", __func__);
+        return false;
+    }
+    FILE* fp = fopen(path, "r");
+    if (!fp) return true;
+    cache->count = spz_cache_read(fp, cache->binary, &cache->entries);
+    fclose(fp);
+    return true;
+}
+
+/**
+ * Writes the cache file of SPZ_RUN_OPTIONS__.changed after a run, adding
+ *  the tests which passed or were cached, and keeping the entries of the
+ *  tests not part of the run. Entries of the tests of the run with another
+ *  key are stale, and dropped.
+ * The file is locked while it is read again and merged, so that concurrent
+ *  runs sharing it don't lose each other's entries, and replaced at once
+ *  through a temporary file next to it.
+ * @param cache The cache read before the run.
+ * @param path The cache file.
+ * @param jobs The jobs of the run.
+ * @param count The number of jobs.
+ * @param suites The suites of the run, naming the tests.
+ */
+static void spz_cache_write(const SpzCache* cache, const char* path, const SpzJob* jobs, int count, const TestSuite* suites)
+{
+    char tmpbuf[FILENAME_MAX] = {0};
+    int len = snprintf(tmpbuf, sizeof(tmpbuf), "%s.XXXXXX", path);
+    if (len < 0 || (size_t) len >= sizeof(tmpbuf)) {
+        fprintf(stderr, "%s(): cache path {%s} is too long\n", __func__, path);
+        return;
+    }
+    /* Lock the file in place, as another run may replace it while we wait */
+    int fd = -1;
+    struct stat locked = {0};
+    for (;;) {
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd == -1 || flock(fd, LOCK_EX) == -1 || fstat(fd, &locked) == -1) {
+            fprintf(stderr, "%s(): failed locking {%s}: %s\n", __func__, path, strerror(errno));
+            if (fd != -1) close(fd);
+            return;
+        }
+        struct stat current = {0};
+        if (stat(path, &current) == 0 && current.st_dev == locked.st_dev && current.st_ino == locked.st_ino) break;
+        close(fd);
+    }
+    FILE* in = fdopen(fd, "r");
+    if (!in) {
+        fprintf(stderr, "%s(): failed reading {%s}: %s\n", __func__, path, strerror(errno));
+        close(fd);
+        return;
+    }
+    SpzCacheEntry* entries = NULL;
+    int entries_count = spz_cache_read(in, cache->binary, &entries);
+    uint64_t* names = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    if (!names) {
+        perror("failed allocating cache names");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        names[i] = spz_name_hash(suites[jobs[i].suite_idx].name, jobs[i].test.name);
+    }
+    qsort(names, count, sizeof(uint64_t), spz_cmp_cache_key);
+    int tmp_fd = mkstemp(tmpbuf);
+    FILE* out = (tmp_fd != -1 ? fdopen(tmp_fd, "w") : NULL);
+    if (out) {
+        /* mkstemp() files are private, keep the mode of the cache file */
+        fchmod(tmp_fd, locked.st_mode & 0777);
+        fprintf(out, "supozi-cache 2 %016llx\n", (unsigned long long) cache->binary);
+        for (int i = 0; i < count; i++) {
+            const SpzJob* job = &jobs[i];
+            if (job->result.exit_code != 0 || job->result.timed_out) continue;
+            fprintf(out, "%016llx %s::%s\n", (unsigned long long) job->cache_key, suites[job->suite_idx].name, job->test.name);
+        }
+        /* Entries of tests of the run are either written above or stale */
+        for (int i = 0; i < entries_count; i++) {
+            uint64_t name = spz_hash_bytes(SPZ_FNV_OFFSET, entries[i].name, strlen(entries[i].name));
+            if (count > 0 && bsearch(&name, names, count, sizeof(uint64_t), spz_cmp_cache_key)) continue;
+            fprintf(out, "%016llx %s\n", (unsigned long long) entries[i].key, entries[i].name);
+        }
+        if (fclose(out) != 0 || rename(tmpbuf, path) == -1) {
+            fprintf(stderr, "%s(): failed writing {%s}: %s\n", __func__, path, strerror(errno));
+            remove(tmpbuf);
+        }
+    } else {
+        fprintf(stderr, "%s(): failed opening {%s}: %s\n", __func__, tmpbuf, strerror(errno));
+        if (tmp_fd != -1) {
+            close(tmp_fd);
+            remove(tmpbuf);
+        }
+    }
+    free(names);
+    spz_cache_free_entries(entries, entries_count);
+    /* Closing the file releases the lock */
+    fclose(in);
+}
+
+/**
+ * Holds the state of a single TestSuite while its jobs are running.
+ * @see SpzRun
+ */
+typedef struct SpzSuiteRun {
+    const char* name; /**< Name of the suite.*/
+    SpzJob* jobs; /**< Jobs of the suite, a slice of the SpzRun jobs.*/
+    int count; /**< Number of jobs of the suite.*/
+    int done; /**< Counts reported jobs.*/
+    int failures; /**< Counts failed tests.*/
+    int successes; /**< Counts passed tests.*/
+    int cached; /**< Counts passed tests skipped by SPZ_RUN_OPTIONS__.changed.*/
+    fixture_setup_fn setup; /**< Setup of the suite fixture, NULL for none.*/
+    fixture_teardown_fn teardown; /**< Teardown of the suite fixture, NULL for none.*/
+    bool set_up; /**< Set once spz_suite_setup() ran.*/
+    bool setup_failed; /**< Set when the setup failed, failing all tests of the suite.*/
+    bool in_runner; /**< Set when the fixture runs in the runner.*/
+    bool in_server; /**< Set when the fixture runs in the fork server.*/
+} SpzSuiteRun;
+
+/**
+ * Holds the state of spz_run_suites() while its jobs are running.
+ * @see spz_run_job_cb
+ */
+typedef struct SpzRun {
+    SpzSuiteRun* suites; /**< State of each suite.*/
+    int suites_count; /**< Number of suites.*/
+    int current; /**< Index of the first suite not yet started.*/
+    bool registry; /**< When true, prints the per-suite registry lines.*/
+    int jobs; /**< Max number of children in flight.*/
+    int record; /**< When >0, turns on stdout/stderr recording.*/
+    const char* stdout_record_suffix; /**< Suffix used for stdout record.*/
+    const char* stderr_record_suffix; /**< Suffix used for stderr record.*/
+    int failures; /**< Counts failed tests across all suites.*/
+    const SpzCache* cache; /**< Keys of the tests which passed before, NULL unless SPZ_RUN_OPTIONS__.changed is set.*/
+} SpzRun;
+
+/**
+ * Runs the setup of a suite fixture, right before the first job of the suite
+ *  is spawned. The setup runs in the runner when any test of the suite runs
+ *  there, or is forked from it, and in the fork server when any is forked
+ *  from the server, so that the children inherit the fixture copy-on-write.
+ * @see SpzSuiteRun
+ * @param sr The suite about to start.
+ */
+static void spz_suite_setup(SpzSuiteRun* sr)
+{
+    sr->set_up = true;
+    if (!sr->setup && !sr->teardown) return;
+    bool use_server = (SPZ_FORK_SERVER__.pid > 0);
+    for (int i = 0; i < sr->count; i++) {
+        if (use_server && spz_test_forked(&sr->jobs[i].test)) {
+            sr->in_server = true;
+        } else {
+            sr->in_runner = true;
+        }
+    }
+    if (!sr->setup) return;
+    bool ok = true;
+    if (sr->in_runner) {
+        ok = sr->setup();
+    }
+    if (sr->in_server) {
+        ok = spz_fork_server_fixture(SPZ_FORK_REQ_SETUP, sr->setup, NULL) && ok;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s(): setup of suite {%s} failed\n", __func__, sr->name);
+        sr->setup_failed = true;
+    }
+}
+
+/**
+ * Runs the teardown of a suite fixture, where its setup ran.
+ * @see spz_suite_setup
+ * @param sr The suite which is done.
+ */
+static void spz_suite_teardown(SpzSuiteRun* sr)
+{
+    if (!sr->set_up || !sr->teardown) return;
+    if (sr->in_runner) {
+        sr->teardown();
+    }
+    if (sr->in_server) {
+        spz_fork_server_fixture(SPZ_FORK_REQ_TEARDOWN, NULL, sr->teardown);
+    }
+}
+
+/**
+ * Prints the summary of a TestSuite run by spz_run_suites(), including the
+ *  failures report. Closes the streams kept for failed tests.
+ * Also tears down the suite fixture.
+ * @see SpzSuiteRun
+ */
+static void spz_run_suite_end(SpzRun* run, SpzSuiteRun* sr)
+{
+    spz_suite_teardown(sr);
+    for (int i = 0; i < SPZ_REPORTERS_COUNT__; i++) {
+        TestReporter* r = &SPZ_REPORTERS__[i];
+        if (r->suite_end) r->suite_end(r, sr->name, sr->successes, sr->failures);
+    }
+    printf("[  Suite  ] {%s}: All tests completed. Failures: {%d}\n", sr->name, sr->failures);
+    printf("\nfailures:\n\n");
+    for (int i=0; i < sr->count; i++) {
+        SpzJob* job = &sr->jobs[i];
+        if (job->result.exit_code == 0) continue;
+        printf("---- %s::%s stdout ----\n", sr->name, job->test.name);
+        if (job->result.stdout_fp) {
+            int stdout_fd = fileno(job->result.stdout_fp);
+            spz_print_stream_to_file(stdout_fd, stdout);
+        }
+
+        printf("---- %s::%s stderr ----\n", sr->name, job->test.name);
+        if (job->result.stderr_fp) {
+            int stderr_fd = fileno(job->result.stderr_fp);
+            spz_print_stream_to_file(stderr_fd, stdout);
+        }
+        testresult_close(&job->result);
+    }
+    printf("\nfailures:\n");
+    for (int i=0; i < sr->count; i++) {
+        SpzJob* job = &sr->jobs[i];
+        if (job->result.exit_code == 0) continue;
+        if (job->result.setup_failed) {
+            printf("    %s::%s: suite setup failed\n", sr->name, job->test.name);
+        } else if (job->result.timed_out) {
+            printf("    %s::%s: timed out after {%i}ms\n", sr->name, job->test.name, job->child.timeout_ms);
+        } else if (job->result.signum != -1) {
+            printf("    %s::%s: exit code {%i}, signal {%i}\n", sr->name, job->test.name, job->result.exit_code, job->result.signum);
+        } else {
+            printf("    %s::%s: exit code {%i}\n", sr->name, job->test.name, job->result.exit_code);
+        }
+    }
+#ifndef SPZ_NOTIMER
+    /* Tests of a suite may overlap, so take the span from first start to last stop, cached ones never started */
+    double elapsed = 0;
+    int ran = 0;
+    while (ran < sr->count && sr->jobs[ran].result.cached) ran++;
+    if (ran < sr->count) {
+        struct timespec first = sr->jobs[ran].timer.start_time;
+        struct timespec last = sr->jobs[ran].timer.end_time;
+        for (int i=ran+1; i < sr->count; i++) {
+            if (sr->jobs[i].result.cached) continue;
+            struct timespec start = sr->jobs[i].timer.start_time;
+            struct timespec end = sr->jobs[i].timer.end_time;
+            if (start.tv_sec < first.tv_sec || (start.tv_sec == first.tv_sec && start.tv_nsec < first.tv_nsec)) first = start;
+            if (end.tv_sec > last.tv_sec || (end.tv_sec == last.tv_sec && end.tv_nsec > last.tv_nsec)) last = end;
+        }
+        elapsed = (last.tv_sec - first.tv_sec) + (last.tv_nsec - first.tv_nsec) / 1e9;
+    }
+#endif // SPZ_NOTIMER
+    printf("\ntest result: %s. %i passed; %i failed;", (sr->failures == 0 ? "\033[0;32PASSED\033[0m" : "\033[0;31mFAILED\033[0m"), sr->successes, sr->failures);
+    if (run->cache) {
+        printf(" %i cached;", sr->cached);
+    }
+#ifndef SPZ_NOTIMER
+    printf(" elapsed: %.2fs", elapsed);
+#endif // SPZ_NOTIMER
+    printf("\n");
+    if (run->registry) {
+        if (sr->failures > 0) {
+            printf("[ FAILED  ] Failures: {%d}\n", sr->failures);
+        } else {
+            printf("[ SUCCESS ]\n");
+        }
+        printf("[ DONE    ]\n");
+    }
+    run->failures += sr->failures;
+}
+
+/**
+ * Compares two SpzJob pointers by decreasing wall time.
+ */
+static int spz_cmp_job_wall(const void* a, const void* b)
+{
+    double x = (*(const SpzJob* const*) a)->result.usage.wall_s;
+    double y = (*(const SpzJob* const*) b)->result.usage.wall_s;
+    return (x < y) - (x > y);
+}
+
+/**
+ * Prints the resources used by the slowest jobs of a spz_run_suites() run.
+ * Skipped jobs, like cached tests or the ones of a failed suite setup, are
+ *  left out.
+ * @see TestUsage
+ * @param run The finished run.
+ * @param jobs The jobs of the run.
+ * @param count The number of jobs.
+ * @param n How many jobs to list.
+ */
+static void spz_run_print_slowest(SpzRun* run, SpzJob* jobs, int count, int n)
+{
+    if (n <= 0 || count <= 0) return;
+    SpzJob** sorted = malloc(count * sizeof(SpzJob*));
+    if (!sorted) {
+        perror("failed allocating slowest tests");
+        exit(EXIT_FAILURE);
+    }
+    int ran = 0;
+    for (int i = 0; i < count; i++) {
+        if (!jobs[i].skipped) sorted[ran++] = &jobs[i];
+    }
+    qsort(sorted, ran, sizeof(SpzJob*), spz_cmp_job_wall);
+    if (n > ran) n = ran;
+    if (n == 0) {
+        free(sorted);
+        return;
+    }
+    printf("\nslowest tests:\n");
+    for (int i = 0; i < n; i++) {
+        const TestUsage* u = &sorted[i]->result.usage;
+        printf("    %s::%s: %.3fs wall, %.3fs user, %.3fs sys, %ld KiB max rss, %ld/%ld minor/major faults, %ld/%ld voluntary/involuntary switches\n", run->suites[sorted[i]->suite_idx].name, sorted[i]->test.name, u->wall_s, u->user_s, u->sys_s, u->max_rss_kb, u->minor_faults, u->major_faults, u->voluntary_switches, u->involuntary_switches);
+    }
+    free(sorted);
+}
+
+/**
+ * Starts all suites up to the passed index, in order.
+ * Suites without tests are also ended right away.
+ * @see SpzRun
+ * @param run The run to advance.
+ * @param suite_idx Index of the last suite to start.
+ */
+static void spz_run_advance(SpzRun* run, int suite_idx)
+{
+    while (run->current <= suite_idx && run->current < run->suites_count) {
+        SpzSuiteRun* sr = &run->suites[run->current];
+        if (run->registry) {
+            printf("[  Suite  ] suite %s, %d tests\n", sr->name, sr->count);
+        }
+        for (int i = 0; i < SPZ_REPORTERS_COUNT__; i++) {
+            TestReporter* r = &SPZ_REPORTERS__[i];
+            if (r->suite_begin) r->suite_begin(r, sr->name, sr->count);
+        }
+        if (sr->count == 0) {
+            spz_run_suite_end(run, sr);
+        }
+        run->current++;
+    }
+}
+
+/**
+ * The spz_job_cb used by spz_run_suites() to print each test line, and
+ *  pass the result to each TestReporter.
+ * Suite fixtures are set up before the first job of their suite, whose jobs
+ *  all fail without running when the setup fails.
+ * Streams for successful tests are closed once reported, the ones for
+ *  failed tests are kept for the failures report of their suite.
+ * @see SpzRun
+ */
+static void spz_run_job_cb(SpzJob* job, SpzJobEvent ev, void* ctx)
+{
+    SpzRun* run = ctx;
+    SpzSuiteRun* sr = &run->suites[job->suite_idx];
+    if (ev == SPZ_JOB_PREPARE) {
+        /* Print the suite line before any output of its setup */
+        if (run->jobs == 1) spz_run_advance(run, job->suite_idx);
+        /* Cached tests don't need the suite set up */
+        if (run->cache && spz_cache_has(run->cache, job->cache_key)) {
+            job->result = (TestResult) { .exit_code = 0, .signum = -1, .cached = true, };
+            job->done = true;
+            return;
+        }
+        if (!sr->set_up) spz_suite_setup(sr);
+        if (sr->setup_failed) {
+            job->result = (TestResult) { .exit_code = 1, .signum = -1, .setup_failed = true, };
+            job->done = true;
+        }
+        return;
+    }
+    if (ev == SPZ_JOB_STARTED || run->jobs > 1) {
+        spz_run_advance(run, job->suite_idx);
+        printf(" => test %s::%s ... ", sr->name, job->test.name);
+        fflush(stdout);
+    }
+    if (ev != SPZ_JOB_DONE) return;
+    if (job->result.timed_out) {
+        printf("\033[0;31mTIMEOUT\033[0m\n");
+        sr->failures++;
+    } else if (job->result.exit_code != 0) {
+        printf("\033[0;31mFAILED\033[0m\n");
+        sr->failures++;
+    } else if (job->result.cached) {
+        printf("\033[0;32mcached\033[0m\n");
+        sr->successes++;
+        sr->cached++;
+    } else {
+        printf("\033[0;32mok\033[0m\n");
+        sr->successes++;
+        if (run->record > 0) {
+            spz_record_result(job->test.name, job->result, run->stdout_record_suffix, run->stderr_record_suffix);
+        }
+    }
+    spz_print_counters(&job->result.counters, 0);
+    fflush(stdout);
+    if (SPZ_REPORTERS_COUNT__ > 0) {
+        testresult_map(&job->result);
+    }
+    for (int i = 0; i < SPZ_REPORTERS_COUNT__; i++) {
+        TestReporter* r = &SPZ_REPORTERS__[i];
+        if (r->test) r->test(r, sr->name, &job->test, &job->result);
+        r->count++;
+    }
+    if (job->result.exit_code == 0 && !job->result.timed_out) {
+        testresult_close(&job->result);
+    }
+    sr->done++;
+    if (sr->done == sr->count) {
+        spz_run_suite_end(run, sr);
+    }
+}
+
+/**
+ * Run the tests of an array of TestSuite as a single queue of piped jobs.
+ * Up to SPZ_RUN_OPTIONS__.jobs tests run at the same time, regardless of
+ *  the suite they belong to, so a slow test does not hold back the next
+ *  suites. Per-suite output is still printed in registration order.
+ * With SPZ_RUN_OPTIONS__.changed, tests which passed with the same cache
+ *  key are reported as cached without running, and the cache file is
+ *  updated once all are done.
+ * @see SpzRun
+ * @see spz_run_jobs
+ * @param suites The suites to run.
+ * @param suites_count Number of suites.
+ * @param registry When true, prints the per-suite registry lines.
+ * @param record When >0, turns on stdout/stderr recording.
+ * @param stdout_record_suffix Suffix used for stdout record.
+ * @param stderr_record_suffix Suffix used for stderr record.
+ * @return 0 for success or number of errors occurred.
+ */
+static int spz_run_suites(const TestSuite* suites, int suites_count, bool registry, int record, const char* stdout_record_suffix, const char* stderr_record_suffix)
+{
+    int total = 0;
+    for (int i = 0; i < suites_count; i++) {
+        total += suites[i].test_count;
+    }
+    SpzJob* jobs = NULL;
+    SpzSuiteRun* suite_runs = NULL;
+    if (total > 0) {
+        jobs = calloc(total, sizeof(SpzJob));
+        if (!jobs) {
+            perror("failed allocating jobs");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (suites_count > 0) {
+        suite_runs = calloc(suites_count, sizeof(SpzSuiteRun));
+        if (!suite_runs) {
+            perror("failed allocating suite runs");
+            exit(EXIT_FAILURE);
+        }
+    }
+    SpzCache cache = {0};
+    const char* cache_path = (SPZ_RUN_OPTIONS__.cache_path ? SPZ_RUN_OPTIONS__.cache_path : "." SPZ_PATH_SEPARATOR "supozi" SPZ_CACHE_SUFFIX);
+    bool use_cache = (SPZ_RUN_OPTIONS__.changed && spz_cache_open(&cache, cache_path));
+    int queued = 0;
+    for (int i = 0; i < suites_count; i++) {
+        suite_runs[i].name = suites[i].name;
+        suite_runs[i].jobs = jobs + queued;
+        suite_runs[i].count = suites[i].test_count;
+        suite_runs[i].setup = suites[i].setup;
+        suite_runs[i].teardown = suites[i].teardown;
+        for (int j = 0; j < suites[i].test_count; j++) {
+            jobs[queued].test = suites[i].tests[j];
+            jobs[queued].suite_idx = i;
+            jobs[queued].child.timeout_ms = spz_test_timeout(&suites[i], &suites[i].tests[j]);
+            if (use_cache) {
+                jobs[queued].cache_key = spz_cache_key(&cache, &suites[i], &suites[i].tests[j], stdout_record_suffix, stderr_record_suffix);
+            }
+            queued++;
+        }
+    }
+    for (int i = 0; i < SPZ_REPORTERS_COUNT__; i++) {
+        TestReporter* r = &SPZ_REPORTERS__[i];
+        r->count = 0;
+        if (r->begin) r->begin(r, total);
+    }
+    SpzRun run = {
+        .suites = suite_runs,
+        .suites_count = suites_count,
+        .registry = registry,
+        .jobs = SPZ_RUN_OPTIONS__.jobs,
+        .record = record,
+        .stdout_record_suffix = stdout_record_suffix,
+        .stderr_record_suffix = stderr_record_suffix,
+        .cache = (use_cache ? &cache : NULL),
+    };
+    spz_run_jobs(jobs, total, run.jobs, spz_run_job_cb, &run);
+    spz_run_advance(&run, suites_count-1);
+    if (registry) {
+        spz_run_print_slowest(&run, jobs, total, SPZ_RUN_OPTIONS__.slowest);
+    }
+    for (int i = 0; i < SPZ_REPORTERS_COUNT__; i++) {
+        TestReporter* r = &SPZ_REPORTERS__[i];
+        if (r->end) r->end(r, run.failures);
+    }
+    if (use_cache) {
+        spz_cache_write(&cache, cache_path, jobs, total, suites);
+        spz_cache_free_entries(cache.entries, cache.count);
+    }
+    free(jobs);
+    free(suite_runs);
+    return run.failures;
+}
+
+#endif // SPZ_NOPIPE
+
+/**
+ * Run a TestSuite. Wrapper of run_suite_record_ptr.
+ * @see TestSuite
+ * @see run_suite_record_ptr
+ * @param suite The suite to run.
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_suite(TestSuite suite, int piped) {
+    return run_suite_record_ptr(&suite, piped, 0, NULL, NULL);
+}
+
+/**
+ * Run a TestSuite. Wrapper of run_suite_record_ptr.
+ * @see TestSuite
+ * @see run_suite_record_ptr
+ * @param suite The suite to run.
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @param record When >0, turns on stdout/stderr recording.
+ * @param stdout_record_suffix Suffix used for stdout record.
+ * @param stderr_record_suffix Suffix used for stderr record.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_suite_record(TestSuite suite, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
+    return run_suite_record_ptr(&suite, piped, record, stdout_record_suffix, stderr_record_suffix);
+}
+
+/**
+ * Run a TestSuite without copying it. Wrapper of run_suite_record_ptr.
+ * @see TestSuite
+ * @see run_suite_record_ptr
+ * @param suite The suite to run.
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_suite_ptr(const TestSuite* suite, int piped) {
+    return run_suite_record_ptr(suite, piped, 0, NULL, NULL);
+}
+
+/**
+ * Run a TestSuite without copying it.
+ * When piped, up to SPZ_RUN_OPTIONS__.jobs tests run at the same time, while
+ *  results are still printed in registration order.
+ * @see TestSuite
+ * @see SPZ_RUN_OPTIONS__
+ * @see spz_run_suites
+ * @param suite The suite to run.
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @param record When >0, turns on stdout/stderr recording.
+ * @param stdout_record_suffix Suffix used for stdout record.
+ * @param stderr_record_suffix Suffix used for stderr record.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_suite_record_ptr(const TestSuite* suite, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
+#ifndef SPZ_NOPIPE
+    if (piped > 0) {
+        return spz_run_suites(suite, 1, false, record, stdout_record_suffix, stderr_record_suffix);
+    }
+#endif // SPZ_NOPIPE
+    int failures = 0;
+    int successes = 0;
+
+#ifndef SPZ_NOTIMER
+    DumbTimer timer = dt_new();
+#endif // SPZ_NOTIMER
+
+    bool fixture_ok = true;
+    if (suite->test_count > 0 && suite->setup) {
+        fixture_ok = suite->setup();
+        if (!fixture_ok) {
+            fprintf(stderr, "%s(): setup of suite {%s} failed\n", __func__, suite->name);
+        }
+    }
+    for (int i = 0; i < suite->test_count; i++) {
+        printf(" => test %s::%s ... ", suite->name, suite->tests[i].name);
+        fflush(stdout);
+        int res = (fixture_ok ? run_test(suite->tests[i]) : 1);
+        if (res != 0) {
+            printf("\033[0;31mFAILED\033[0m, res: {%d}\n", res);
+            failures++;
+        } else {
+            printf("\033[0;32mok\033[0m\n");
+            successes++;
+        }
+    }
+    if (suite->test_count > 0 && suite->teardown) {
+        suite->teardown();
+    }
+
+#ifndef SPZ_NOTIMER
+    double elapsed = dt_stop(&timer);
+#endif // SPZ_NOTIMER
+
+    printf("[  Suite  ] {%s}: All tests completed. Failures: {%d}\n", suite->name, failures);
+
+#ifndef SPZ_NOTIMER
+    printf("\ntest result: %s. %i passed; %i failed; elapsed: %.2fs\n", (failures == 0 ? "\033[0;32PASSED\033[0m" : "\033[0;31mFAILED\033[0m"), successes, failures, elapsed);
+#else
+    printf("\ntest result: %s. %i passed; %i failed;\n", (failures == 0 ? "\033[0;32PASSED\033[0m" : "\033[0;31mFAILED\033[0m"), successes, failures);
+#endif // SPZ_NOTIMER
+    return failures;
+}
+
+/**
+ * Run all TestSuites in global TestRegistry. Wrapper of run_tests_record.
+ * @see SPZ_TEST_REGISTRY__
+ * @see run_tests_record
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_tests(int piped) {
+    return run_tests_record(piped, 0, NULL, NULL);
+}
+
+/**
+ * Run all TestSuites in global TestRegistry. Wrapper of run_testregistry_record_ptr.
+ * @see SPZ_TEST_REGISTRY__
+ * @see run_testregistry_record_ptr
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @param record When >0, turns on stdout/stderr recording.
+ * @param stdout_record_suffix Suffix used for stdout record.
+ * @param stderr_record_suffix Suffix used for stderr record.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_tests_record(int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
+    return run_testregistry_record_ptr(&SPZ_TEST_REGISTRY__, piped, record, stdout_record_suffix, stderr_record_suffix);
+}
+
+/**
+ * Run all TestSuites in passed TestRegistry. Wrapper of run_testregistry_record_ptr.
+ * @see TestRegistry
+ * @see run_testregistry_record_ptr
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_testregistry(TestRegistry tr, int piped) {
+    return run_testregistry_record_ptr(&tr, piped, 0, NULL, NULL);
+}
+
+/**
+ * Run all TestSuites in passed TestRegistry. Wrapper of run_testregistry_record_ptr.
+ * @see TestRegistry
+ * @see run_testregistry_record_ptr
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @param record When >0, turns on stdout/stderr recording.
+ * @param stdout_record_suffix Suffix used for stdout record.
+ * @param stderr_record_suffix Suffix used for stderr record.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_testregistry_record(TestRegistry tr, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
+    return run_testregistry_record_ptr(&tr, piped, record, stdout_record_suffix, stderr_record_suffix);
+}
+
+/**
+ * Run all TestSuites in passed TestRegistry without copying it.
+ * Wrapper of run_testregistry_record_ptr.
+ * @see TestRegistry
+ * @see run_testregistry_record_ptr
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @return 0 for success or number of errors occurred.
+ */
+int run_testregistry_ptr(const TestRegistry* tr, int piped) {
+    return run_testregistry_record_ptr(tr, piped, 0, NULL, NULL);
+}
+
+/**
+ * Builds a TestRegistry with the selected tests of another one, keeping
+ *  their order. Suites without selected tests are left out.
+ * @param tr The TestRegistry to select from.
+ * @param selected One flag per test, in registration order.
+ * @param subset The TestRegistry to fill. Caller must free it with free_testregistry().
+ */
+static void spz_registry_subset(const TestRegistry* tr, const bool* selected, TestRegistry* subset)
+{
+    *subset = (TestRegistry) { .suites_count = -1, };
+    int offset = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        const TestSuite* suite = &tr->suites[i];
+        bool registered = false;
+        for (int j = 0; j < suite->test_count; j++) {
+            if (!selected[offset + j]) continue;
+            if (!registered) {
+                register_test_suite_toreg(subset, suite->name);
+                set_suite_timeout_toreg(subset, suite->timeout_ms);
+                set_suite_fixture_toreg(subset, suite->setup, suite->teardown);
+                registered = true;
+            }
+            if (!spz_suite_push_test(&subset->suites[subset->suites_count], suite->tests[j])) {
+                perror("failed growing selection");
+                exit(EXIT_FAILURE);
+            }
+        }
+        offset += suite->test_count;
+    }
+}
+
+/**
+ * Represents a line of a shard durations file.
+ * @see spz_read_durations
+ */
+typedef struct SpzDuration {
+    char* name; /**< SUITE::TEST name.*/
+    double seconds; /**< Duration of the test.*/
+} SpzDuration;
+
+static int spz_cmp_duration(const void* a, const void* b)
+{
+    return strcmp(((const SpzDuration*) a)->name, ((const SpzDuration*) b)->name);
+}
+
+/**
+ * Reads a durations file, as written by spz_durations_reporter(). Each line
+ *  is a SUITE::TEST name, followed by a space and the seconds it took.
+ * @param path The file to read.
+ * @param count Set to the number of durations read.
+ * @return The durations sorted by name, NULL when the file can't be read.
+ *  Caller must free each name and the array.
+ */
+static SpzDuration* spz_read_durations(const char* path, int* count)
+{
+    *count = 0;
+    FILE* file = fopen(path, "r");
+    if (!file) return NULL;
+    SpzDuration* durations = NULL;
+    int capacity = 0;
+    char line[FILENAME_MAX];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        /* Names may have spaces, the duration is after the last one */
+        char* sep = strrchr(line, ' ');
+        if (!sep || sep == line) continue;
+        char* end = NULL;
+        double seconds = strtod(sep + 1, &end);
+        if (end == sep + 1 || *end != '\0' || !(seconds >= 0)) continue;
+        *sep = '\0';
+        if (*count == capacity) {
+            capacity = (capacity > 0 ? capacity * 2 : SPZ_INITIAL_CAPACITY);
+            SpzDuration* new_durations = realloc(durations, capacity * sizeof(SpzDuration));
+            if (!new_durations) {
+                perror("failed growing durations");
+                exit(EXIT_FAILURE);
+            }
+            durations = new_durations;
+        }
+        char* name = malloc(strlen(line) + 1);
+        if (!name) {
+            perror("failed allocating duration name");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(name, line);
+        durations[(*count)++] = (SpzDuration) { .name = name, .seconds = seconds, };
+    }
+    fclose(file);
+    if (*count > 0) {
+        qsort(durations, *count, sizeof(SpzDuration), spz_cmp_duration);
+    }
+    return (durations ? durations : calloc(1, sizeof(SpzDuration)));
+}
+
+/**
+ * Represents a test while spz_shard_select() balances shards.
+ */
+typedef struct SpzShardItem {
+    int idx; /**< Index of the test, in registration order.*/
+    double seconds; /**< Expected duration.*/
+    uint64_t hash; /**< Hash of the test name, used to break ties.*/
+} SpzShardItem;
+
+static int spz_cmp_shard_item(const void* a, const void* b)
+{
+    const SpzShardItem* x = a;
+    const SpzShardItem* y = b;
+    if (x->seconds != y->seconds) return (x->seconds < y->seconds) - (x->seconds > y->seconds);
+    if (x->hash != y->hash) return (x->hash > y->hash) - (x->hash < y->hash);
+    return x->idx - y->idx;
+}
+
+/**
+ * Selects the tests of a TestRegistry belonging to a shard.
+ * Without a durations file, a test belongs to the shard given by the hash
+ *  of its name modulo the shard count. With one, tests are assigned from
+ *  the longest, each to the shard with the least expected time so far.
+ *  Tests missing from the file are expected to take the mean of the known
+ *  ones. Every shard computes the same assignment, as long as all of them
+ *  read the same file.
+ * @see spz_name_hash
+ * @param tr The TestRegistry to split.
+ * @param selected Set for the tests of the shard, one flag per test in registration order.
+ * @param index Index of the shard, from 0.
+ * @param count Number of shards.
+ * @param durations_path Path to a durations file, or NULL.
+ * @return The number of selected tests.
+ */
+static int spz_shard_select(const TestRegistry* tr, bool* selected, int index, int count, const char* durations_path)
+{
+    int total = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        total += tr->suites[i].test_count;
+    }
+    SpzShardItem* items = calloc(total+1, sizeof(SpzShardItem));
+    if (!items) {
+        perror("failed allocating shard items");
+        exit(EXIT_FAILURE);
+    }
+    int durations_count = 0;
+    SpzDuration* durations = NULL;
+    if (durations_path) {
+        durations = spz_read_durations(durations_path, &durations_count);
+        if (!durations) {
+            fprintf(stderr, "%s(): failed reading durations {%s}, splitting by hash\n", __func__, durations_path);
+        }
+    }
+    int known = 0;
+    double known_sum = 0;
+    int n = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        const TestSuite* suite = &tr->suites[i];
+        for (int j = 0; j < suite->test_count; j++) {
+            items[n] = (SpzShardItem) { .idx = n, .seconds = -1, .hash = spz_name_hash(suite->name, suite->tests[j].name), };
+            if (durations_count > 0) {
+                char name[FILENAME_MAX];
+                snprintf(name, sizeof(name), "%s::%s", suite->name, suite->tests[j].name);
+                SpzDuration key = { .name = name, };
+                SpzDuration* found = bsearch(&key, durations, durations_count, sizeof(SpzDuration), spz_cmp_duration);
+                if (found) {
+                    items[n].seconds = found->seconds;
+                    known_sum += found->seconds;
+                    known++;
+                }
+            }
+            n++;
+        }
+    }
+    int selected_count = 0;
+    if (!durations) {
+        for (int i = 0; i < total; i++) {
+            selected[i] = (items[i].hash % (uint64_t) count) == (uint64_t) index;
+            if (selected[i]) selected_count++;
+        }
+    } else {
+        double fallback = (known > 0 ? known_sum / known : 1);
+        for (int i = 0; i < total; i++) {
+            if (items[i].seconds < 0) items[i].seconds = fallback;
+        }
+        qsort(items, total, sizeof(SpzShardItem), spz_cmp_shard_item);
+        double* loads = calloc(count, sizeof(double));
+        if (!loads) {
+            perror("failed allocating shard loads");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < total; i++) {
+            int target = 0;
+            for (int s = 1; s < count; s++) {
+                if (loads[s] < loads[target]) target = s;
+            }
+            loads[target] += items[i].seconds;
+            selected[items[i].idx] = (target == index);
+            if (target == index) selected_count++;
+        }
+        free(loads);
+        for (int i = 0; i < durations_count; i++) {
+            free(durations[i].name);
+        }
+        free(durations);
+    }
+    free(items);
+    return selected_count;
+}
+
+/**
+ * Internal helper of run_testregistry_record_ptr(), running a TestRegistry
+ *  after sharding.
+ * @see run_testregistry_record_ptr
+ */
+static int spz_run_testregistry(const TestRegistry* tr, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
+    int failures = 0;
+    printf("Running all test suites...\n");
+#ifndef SPZ_NOPIPE
+    if (piped > 0) {
+        failures = spz_run_suites(tr->suites, tr->suites_count+1, true, record, stdout_record_suffix, stderr_record_suffix);
+        printf("All tests completed. Failures: {%d}\n", failures);
+        return failures;
+    }
+#endif // SPZ_NOPIPE
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        const TestSuite* suite = &tr->suites[i];
+        printf("[  Suite  ] suite %s, %d tests\n", suite->name, suite->test_count);
+        int res = run_suite_record_ptr(suite, piped, record, stdout_record_suffix, stderr_record_suffix);
+        if (res > 0) {
+            printf("[ FAILED  ] Failures: {%d}\n", res);
+        } else {
+            printf("[ SUCCESS ]\n");
+        }
+        failures += res;
+        printf("[ DONE    ]\n");
+    }
+    printf("All tests completed. Failures: {%d}\n", failures);
+    return failures;
+}
+
+/**
+ * Run all TestSuites in a TestRegistry without copying it.
+ * When piped, all tests of all suites are scheduled as a single queue.
+ * When SPZ_RUN_OPTIONS__.shard_count is > 1, only the tests of the shard
+ *  selected by SPZ_RUN_OPTIONS__.shard_index are run.
+ * @see TestRegistry
+ * @see spz_run_suites
+ * @see spz_shard_select
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @param record When >0, turns on stdout/stderr recording.
+ * @param stdout_record_suffix Suffix used for stdout record.
+ * @param stderr_record_suffix Suffix used for stderr record.
+ * @return 0 for success, number of errors occurred, or -1 for an invalid shard.
+ */
+int run_testregistry_record_ptr(const TestRegistry* tr, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
+    int shard_count = SPZ_RUN_OPTIONS__.shard_count;
+    int shard_index = SPZ_RUN_OPTIONS__.shard_index;
+    if (shard_count <= 1) {
+        return spz_run_testregistry(tr, piped, record, stdout_record_suffix, stderr_record_suffix);
+    }
+    if (shard_index < 0 || shard_index >= shard_count) {
+        fprintf(stderr, "%s(): shard index {%d} out of range for {%d} shards\n", __func__, shard_index, shard_count);
+        return -1;
+    }
+    int total = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        total += tr->suites[i].test_count;
+    }
+    bool* selected = calloc(total+1, sizeof(bool));
+    if (!selected) {
+        perror("failed allocating selection");
+        exit(EXIT_FAILURE);
+    }
+    int count = spz_shard_select(tr, selected, shard_index, shard_count, SPZ_RUN_OPTIONS__.shard_durations);
+    printf("Running shard {%d} of {%d}: {%d} of {%d} tests\n", shard_index, shard_count, count, total);
+    TestRegistry subset = {0};
+    spz_registry_subset(tr, selected, &subset);
+    free(selected);
+    int res = spz_run_testregistry(&subset, piped, record, stdout_record_suffix, stderr_record_suffix);
+    free_testregistry(&subset);
+    return res;
+}
+
+/**
+ * Matches a string against a glob pattern of pattern_len bytes.
+ * Supports '*', '?', bracket expressions like [abc], [a-z] and [!abc], and
+ *  '\' to escape the next character.
+ * @param pattern The glob pattern.
+ * @param pattern_len Length of the pattern.
+ * @param str The string to match.
+ * @return True if the whole string matches.
+ */
+static bool spz_glob_match(const char* pattern, size_t pattern_len, const char* str)
+{
+    size_t p = 0;
+    const char* star_p = NULL;
+    const char* star_s = NULL;
+    while (*str) {
+        if (p < pattern_len && pattern[p] == '*') {
+            star_p = pattern + (++p);
+            star_s = str;
+            continue;
+        }
+        bool matched = false;
+        size_t next = p + 1;
+        if (p < pattern_len) {
+            if (pattern[p] == '?') {
+                matched = true;
+            } else if (pattern[p] == '[') {
+                size_t q = p + 1;
+                bool negate = (q < pattern_len && (pattern[q] == '!' || pattern[q] == '^'));
+                if (negate) q++;
+                bool in_set = false;
+                bool first = true;
+                while (q < pattern_len && (first || pattern[q] != ']')) {
+                    first = false;
+                    char lo = pattern[q];
+                    char hi = lo;
+                    if (q+2 < pattern_len && pattern[q+1] == '-' && pattern[q+2] != ']') {
+                        hi = pattern[q+2];
+                        q += 2;
+                    }
+                    if (*str >= lo && *str <= hi) in_set = true;
+                    q++;
+                }
+                if (q < pattern_len) {
+                    matched = (in_set != negate);
+                    next = q + 1;
+                } else {
+                    /* Unterminated bracket, match it literally */
+                    matched = (*str == '[');
+                }
+            } else if (pattern[p] == '\\' && p+1 < pattern_len) {
+                matched = (*str == pattern[p+1]);
+                next = p + 2;
+            } else {
+                matched = (*str == pattern[p]);
+            }
+        }
+        if (matched) {
+            p = next;
+            str++;
+        } else if (star_p) {
+            p = star_p - pattern;
+            str = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern_len && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern_len;
+}
+
+/**
+ * Checks if a filter passed to run_testregistry_filter() is a glob pattern.
+ * @param filter The filter to check.
+ * @return True if the filter contains glob metacharacters.
+ */
+static inline bool spz_is_glob(const char* filter)
+{
+    return strpbrk(filter, "*?[\\") != NULL;
+}
+
+/**
+ * Selects the tests of a TestRegistry matching a list of filters, as
+ *  described for run_testregistry_filter().
+ * @see run_testregistry_filter
+ * @param tr The TestRegistry to select from.
+ * @param filters The names or patterns to select.
+ * @param filters_count The number of filters.
+ * @param selected Set for the selected tests, one flag per test in registration order.
+ * @return 0 for success, -1 for unknown names or when no test matched.
+ */
+static int spz_filter_select(const TestRegistry* tr, const char** filters, int filters_count, bool* selected)
+{
+    int total = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        total += tr->suites[i].test_count;
+    }
+    bool has_includes = false;
+    for (int f = 0; f < filters_count; f++) {
+        if (filters[f][0] != '!') {
+            has_includes = true;
+            break;
+        }
+    }
+    for (int i = 0; i < total; i++) {
+        selected[i] = !has_includes;
+    }
+    for (int f = 0; f < filters_count; f++) {
+        bool exclude = (filters[f][0] == '!');
+        const char* filter = filters[f] + (exclude ? 1 : 0);
+        if (!spz_is_glob(filter)) {
+            int suite_idx = -1;
+            int test_idx = -1;
+            if (!lookup_testregistry(tr, filter, &suite_idx, &test_idx)) {
+                fprintf(stderr, "%s(): unknown suite or test {%s}\n", __func__, filter);
+                return -1;
+            }
+            int offset = 0;
+            for (int i = 0; i < suite_idx; i++) {
+                offset += tr->suites[i].test_count;
+            }
+            if (test_idx == -1) {
+                for (int j = 0; j < tr->suites[suite_idx].test_count; j++) {
+                    selected[offset + j] = !exclude;
+                }
+            } else {
+                selected[offset + test_idx] = !exclude;
+            }
+            continue;
+        }
+        const char* sep = strstr(filter, "::");
+        size_t suite_pattern_len = (sep ? (size_t) (sep - filter) : strlen(filter));
+        const char* test_pattern = (sep ? sep + 2 : NULL);
+        int offset = 0;
+        for (int i = 0; i < tr->suites_count+1; i++) {
+            const TestSuite* suite = &tr->suites[i];
+            if (spz_glob_match(filter, suite_pattern_len, suite->name)) {
+                for (int j = 0; j < suite->test_count; j++) {
+                    if (!test_pattern || spz_glob_match(test_pattern, strlen(test_pattern), suite->tests[j].name)) {
+                        selected[offset + j] = !exclude;
+                    }
+                }
+            }
+            offset += suite->test_count;
+        }
+    }
+    if (filters_count == 0) return 0;
+    for (int i = 0; i < total; i++) {
+        if (selected[i]) return 0;
+    }
+    fprintf(stderr, "%s(): no tests matched\n", __func__);
+    return -1;
+}
+
+/**
+ * Run the tests matching a list of filters in a TestRegistry, with a single
+ *  run_testregistry_record_ptr() call.
+ * Each filter is either a SUITE or SUITE::TEST name, resolved with
+ *  lookup_testregistry(), or a glob pattern. Patterns without "::" match
+ *  suite names, while SUITE::TEST patterns match the suite and test parts
+ *  separately. Filters starting with '!' exclude the tests they match.
+ * Filters are applied in order, so later ones win. When only exclusions are
+ *  passed, all tests are included first.
+ * Selected tests keep their registration order, and are run once even when
+ *  matched more than once.
+ * @see TestRegistry
+ * @see lookup_testregistry
+ * @see run_testregistry_record_ptr
+ * @param tr The TestRegistry to run from.
+ * @param filters The names or patterns to run.
+ * @param filters_count The number of filters.
+ * @param piped When >0, turns on stdout/stderr piping.
+ * @return 0 for success, number of errors occurred, or -1 for unknown names
+ *  or when no test matched.
+ */
+int run_testregistry_filter(const TestRegistry* tr, const char** filters, int filters_count, int piped) {
+    int total = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        total += tr->suites[i].test_count;
+    }
+    bool* selected = calloc(total+1, sizeof(bool));
+    if (!selected) {
+        perror("failed allocating selection");
+        exit(EXIT_FAILURE);
+    }
+    if (spz_filter_select(tr, filters, filters_count, selected) < 0) {
+        free(selected);
+        return -1;
+    }
+    TestRegistry subset = {0};
+    spz_registry_subset(tr, selected, &subset);
+    free(selected);
+    int res = run_testregistry_record_ptr(&subset, piped, 0, NULL, NULL);
+    free_testregistry(&subset);
+    return res;
+}
+
+/**
+ * Returns the name of a Test_Type, as printed by list_testregistry().
+ */
+static inline const char* spz_test_type_name(Test_Type type)
+{
+    switch (type) {
+        case TEST_VOID: return "void";
+        case TEST_INT: return "int";
+        case TEST_BOOL: return "bool";
+        case TEST_PARAMETERIZED: return "param";
+        case TEST_FUZZ: return "fuzz";
+    }
+    return "unknown";
+}
+
+/**
+ * Prints the tests of a TestRegistry matching a list of filters, without
+ *  running them. Filters work like for run_testregistry_filter(), and all
+ *  tests are listed when none is passed.
+ * Each test has a stable ID, the hex hash of its SUITE::TEST name, which
+ *  is also used for sharding.
+ * The text format has one "ID TYPE SUITE::TEST" line per test. The JSON
+ *  format is an array of suites, each with its tests.
+ * @see run_testregistry_filter
+ * @see spz_name_hash
+ * @param tr The TestRegistry to list.
+ * @param filters The names or patterns to list.
+ * @param filters_count The number of filters.
+ * @param json When true, prints JSON instead of text.
+ * @return 0 for success, -1 for unknown names or when no test matched.
+ */
+int list_testregistry(const TestRegistry* tr, const char** filters, int filters_count, bool json) {
+    int total = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        total += tr->suites[i].test_count;
+    }
+    bool* selected = calloc(total+1, sizeof(bool));
+    if (!selected) {
+        perror("failed allocating selection");
+        exit(EXIT_FAILURE);
+    }
+    if (spz_filter_select(tr, filters, filters_count, selected) < 0) {
+        free(selected);
+        return -1;
+    }
+    if (json) printf("[");
+    const char* suite_sep = "";
+    int offset = 0;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        const TestSuite* suite = &tr->suites[i];
+        bool listed = false;
+        for (int j = 0; j < suite->test_count; j++) {
+            if (!selected[offset + j]) continue;
+            const Test* t = &suite->tests[j];
+            unsigned long long id = spz_name_hash(suite->name, t->name);
+            if (!json) {
+                printf("%016llx %s %s::%s\n", id, spz_test_type_name(t->type), suite->name, t->name);
+                continue;
+            }
+            if (!listed) {
+                printf("%s\n{\"suite\":", suite_sep);
+                spz_write_json(stdout, suite->name, strlen(suite->name));
+                printf(",\"timeout_ms\":%i,\"tests\":[", suite->timeout_ms);
+                suite_sep = ",";
+                listed = true;
+            } else {
+                printf(",");
+            }
+            printf("\n  {\"id\":\"%016llx\",\"name\":", id);
+            spz_write_json(stdout, t->name, strlen(t->name));
+            printf(",\"type\":\"%s\",\"timeout_ms\":%i,\"unsafe\":%s}", spz_test_type_name(t->type), t->timeout_ms, (t->unsafe ? "true" : "false"));
+        }
+        if (listed) printf("]}");
+        offset += suite->test_count;
+    }
+    if (json) printf("\n]\n");
+    free(selected);
+    return 0;
+}
+
+#ifndef SPZ_NOTIMER
+/**
+ * Computes a square root with Newton's method, so that linking libm is not needed.
+ */
+static double spz_sqrt(double x)
+{
+    if (x <= 0) return 0;
+    double r = (x > 1 ? x : 1);
+    for (int i = 0; i < 64; i++) {
+        double next = (r + x / r) / 2;
+        if (next >= r) break;
+        r = next;
+    }
+    return r;
+}
+
+static int spz_cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static double spz_sorted_median(const double* v, int n)
+{
+    if (n <= 0) return 0;
+    return (n % 2 ? v[n/2] : (v[n/2-1] + v[n/2]) / 2);
+}
+
+/**
+ * Represents a benchmark baseline read by spz_read_bench_baseline().
+ */
+typedef struct SpzBenchBaseline {
+    double median_ns; /**< Median of the recorded samples.*/
+    double mad_ns; /**< Median absolute deviation of the recorded samples.*/
+    int samples; /**< Number of recorded samples.*/
+    double* samples_ns; /**< The recorded samples, must be freed.*/
+} SpzBenchBaseline;
+
+/**
+ * Writes a BenchResult as baseline file.
+ * @param filepath Path to the baseline file.
+ * @param res The result to write.
+ * @return True on success.
+ */
+static bool spz_write_bench_baseline(const char* filepath, const BenchResult* res)
+{
+    FILE* file = fopen(filepath, "w");
+    if (!file) {
+        fprintf(stderr, "%s(): failed opening baseline at {%s}\n", __func__, filepath);
+        return false;
+    }
+    fprintf(file, "median_ns %.17g\nmad_ns %.17g\nsamples %d\n", res->median_ns, res->mad_ns, res->samples);
+    for (int i = 0; i < res->samples; i++) {
+        fprintf(file, "%.17g\n", res->samples_ns[i]);
+    }
+    return fclose(file) == 0;
+}
+
+/**
+ * Reads a baseline file written by spz_write_bench_baseline().
+ * @param filepath Path to the baseline file.
+ * @param base The baseline to fill. Caller must free its samples_ns.
+ * @return 1 on success, 0 for malformed files, -1 when the file can't be opened.
+ */
+static int spz_read_bench_baseline(const char* filepath, SpzBenchBaseline* base)
+{
+    *base = (SpzBenchBaseline) {0};
+    FILE* file = fopen(filepath, "r");
+    if (!file) return -1;
+    if (fscanf(file, "median_ns %lf mad_ns %lf samples %d", &base->median_ns, &base->mad_ns, &base->samples) != 3 || base->samples <= 0 || base->samples > 1000000) {
+        fclose(file);
+        return 0;
+    }
+    base->samples_ns = malloc(base->samples * sizeof(double));
+    if (!base->samples_ns) {
+        perror("failed allocating baseline samples");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < base->samples; i++) {
+        if (fscanf(file, "%lf", &base->samples_ns[i]) != 1) {
+            free(base->samples_ns);
+            base->samples_ns = NULL;
+            fclose(file);
+            return 0;
+        }
+    }
+    fclose(file);
+    return 1;
+}
+
+/**
+ * Represents a sample ranked by spz_mann_whitney_z().
+ */
+typedef struct SpzRankedSample {
+    double v; /**< The sample.*/
+    bool cur; /**< Set for the new samples, clear for the baseline ones.*/
+} SpzRankedSample;
+
+static int spz_cmp_ranked_sample(const void* a, const void* b)
+{
+    double x = ((const SpzRankedSample*) a)->v;
+    double y = ((const SpzRankedSample*) b)->v;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Computes the z score of the Mann-Whitney U test for the new samples being
+ *  slower than the baseline ones, with the normal approximation corrected
+ *  for ties. Positive values mean the new samples rank higher.
+ * @param base Baseline samples.
+ * @param n1 Number of baseline samples.
+ * @param cur New samples.
+ * @param n2 Number of new samples.
+ * @return The z score.
+ */
+static double spz_mann_whitney_z(const double* base, int n1, const double* cur, int n2)
+{
+    int n = n1 + n2;
+    /* Sort all samples, keeping track of which side they come from */
+    SpzRankedSample* all = malloc(n * sizeof(SpzRankedSample));
+    if (!all) {
+        perror("failed allocating samples");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n1; i++) {
+        all[i].v = base[i];
+        all[i].cur = false;
+    }
+    for (int i = 0; i < n2; i++) {
+        all[n1 + i].v = cur[i];
+        all[n1 + i].cur = true;
+    }
+    qsort(all, n, sizeof(SpzRankedSample), spz_cmp_ranked_sample);
+    double rank_sum = 0;
+    double ties = 0;
+    for (int i = 0; i < n; ) {
+        int j = i;
+        while (j < n && all[j].v == all[i].v) j++;
+        /* Tied samples share the average of their ranks */
+        double rank = (i + 1 + j) / 2.0;
+        for (int k = i; k < j; k++) {
+            if (all[k].cur) rank_sum += rank;
+        }
+        double t = j - i;
+        ties += t * t * t - t;
+        i = j;
+    }
+    free(all);
+    double u = rank_sum - (double) n2 * (n2 + 1) / 2;
+    double mean = (double) n1 * n2 / 2;
+    double var = (double) n1 * n2 / 12 * ((n + 1) - ties / ((double) n * (n - 1)));
+    if (var <= 0) return 0;
+    /* Continuity correction */
+    double diff = u - mean;
+    diff = (diff > 0.5 ? diff - 0.5 : (diff < -0.5 ? diff + 0.5 : 0));
+    return diff / spz_sqrt(var);
+}
+
+/**
+ * Run a Bench, calibrating the iterations of each sample to
+ *  SPZ_BENCH_SAMPLE_MS, warming up for SPZ_BENCH_WARMUP_MS and then taking
+ *  SPZ_BENCH_SAMPLES samples.
+ * @see Bench
+ * @see BenchResult
+ * @param b The benchmark to run.
+ * @return The statistics of the samples.
+ */
+BenchResult run_bench(Bench b)
+{
+    const double target = SPZ_BENCH_SAMPLE_MS / 1e3;
+    DumbTimer warmup = dt_new();
+    /* Grow iters until a sample lasts at least the target */
+    uint64_t iters = 1;
+    for (;;) {
+        DumbTimer dt = dt_new();
+        b.func(iters);
+        double elapsed = dt_stop(&dt);
+        if (elapsed >= target || iters >= (UINT64_MAX / 16)) break;
+        double scale = (elapsed > 0 ? target / elapsed * 1.2 : 10);
+        if (scale < 2) scale = 2;
+        if (scale > 10) scale = 10;
+        iters = (uint64_t) (iters * scale);
+    }
+    while (dt_elapsed(&warmup) * 1e3 < SPZ_BENCH_WARMUP_MS) {
+        b.func(iters);
+    }
+    BenchResult res = {
+        .iters = iters,
+        .samples = SPZ_BENCH_SAMPLES,
+    };
+    SpzPerf perf = {0};
+    if (SPZ_RUN_OPTIONS__.perf) {
+        spz_perf_open(&perf, 0, false);
+    }
+    double* samples = res.samples_ns;
+    double sum = 0;
+    spz_perf_enable(&perf, true);
+    for (int i = 0; i < SPZ_BENCH_SAMPLES; i++) {
+        DumbTimer dt = dt_new();
+        b.func(iters);
+        samples[i] = dt_stop(&dt) * 1e9 / iters;
+        sum += samples[i];
+    }
+    spz_perf_enable(&perf, false);
+    spz_perf_close(&perf, &res.counters);
+    qsort(samples, SPZ_BENCH_SAMPLES, sizeof(double), spz_cmp_double);
+    res.min_ns = samples[0];
+    res.mean_ns = sum / SPZ_BENCH_SAMPLES;
+    res.median_ns = spz_sorted_median(samples, SPZ_BENCH_SAMPLES);
+    /* Nearest rank */
+    int p99 = (SPZ_BENCH_SAMPLES * 99 + 99) / 100 - 1;
+    res.p99_ns = samples[p99];
+    double var = 0;
+    double deviations[SPZ_BENCH_SAMPLES];
+    for (int i = 0; i < SPZ_BENCH_SAMPLES; i++) {
+        var += (samples[i] - res.mean_ns) * (samples[i] - res.mean_ns);
+        deviations[i] = (samples[i] > res.median_ns ? samples[i] - res.median_ns : res.median_ns - samples[i]);
+    }
+    res.stddev_ns = (SPZ_BENCH_SAMPLES > 1 ? spz_sqrt(var / (SPZ_BENCH_SAMPLES - 1)) : 0);
+    qsort(deviations, SPZ_BENCH_SAMPLES, sizeof(double), spz_cmp_double);
+    res.mad_ns = spz_sorted_median(deviations, SPZ_BENCH_SAMPLES);
+    return res;
+}
+
+/**
+ * Checks if a Bench of a TestSuite matches a list of filters, as described
+ *  for run_benches_filter().
+ * @param suite The suite of the benchmark.
+ * @param b The benchmark.
+ * @param filters The names or patterns to run.
+ * @param filters_count The number of filters.
+ * @param has_includes True when some filter is not an exclusion.
+ * @return True when the benchmark is selected.
+ */
+static bool spz_bench_selected(const TestSuite* suite, const Bench* b, const char** filters, int filters_count, bool has_includes)
+{
+    bool selected = !has_includes;
+    for (int f = 0; f < filters_count; f++) {
+        bool exclude = (filters[f][0] == '!');
+        const char* filter = filters[f] + (exclude ? 1 : 0);
+        const char* sep = strstr(filter, "::");
+        size_t suite_pattern_len = (sep ? (size_t) (sep - filter) : strlen(filter));
+        if (spz_glob_match(filter, suite_pattern_len, suite->name) && (!sep || spz_glob_match(sep + 2, strlen(sep + 2), b->name))) {
+            selected = !exclude;
+        }
+    }
+    return selected;
+}
+#endif // SPZ_NOTIMER
+
+/**
+ * Run all benchmarks in global TestRegistry. Wrapper of run_benches_filter.
+ * @see SPZ_TEST_REGISTRY__
+ * @see run_benches_filter
+ * @return 0 for success, -1 when benchmarks are not available.
+ */
+int run_benches(void) {
+    return run_benches_filter(&SPZ_TEST_REGISTRY__, NULL, 0);
+}
+
+/**
+ * Run the benchmarks of a TestRegistry matching a list of filters, in
+ *  registration order, printing the statistics of each one.
+ * Filters are SUITE or SUITE::BENCH names or glob patterns, with the same
+ *  rules as run_testregistry_filter(). No filters run all benchmarks, while
+ *  filters matching none are an error.
+ * Benchmarks run in the calling process, one at a time.
+ * @see run_bench
+ * @see run_testregistry_filter
+ * @param tr The TestRegistry to run from.
+ * @param filters The names or patterns to run.
+ * @param filters_count The number of filters.
+ * @return 0 for success, -1 when benchmarks are not available or none matched.
+ */
+int run_benches_filter(const TestRegistry* tr, const char** filters, int filters_count) {
+    return run_benches_record_filter(tr, filters, filters_count, SPZ_BENCH_RUN, NULL);
+}
+
+/**
+ * Run the benchmarks of a TestRegistry matching a list of filters, like
+ *  run_benches_filter(), then record or check their baselines.
+ * Baselines are written to ./SUITE.NAME followed by the suffix, so that
+ *  benchmarks of different suites can share a name. Checking runs a one-sided Mann-Whitney U test
+ *  against the recorded samples, and reports a regression when the slowdown
+ *  is significant and the median is more than SPZ_RUN_OPTIONS__.bench_threshold
+ *  percent slower. Benchmarks without a baseline are reported, not failed.
+ * @see run_benches_filter
+ * @see BenchMode
+ * @param tr The TestRegistry to run from.
+ * @param filters The names or patterns to run.
+ * @param filters_count The number of filters.
+ * @param mode What to do with the results.
+ * @param bench_record_suffix Suffix used for baselines, SPZ_BENCH_SUFFIX when NULL.
+ * @return 0 for success, number of regressions, or -1 when benchmarks are not
+ *  available or none matched.
+ */
+int run_benches_record_filter(const TestRegistry* tr, const char** filters, int filters_count, BenchMode mode, const char* bench_record_suffix) {
+#ifndef SPZ_NOTIMER
+    if (!bench_record_suffix) {
+        bench_record_suffix = SPZ_BENCH_SUFFIX;
+    }
+    int regressions = 0;
+    bool has_includes = false;
+    for (int f = 0; f < filters_count; f++) {
+        if (filters[f][0] != '!') {
+            has_includes = true;
+            break;
+        }
+    }
+    int ran = 0;
+    int matched = 0;
+    printf("Running benchmarks...\n");
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        const TestSuite* suite = &tr->suites[i];
+        int suite_matched = 0;
+        for (int j = 0; j < suite->bench_count; j++) {
+            if (spz_bench_selected(suite, &suite->benches[j], filters, filters_count, has_includes)) suite_matched++;
+        }
+        matched += suite_matched;
+        bool announced = false;
+        for (int j = 0; j < suite->bench_count && suite_matched > 0; j++) {
+            const Bench* b = &suite->benches[j];
+            if (!spz_bench_selected(suite, b, filters, filters_count, has_includes)) continue;
+            if (!announced) {
+                printf("[  Bench  ] suite %s, %d benchmarks\n", suite->name, suite_matched);
+                announced = true;
+                if (suite->setup && !suite->setup()) {
+                    printf("    setup of suite {%s} failed, skipping its benchmarks\n", suite->name);
+                    break;
+                }
+            }
+            printf(" => bench %s::%s ... ", suite->name, b->name);
+            fflush(stdout);
+            BenchResult res = run_bench(*b);
+            printf("%.2f ns/op (min %.2f, p99 %.2f, mean %.2f ± %.2f), %i x %llu iters\n", res.median_ns, res.min_ns, res.p99_ns, res.mean_ns, res.stddev_ns, res.samples, (unsigned long long) res.iters);
+            spz_print_counters(&res.counters, res.iters * res.samples);
+            ran++;
+            if (mode == SPZ_BENCH_RUN) continue;
+            char pathbuf[FILENAME_MAX] = {0};
+            snprintf(pathbuf, sizeof(pathbuf), ".%s%s.%s%s", SPZ_PATH_SEPARATOR, suite->name, b->name, bench_record_suffix);
+            if (mode == SPZ_BENCH_RECORD) {
+                if (!spz_write_bench_baseline(pathbuf, &res)) {
+                    fprintf(stderr, "%s(): failed writing baseline {%s}\n", __func__, pathbuf);
+                }
+                continue;
+            }
+            SpzBenchBaseline base = {0};
+            int read_res = spz_read_bench_baseline(pathbuf, &base);
+            if (read_res != 1) {
+                printf("    baseline {%s} %s\n", pathbuf, (read_res == -1 ? "not found" : "is malformed"));
+                continue;
+            }
+            double z = spz_mann_whitney_z(base.samples_ns, base.samples, res.samples_ns, res.samples);
+            double change = (base.median_ns > 0 ? (res.median_ns / base.median_ns - 1) * 100 : 0);
+            bool regressed = (z > SPZ_BENCH_CHECK_Z && change > SPZ_RUN_OPTIONS__.bench_threshold);
+            printf("    baseline %.2f ns/op ± %.2f, change %+.2f%%, z %.2f: %s\n", base.median_ns, base.mad_ns, change, z, (regressed ? "\033[0;31mREGRESSION\033[0m" : "\033[0;32mok\033[0m"));
+            if (regressed) regressions++;
+            free(base.samples_ns);
+        }
+        if (announced && suite->teardown) {
+            suite->teardown();
+        }
+    }
+    if (filters_count > 0 && matched == 0) {
+        fprintf(stderr, "%s(): no benchmarks matched\n", __func__);
+        return -1;
+    }
+    if (mode == SPZ_BENCH_CHECK) {
+        printf("All benchmarks completed. Ran: {%d}, regressions: {%d}\n", ran, regressions);
+    } else {
+        printf("All benchmarks completed. Ran: {%d}\n", ran);
+    }
+    return regressions;
+#else
+    (void) tr;
+    (void) filters;
+    (void) filters_count;
+    (void) mode;
+    (void) bench_record_suffix;
+    fprintf(stderr, "%s(): benchmarks need the timer, build without SPZ_NOTIMER\n", __func__);
+    return -1;
+#endif // SPZ_NOTIMER
+}
+
+#ifndef SPZ_NOPIPE
+/* Compilers which can't leave the coverage callbacks uninstrumented get none, as they would recurse */
+#if defined(__clang__)
+#define SPZ_NO_COVERAGE __attribute__((no_sanitize("coverage")))
+#elif defined(__GNUC__) && __GNUC__ >= 12
+#define SPZ_NO_COVERAGE __attribute__((no_sanitize_coverage))
+#endif // __clang__
+
+/**
+ * Represents an operand of a comparison made by a fuzzed child.
+ */
+typedef struct SpzFuzzCmp {
+    uint64_t value; /**< The operand, 0 for unused slots.*/
+    size_t width; /**< Size of the operand, in bytes.*/
+} SpzFuzzCmp;
+
+static unsigned char* SPZ_FUZZ_MAP__ = NULL; /**< Edge hit counts, shared with the fuzzed children.*/
+static SpzFuzzCmp* SPZ_FUZZ_CMPS__ = NULL; /**< Comparison operands, shared with the fuzzed children after the map.*/
+static volatile bool SPZ_FUZZ_ACTIVE__ = false; /**< Set by fuzzed children while calling the target.*/
+static uintptr_t SPZ_FUZZ_PREV__ = 0; /**< Slot of the previous location, shifted, to tell edges apart.*/
+static fuzz_fn SPZ_FUZZ_TARGET__ = NULL; /**< Target called by the next fuzzed child.*/
+static const unsigned char* SPZ_FUZZ_INPUT__ = NULL; /**< Input passed to the next fuzzed child.*/
+static size_t SPZ_FUZZ_INPUT_LEN__ = 0; /**< Length of the input passed to the next fuzzed child.*/
+
+#ifdef SPZ_NO_COVERAGE
+/**
+ * Counts a hit of the edge from the previous location to the passed one,
+ *  like AFL does.
+ * @param loc The id of the location.
+ */
+static inline SPZ_NO_COVERAGE void spz_fuzz_hit(uint64_t loc)
+{
+    uintptr_t slot = (uintptr_t) ((loc * 0x9E3779B97F4A7C15ULL) >> 32) & (SPZ_FUZZ_MAP_SIZE - 1);
+    SPZ_FUZZ_MAP__[slot ^ SPZ_FUZZ_PREV__]++;
+    SPZ_FUZZ_PREV__ = slot >> 1;
+}
+
+/**
+ * Numbers the guards of -fsanitize-coverage=trace-pc-guard, as clang calls
+ *  it for each instrumented module. Weak, so that a sanitizer runtime or
+ *  libFuzzer can take over.
+ */
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_pc_guard_init(uint32_t* start, uint32_t* stop)
+{
+    static uint32_t guards = 0;
+    if (start == stop || *start) return;
+    for (uint32_t* guard = start; guard < stop; guard++) {
+        *guard = ++guards;
+    }
+}
+
+/**
+ * Called by -fsanitize-coverage=trace-pc-guard on each edge.
+ */
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_pc_guard(uint32_t* guard)
+{
+    if (!SPZ_FUZZ_ACTIVE__ || !*guard) return;
+    spz_fuzz_hit(*guard);
+}
+
+/**
+ * Called by -fsanitize-coverage=trace-pc on each basic block, the only mode
+ *  gcc has. The return address tells the blocks apart.
+ */
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_pc(void)
+{
+    if (!SPZ_FUZZ_ACTIVE__) return;
+    spz_fuzz_hit((uintptr_t) __builtin_return_address(0));
+}
+
+/**
+ * Reports an operand of a comparison, so that it can be written into later
+ *  inputs. Operands share slots by hash, keeping the last one.
+ * @param value The operand.
+ * @param width The size of the operand.
+ */
+static inline SPZ_NO_COVERAGE void spz_fuzz_cmp(uint64_t value, size_t width)
+{
+    if (!SPZ_FUZZ_ACTIVE__ || value == 0) return;
+    SpzFuzzCmp* slot = &SPZ_FUZZ_CMPS__[((value * 0x9E3779B97F4A7C15ULL) >> 32) % SPZ_FUZZ_CMP_SLOTS];
+    slot->value = value;
+    slot->width = width;
+}
+
+/*
+ * Called by -fsanitize-coverage=trace-cmp on comparisons, with a constant
+ *  as first operand for the const variants.
+ */
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_const_cmp1(uint8_t a, uint8_t b) { (void) b; spz_fuzz_cmp(a, 1); }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_const_cmp2(uint16_t a, uint16_t b) { (void) b; spz_fuzz_cmp(a, 2); }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_const_cmp4(uint32_t a, uint32_t b) { (void) b; spz_fuzz_cmp(a, 4); }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_const_cmp8(uint64_t a, uint64_t b) { (void) b; spz_fuzz_cmp(a, 8); }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_cmp1(uint8_t a, uint8_t b) { spz_fuzz_cmp(a, 1); spz_fuzz_cmp(b, 1); }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_cmp2(uint16_t a, uint16_t b) { spz_fuzz_cmp(a, 2); spz_fuzz_cmp(b, 2); }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_cmp4(uint32_t a, uint32_t b) { spz_fuzz_cmp(a, 4); spz_fuzz_cmp(b, 4); }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_cmp8(uint64_t a, uint64_t b) { spz_fuzz_cmp(a, 8); spz_fuzz_cmp(b, 8); }
+/* gcc also traces floating point comparisons, which are of no use here */
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_cmpf(float a, float b) { (void) a; (void) b; }
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_cmpd(double a, double b) { (void) a; (void) b; }
+
+/**
+ * Called by -fsanitize-coverage=trace-cmp on switches. cases holds the
+ *  number of cases, the width of the value in bits, then the cases.
+ */
+SPZ_NO_COVERAGE __attribute__((weak)) void __sanitizer_cov_trace_switch(uint64_t value, void* table)
+{
+    (void) value;
+    const uint64_t* cases = table;
+    for (uint64_t i = 0; i < cases[0]; i++) {
+        spz_fuzz_cmp(cases[2 + i], (size_t) (cases[1] / 8));
+    }
+}
+#endif // SPZ_NO_COVERAGE
+
+/**
+ * Represents an input of the corpus of fuzz_testregistry().
+ */
+typedef struct SpzFuzzInput {
+    unsigned char* data; /**< The input, allocated.*/
+    size_t len; /**< Length of the input.*/
+} SpzFuzzInput;
+
+/**
+ * Represents the comparison operands collected by fuzz_testregistry().
+ * Once full, new operands replace the oldest ones.
+ */
+typedef struct SpzFuzzDict {
+    SpzFuzzCmp entries[SPZ_FUZZ_DICT_SIZE]; /**< The operands.*/
+    int count; /**< Number of operands held.*/
+    int next; /**< Index of the next operand to replace, once full.*/
+} SpzFuzzDict;
+
+/**
+ * Test run in the fuzzed children, calling SPZ_FUZZ_TARGET__ on a copy of
+ *  SPZ_FUZZ_INPUT__ sized to fit, so that sanitizers catch overflows.
+ * @return The result of the target.
+ */
+static bool spz_fuzz_child(void)
+{
+    unsigned char* data = malloc(SPZ_FUZZ_INPUT_LEN__ ? SPZ_FUZZ_INPUT_LEN__ : 1);
+    if (!data) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(data, SPZ_FUZZ_INPUT__, SPZ_FUZZ_INPUT_LEN__);
+    SPZ_FUZZ_PREV__ = 0;
+    SPZ_FUZZ_ACTIVE__ = true;
+    bool res = SPZ_FUZZ_TARGET__(data, SPZ_FUZZ_INPUT_LEN__);
+    SPZ_FUZZ_ACTIVE__ = false;
+    free(data);
+    return res;
+}
+
+/**
+ * Runs the fuzzed child for an input, as a piped test.
+ * @param t The test running spz_fuzz_child().
+ * @param timeout_ms The timeout in milliseconds.
+ * @return The result of the child.
+ */
+static TestResult spz_fuzz_exec(Test t, int timeout_ms)
+{
+    run_piped__(TestResult, t, timeout_ms);
+}
+
+/**
+ * Returns the AFL bucket of a hit count, so that only changes across
+ *  buckets count as new coverage.
+ */
+static inline unsigned char spz_fuzz_bucket(unsigned char hits)
+{
+    if (hits <= 2) return hits;
+    if (hits == 3) return 4;
+    if (hits < 8) return 8;
+    if (hits < 16) return 16;
+    if (hits < 32) return 32;
+    if (hits < 128) return 64;
+    return 128;
+}
+
+/**
+ * Merges the buckets hit by the last child into the ones seen so far.
+ * @param seen The buckets seen so far, per slot.
+ * @param edges Increased by the number of slots hit for the first time.
+ * @return The number of slots with a new bucket.
+ */
+static int spz_fuzz_merge(unsigned char* seen, int* edges)
+{
+    int fresh = 0;
+    for (size_t w = 0; w < SPZ_FUZZ_MAP_SIZE; w += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, SPZ_FUZZ_MAP__ + w, sizeof(word));
+        if (!word) continue;
+        for (size_t i = w; i < w + sizeof(uint64_t); i++) {
+            if (!SPZ_FUZZ_MAP__[i]) continue;
+            unsigned char bucket = spz_fuzz_bucket(SPZ_FUZZ_MAP__[i]);
+            if (!(bucket & ~seen[i])) continue;
+            if (!seen[i]) (*edges)++;
+            seen[i] |= bucket;
+            fresh++;
+        }
+    }
+    return fresh;
+}
+
+/**
+ * Adds the comparison operands reported by the last child to a dictionary.
+ * @param dict The dictionary to add to.
+ */
+static void spz_fuzz_merge_cmps(SpzFuzzDict* dict)
+{
+    for (int i = 0; i < SPZ_FUZZ_CMP_SLOTS; i++) {
+        const SpzFuzzCmp* cmp = &SPZ_FUZZ_CMPS__[i];
+        if (cmp->value == 0 || cmp->width == 0 || cmp->width > sizeof(uint64_t)) continue;
+        bool known = false;
+        for (int j = 0; j < dict->count && !known; j++) {
+            known = (dict->entries[j].value == cmp->value && dict->entries[j].width == cmp->width);
+        }
+        if (known) continue;
+        if (dict->count < SPZ_FUZZ_DICT_SIZE) {
+            dict->entries[dict->count++] = *cmp;
+        } else {
+            dict->entries[dict->next] = *cmp;
+            dict->next = (dict->next + 1) % SPZ_FUZZ_DICT_SIZE;
+        }
+    }
+}
 
 /**
- * Run a TestSuite. Wrapper of run_suite_record.
- * @see TestSuite
- * @see run_suite_record
- * @param suite The suite to run.
- * @param piped When >0, turns on stdout/stderr piping.
- * @return 0 for success or number of errors occurred.
+ * Returns a random value in [0, n), n > 0.
  */
-int run_suite(TestSuite suite, int piped) {
-    return run_suite_record(suite, piped, 0, NULL, NULL);
+static inline size_t spz_fuzz_rand(uint64_t* rng, size_t n)
+{
+    return (size_t) (spz_rand_next(rng) % n);
 }
 
 /**
- * Run a TestSuite.
- * @see TestSuite
- * @param suite The suite to run.
- * @param piped When >0, turns on stdout/stderr piping.
- * @param record When >0, turns on stdout/stderr recording.
- * @param stdout_record_suffix Suffix used for stdout record.
- * @param stderr_record_suffix Suffix used for stderr record.
- * @return 0 for success or number of errors occurred.
+ * Applies a stack of random mutations to an input: bit flips, random,
+ *  nudged and interesting values, insertions, erasures, chunks copied
+ *  from the input itself or from another one of the corpus, and operands of
+ *  comparisons made by the target.
+ * @param rng The random state.
+ * @param buf The input, with room for max_len bytes.
+ * @param len The length of the input.
+ * @param max_len The longest input to generate.
+ * @param corpus The corpus to splice from.
+ * @param corpus_count The number of inputs of the corpus.
+ * @param dict The comparison operands.
+ * @return The new length of the input.
  */
-int run_suite_record(TestSuite suite, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
-    int failures = 0;
-    int successes = 0;
-#ifndef SPZ_NOPIPE
-    int exit_codes[MAX_TESTS] = {0};
-    FILE* error_streams[MAX_TESTS][2] = {0};
-    const char* failed[MAX_TESTS] = {0};
-#endif // SPZ_NOPIPE
+static size_t spz_fuzz_mutate(uint64_t* rng, unsigned char* buf, size_t len, size_t max_len, const SpzFuzzInput* corpus, int corpus_count, const SpzFuzzDict* dict)
+{
+    static const int64_t interesting[] = { 0, 1, -1, 16, 32, 64, 100, 127, -128, 255, 256, 1000, 1024, 4096, 32767, -32768, 65535, 65536, INT32_MAX, INT32_MIN, };
+    int stack = 1 << spz_fuzz_rand(rng, 4);
+    for (int s = 0; s < stack; s++) {
+        size_t op = spz_fuzz_rand(rng, (dict->count > 0 ? 10 : 8));
+        /* Only insertions work on empty inputs */
+        if (len == 0 && op < 8) op = 4;
+        switch (op) {
+            case 0: {
+                buf[spz_fuzz_rand(rng, len)] ^= (unsigned char) (1u << spz_fuzz_rand(rng, 8));
+            }
+            break;
+            case 1: {
+                buf[spz_fuzz_rand(rng, len)] = (unsigned char) spz_rand_next(rng);
+            }
+            break;
+            case 2: {
+                buf[spz_fuzz_rand(rng, len)] += (unsigned char) (spz_fuzz_rand(rng, 35) - 17);
+            }
+            break;
+            case 3: {
+                size_t width = (size_t) 1 << spz_fuzz_rand(rng, 3);
+                if (width > len) width = len;
+                size_t pos = spz_fuzz_rand(rng, len - width + 1);
+                uint64_t value = (uint64_t) interesting[spz_fuzz_rand(rng, sizeof(interesting) / sizeof(interesting[0]))];
+                bool big_endian = spz_fuzz_rand(rng, 2);
+                for (size_t k = 0; k < width; k++) {
+                    buf[pos + (big_endian ? width - 1 - k : k)] = (unsigned char) (value >> (8 * k));
+                }
+            }
+            break;
+            case 4: {
+                if (len >= max_len) break;
+                size_t room = max_len - len;
+                size_t n = 1 + spz_fuzz_rand(rng, (room < 16 ? room : 16));
+                size_t pos = spz_fuzz_rand(rng, len + 1);
+                memmove(buf + pos + n, buf + pos, len - pos);
+                /* Either random bytes, or a run of the same one */
+                bool run = spz_fuzz_rand(rng, 2);
+                unsigned char fill = (unsigned char) spz_rand_next(rng);
+                for (size_t k = 0; k < n; k++) {
+                    buf[pos + k] = (run ? fill : (unsigned char) spz_rand_next(rng));
+                }
+                len += n;
+            }
+            break;
+            case 5: {
+                size_t n = 1 + spz_fuzz_rand(rng, (len < 16 ? len : 16));
+                size_t pos = spz_fuzz_rand(rng, len - n + 1);
+                memmove(buf + pos, buf + pos + n, len - pos - n);
+                len -= n;
+            }
+            break;
+            case 6: {
+                size_t n = 1 + spz_fuzz_rand(rng, len);
+                size_t from = spz_fuzz_rand(rng, len - n + 1);
+                size_t to = spz_fuzz_rand(rng, len - n + 1);
+                memmove(buf + to, buf + from, n);
+            }
+            break;
+            case 7: {
+                const SpzFuzzInput* other = &corpus[spz_fuzz_rand(rng, (size_t) corpus_count)];
+                if (other->len == 0) break;
+                size_t n = 1 + spz_fuzz_rand(rng, other->len);
+                size_t from = spz_fuzz_rand(rng, other->len - n + 1);
+                size_t to = spz_fuzz_rand(rng, len + 1);
+                if (to + n > max_len) n = max_len - to;
+                memcpy(buf + to, other->data + from, n);
+                if (to + n > len) len = to + n;
+            }
+            break;
+            default: {
+                /* Write an operand over the input, or insert it */
+                const SpzFuzzCmp* cmp = &dict->entries[spz_fuzz_rand(rng, (size_t) dict->count)];
+                bool insert = (len < cmp->width || spz_fuzz_rand(rng, 2));
+                if (insert && len + cmp->width > max_len) break;
+                size_t pos = spz_fuzz_rand(rng, (insert ? len : len - cmp->width) + 1);
+                if (insert) {
+                    memmove(buf + pos + cmp->width, buf + pos, len - pos);
+                    len += cmp->width;
+                }
+                bool big_endian = spz_fuzz_rand(rng, 2);
+                for (size_t k = 0; k < cmp->width; k++) {
+                    buf[pos + (big_endian ? cmp->width - 1 - k : k)] = (unsigned char) (cmp->value >> (8 * k));
+                }
+            }
+            break;
+        }
+    }
+    return len;
+}
 
-#ifndef SPZ_NOTIMER
-    DumbTimer timer = dt_new();
-#endif // SPZ_NOTIMER
+/**
+ * Writes an input to a file.
+ * @return true on success.
+ */
+static bool spz_write_file(const char* path, const unsigned char* data, size_t len)
+{
+    FILE* fp = fopen(path, "wb");
+    if (!fp) return false;
+    bool ok = (fwrite(data, 1, len, fp) == len);
+    return (fclose(fp) == 0 && ok);
+}
 
-    for (int i = 0; i < suite.test_count; i++) {
-        printf(" => test %s::%s ... ", suite.name, suite.tests[i].name);
-        fflush(stdout);
+/**
+ * Looks up a fuzz target by SUITE::TEST name, or by TEST name alone in any
+ *  suite.
+ * @return true when found.
+ */
+static bool spz_fuzz_lookup(const TestRegistry* tr, const char* name, int* suite_idx, int* test_idx)
+{
+    if (lookup_testregistry(tr, name, suite_idx, test_idx)) {
+        return (*test_idx != -1 && tr->suites[*suite_idx].tests[*test_idx].type == TEST_FUZZ);
+    }
+    if (strstr(name, "::")) return false;
+    for (int i = 0; i < tr->suites_count+1; i++) {
+        for (int j = 0; j < tr->suites[i].test_count; j++) {
+            const Test* t = &tr->suites[i].tests[j];
+            if (t->type == TEST_FUZZ && !strcmp(t->name, name)) {
+                *suite_idx = i;
+                *test_idx = j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+#endif // SPZ_NOPIPE
+
+/**
+ * Fuzzes a target registered with FUZZ, until an input fails or
+ *  TestRunOptions.fuzz_runs inputs were tried.
+ * Each input runs in a forked child, so that crashes, sanitizer reports and
+ *  timeouts are caught. When the program is built with
+ *  -fsanitize-coverage=trace-pc-guard (clang) or trace-pc (gcc), the
+ *  children report the edges they hit through a shared map, and inputs
+ *  reaching new ones join the corpus, which is saved in corpus_dir. Without
+ *  coverage, inputs are only mutated from the corpus it starts with.
+ * Mutations are drawn from TestRunOptions.seed.
+ * A failing input is saved as ./TARGET.crash-HASH, or ./TARGET.timeout-HASH,
+ *  and the output of the child is printed.
+ * @see FUZZ
+ * @see TestRunOptions
+ * @param tr The TestRegistry holding the target.
+ * @param name The name of the target, as SUITE::TEST or TEST.
+ * @param corpus_dir The corpus directory, ./TARGET followed by SPZ_FUZZ_SUFFIX when NULL.
+ * @return 0 when no input failed, 1 when one did, or -1 on errors.
+ */
+int fuzz_testregistry(const TestRegistry* tr, const char* name, const char* corpus_dir) {
 #ifndef SPZ_NOPIPE
-        if (piped > 0) {
-            TestResult res = run_test_piped(suite.tests[i]);
-            if (res.exit_code != 0) {
-                printf("\033[0;31mFAILED\033[0m\n");
-                exit_codes[failures] = res.exit_code;
-                error_streams[failures][0] = res.stdout_fp;
-                error_streams[failures][1] = res.stderr_fp;
-                failed[failures] = suite.tests[i].name;
-                failures++;
-            } else {
-                printf("\033[0;32mok\033[0m\n");
-                successes++;
-                if (record > 0) {
-                    char pathbuf[FILENAME_MAX] = {0};
-                    const char* stdout_pb_suffix = NULL;
-                    if (!stdout_record_suffix) {
-                        stdout_pb_suffix = ".stdout";
-                    } else {
-                        stdout_pb_suffix = stdout_record_suffix;
-                    }
-                    sprintf(pathbuf, ".%s%s%s", SPZ_PATH_SEPARATOR, suite.tests[i].name, stdout_pb_suffix);
-                    FILE* stdout_record_file = fopen(pathbuf, "w");
-                    int stdout_fd = fileno(res.stdout_fp);
-                    spz_print_stream_to_file(stdout_fd, stdout_record_file);
-                    fclose(stdout_record_file);
-
-                    const char* stderr_pb_suffix = NULL;
-                    if (!stderr_record_suffix) {
-                        stderr_pb_suffix = ".stderr";
-                    } else {
-                        stderr_pb_suffix = stderr_record_suffix;
-                    }
-                    sprintf(pathbuf, ".%s%s%s", SPZ_PATH_SEPARATOR, suite.tests[i].name, stderr_pb_suffix);
-                    FILE* stderr_record_file = fopen(pathbuf, "w");
-                    int stderr_fd = fileno(res.stderr_fp);
-                    spz_print_stream_to_file(stderr_fd, stderr_record_file);
-                    fclose(stderr_record_file);
+    int suite_idx = -1;
+    int test_idx = -1;
+    if (!spz_fuzz_lookup(tr, name, &suite_idx, &test_idx)) {
+        fprintf(stderr, "%s(): no fuzz target {%s}\n", __func__, name);
+        return -1;
+    }
+    const TestSuite* suite = &tr->suites[suite_idx];
+    const Test* target = &suite->tests[test_idx];
+    char dirbuf[FILENAME_MAX] = {0};
+    if (!corpus_dir) {
+        snprintf(dirbuf, sizeof(dirbuf), ".%s%s%s", SPZ_PATH_SEPARATOR, target->name, SPZ_FUZZ_SUFFIX);
+        corpus_dir = dirbuf;
+    }
+    if (mkdir(corpus_dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "%s(): failed creating corpus {%s}: %s\n", __func__, corpus_dir, strerror(errno));
+        return -1;
+    }
+    size_t max_len = (size_t) SPZ_RUN_OPTIONS__.fuzz_max_len;
+    unsigned char* buf = malloc(max_len);
+    unsigned char* seen = calloc(SPZ_FUZZ_MAP_SIZE, 1);
+    if (!buf || !seen) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t shared_size = SPZ_FUZZ_MAP_SIZE + SPZ_FUZZ_CMP_SLOTS * sizeof(SpzFuzzCmp);
+    SPZ_FUZZ_MAP__ = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (SPZ_FUZZ_MAP__ == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    SPZ_FUZZ_CMPS__ = (SpzFuzzCmp*) (SPZ_FUZZ_MAP__ + SPZ_FUZZ_MAP_SIZE);
+    SpzFuzzDict* dict = calloc(1, sizeof(SpzFuzzDict));
+    if (!dict) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    /* Start from the corpus, or from the empty input */
+    struct dirent** entries = NULL;
+    int entries_count = scandir(corpus_dir, &entries, &spz_corpus_entry, &alphasort);
+    int corpus_capacity = (entries_count > 0 ? entries_count : 0) + SPZ_INITIAL_CAPACITY;
+    SpzFuzzInput* corpus = malloc(corpus_capacity * sizeof(SpzFuzzInput));
+    if (!corpus) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    int corpus_count = 0;
+    for (int i = 0; i < entries_count; i++) {
+        char pathbuf[FILENAME_MAX] = {0};
+        SpzFuzzInput in = {0};
+        if (spz_corpus_path(pathbuf, sizeof(pathbuf), corpus_dir, entries[i]->d_name)) {
+            in.data = spz_read_file(pathbuf, &in.len);
+        }
+        if (in.data) {
+            corpus[corpus_count++] = in;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    int initial_count = corpus_count;
+    if (corpus_count == 0) {
+        corpus[corpus_count++] = (SpzFuzzInput) { .data = malloc(1), .len = 0, };
+        initial_count = 1;
+    }
+    uint64_t rng = SPZ_RUN_OPTIONS__.seed ^ spz_name_hash(suite->name, target->name);
+    int timeout_ms = spz_test_timeout(suite, target);
+    if (timeout_ms <= 0) {
+        timeout_ms = SPZ_FUZZ_TIMEOUT_MS;
+    }
+    Test child = {
+        .type = TEST_BOOL,
+        .func.bool_fn = &spz_fuzz_child,
+        .name = target->name,
+        .setup = target->setup,
+        .teardown = target->teardown,
+    };
+    SPZ_FUZZ_TARGET__ = target->func.fuzz_fn;
+    printf("Fuzzing %s::%s from {%s}, %d inputs, seed %llu\n", suite->name, target->name, corpus_dir, corpus_count, (unsigned long long) SPZ_RUN_OPTIONS__.seed);
+    int res = 0;
+    if (suite->setup && !suite->setup()) {
+        printf("    setup of suite {%s} failed\n", suite->name);
+        res = -1;
+    }
+    int edges = 0;
+    long long runs = 0;
+    long long mutated = 0;
+    long long start_ms = spz_now_ms();
+    long long next_pulse = 1;
+    while (res == 0) {
+        bool initial = (runs < initial_count);
+        if (!initial && SPZ_RUN_OPTIONS__.fuzz_runs > 0 && mutated >= SPZ_RUN_OPTIONS__.fuzz_runs) break;
+        if (initial) {
+            SPZ_FUZZ_INPUT__ = corpus[runs].data;
+            SPZ_FUZZ_INPUT_LEN__ = corpus[runs].len;
+        } else {
+            const SpzFuzzInput* base = &corpus[spz_fuzz_rand(&rng, (size_t) corpus_count)];
+            size_t len = (base->len < max_len ? base->len : max_len);
+            memcpy(buf, base->data, len);
+            SPZ_FUZZ_INPUT__ = buf;
+            SPZ_FUZZ_INPUT_LEN__ = spz_fuzz_mutate(&rng, buf, len, max_len, corpus, corpus_count, dict);
+            mutated++;
+        }
+        memset(SPZ_FUZZ_MAP__, 0, shared_size);
+        TestResult tres = spz_fuzz_exec(child, timeout_ms);
+        runs++;
+        if (tres.timed_out || tres.signum != -1 || tres.exit_code != 0) {
+            char pathbuf[FILENAME_MAX] = {0};
+            snprintf(pathbuf, sizeof(pathbuf), ".%s%s.%s-%016llx", SPZ_PATH_SEPARATOR, target->name, (tres.timed_out ? "timeout" : "crash"), (unsigned long long) spz_hash_bytes(SPZ_FNV_OFFSET, SPZ_FUZZ_INPUT__, SPZ_FUZZ_INPUT_LEN__));
+            bool saved = spz_write_file(pathbuf, SPZ_FUZZ_INPUT__, SPZ_FUZZ_INPUT_LEN__);
+            printf("\033[0;31m%s\033[0m on input #%lld of %zu bytes, %s {%s}\n", (tres.timed_out ? "TIMEOUT" : "FAILURE"), runs, SPZ_FUZZ_INPUT_LEN__, (saved ? "saved as" : "failed saving"), pathbuf);
+            printf("---- %s::%s stdout ----\n", suite->name, target->name);
+            spz_print_stream_to_file(fileno(tres.stdout_fp), stdout);
+            printf("---- %s::%s stderr ----\n", suite->name, target->name);
+            spz_print_stream_to_file(fileno(tres.stderr_fp), stdout);
+            testresult_close(&tres);
+            res = 1;
+            break;
+        }
+        testresult_close(&tres);
+        int fresh = spz_fuzz_merge(seen, &edges);
+        spz_fuzz_merge_cmps(dict);
+        if (runs == initial_count && edges == 0) {
+            printf("    no coverage, build with -fsanitize-coverage=trace-pc-guard (clang) or trace-pc (gcc) to guide mutations\n");
+        }
+        long long elapsed_ms = spz_now_ms() - start_ms;
+        long long execs = (elapsed_ms > 0 ? runs * 1000 / elapsed_ms : runs);
+        if (fresh && !initial) {
+            if (corpus_count == corpus_capacity) {
+                corpus_capacity *= 2;
+                SpzFuzzInput* grown = realloc(corpus, corpus_capacity * sizeof(SpzFuzzInput));
+                if (!grown) {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
                 }
-                fclose(res.stdout_fp);
-                fclose(res.stderr_fp);
+                corpus = grown;
             }
-        } else {
-            int res = run_test(suite.tests[i]);
-            if (res != 0) {
-                printf("\033[0;31mFAILED\033[0m, res: {%d}\n", res);
-                failures++;
-            } else {
-                printf("\033[0;32mok\033[0m\n");
-                successes++;
+            SpzFuzzInput in = { .data = malloc(SPZ_FUZZ_INPUT_LEN__ ? SPZ_FUZZ_INPUT_LEN__ : 1), .len = SPZ_FUZZ_INPUT_LEN__, };
+            if (!in.data) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
             }
+            memcpy(in.data, SPZ_FUZZ_INPUT__, in.len);
+            corpus[corpus_count++] = in;
+            char hashbuf[17] = {0};
+            snprintf(hashbuf, sizeof(hashbuf), "%016llx", (unsigned long long) spz_hash_bytes(SPZ_FNV_OFFSET, in.data, in.len));
+            char pathbuf[FILENAME_MAX] = {0};
+            if (!spz_corpus_path(pathbuf, sizeof(pathbuf), corpus_dir, hashbuf) || !spz_write_file(pathbuf, in.data, in.len)) {
+                fprintf(stderr, "%s(): failed writing {%s}\n", __func__, pathbuf);
+            }
+            printf("#%lld\tNEW\tedges: %d\tcorpus: %d\tlen: %zu\texec/s: %lld\n", runs, edges, corpus_count, in.len, execs);
+        } else if (runs == next_pulse) {
+            printf("#%lld\tpulse\tedges: %d\tcorpus: %d\texec/s: %lld\n", runs, edges, corpus_count, execs);
         }
-#else
-        int res = run_test(suite.tests[i]);
-        if (res != 0) {
-            printf("\033[0;31mFAILED\033[0m, res: {%d}\n", res);
-            failures++;
-        } else {
-            printf("\033[0;32mok\033[0m\n");
-            successes++;
+        if (runs == next_pulse) {
+            next_pulse *= 2;
         }
+    }
+    if (res >= 0) {
+        printf("Fuzzed %s::%s: %lld inputs in %.2fs, %d edges, %d inputs in corpus\n", suite->name, target->name, runs, (spz_now_ms() - start_ms) / 1000.0, edges, corpus_count);
+    }
+    if (suite->teardown) {
+        suite->teardown();
+    }
+    for (int i = 0; i < corpus_count; i++) {
+        free(corpus[i].data);
+    }
+    free(corpus);
+    free(seen);
+    free(buf);
+    free(dict);
+    munmap(SPZ_FUZZ_MAP__, shared_size);
+    SPZ_FUZZ_MAP__ = NULL;
+    SPZ_FUZZ_CMPS__ = NULL;
+    return res;
+#else
+    (void) tr;
+    (void) name;
+    (void) corpus_dir;
+    fprintf(stderr, "%s(): fuzzing needs to fork, build without SPZ_NOPIPE\n", __func__);
+    return -1;
 #endif // SPZ_NOPIPE
+}
+
+/**
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.jobs.
+ * A value of 0 selects the number of online cpus.
+ * @param arg The value to parse.
+ */
+static void spz_parse_jobs(const char* arg)
+{
+    char* end = NULL;
+    long jobs = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || jobs < 0) {
+        fprintf(stderr, "%s(): invalid jobs value {%s}\n", __func__, arg);
+        return;
+    }
+#ifndef SPZ_NOPIPE
+    if (jobs == 0) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
     }
+#endif // SPZ_NOPIPE
+    SPZ_RUN_OPTIONS__.jobs = (jobs > 0 ? (int) jobs : 1);
+}
 
-#ifndef SPZ_NOTIMER
-    double elapsed = dt_stop(&timer);
-#endif // SPZ_NOTIMER
+/**
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.capture.
+ * @param arg The value to parse, either "memfd" or "tmpfile".
+ */
+static void spz_parse_capture(const char* arg)
+{
+    if (!strcmp(arg, "memfd")) {
+        SPZ_RUN_OPTIONS__.capture = SPZ_CAPTURE_MEMFD;
+    } else if (!strcmp(arg, "tmpfile")) {
+        SPZ_RUN_OPTIONS__.capture = SPZ_CAPTURE_TMPFILE;
+    } else {
+        fprintf(stderr, "%s(): invalid capture value {%s}\n", __func__, arg);
+    }
+}
 
-    printf("[  Suite  ] {%s}: All tests completed. Failures: {%d}\n", suite.name, failures);
+/**
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.timeout_ms.
+ * A value of 0 turns off the default timeout.
+ * @param arg The value to parse, in milliseconds.
+ */
+static void spz_parse_timeout(const char* arg)
+{
+    char* end = NULL;
+    long timeout_ms = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || timeout_ms < 0 || timeout_ms > INT32_MAX) {
+        fprintf(stderr, "%s(): invalid timeout value {%s}\n", __func__, arg);
+        return;
+    }
+    SPZ_RUN_OPTIONS__.timeout_ms = (int) timeout_ms;
+}
 
+/**
+ * Internal helper used by spz_parse_args() to add a reporter.
+ * @param arg The value to parse, as FORMAT:PATH, where FORMAT is junit,
+ *  jsonl, tap or durations, and PATH is a file or "-" for stdout.
+ *  Only one report can go to stdout, and the rest of the output is moved
+ *  to stderr so that it is not mixed with the report.
+ */
+static void spz_parse_report(const char* arg)
+{
 #ifndef SPZ_NOPIPE
-    if (piped > 0) {
-        printf("\nfailures:\n\n");
-        for (int i=0; i < failures; i++) {
-            printf("---- %s::%s stdout ----\n", suite.name, failed[i]);
-            int stdout_fd = fileno(error_streams[i][0]);
-            spz_print_stream_to_file(stdout_fd, stdout);
-
-            printf("---- %s::%s stderr ----\n", suite.name, failed[i]);
-            int stderr_fd = fileno(error_streams[i][1]);
-            spz_print_stream_to_file(stderr_fd, stdout);
-
-            fclose(error_streams[i][0]);
-            fclose(error_streams[i][1]);
+    const char* sep = strchr(arg, ':');
+    size_t format_len = (sep ? (size_t) (sep - arg) : strlen(arg));
+    const char* path = (sep ? sep + 1 : "-");
+    TestReporter (*make)(FILE*) = NULL;
+    if (format_len == strlen("junit") && !strncmp(arg, "junit", format_len)) {
+        make = spz_junit_reporter;
+    } else if (format_len == strlen("jsonl") && !strncmp(arg, "jsonl", format_len)) {
+        make = spz_jsonl_reporter;
+    } else if (format_len == strlen("tap") && !strncmp(arg, "tap", format_len)) {
+        make = spz_tap_reporter;
+    } else if (format_len == strlen("durations") && !strncmp(arg, "durations", format_len)) {
+        make = spz_durations_reporter;
+    } else {
+        fprintf(stderr, "%s(): invalid report format {%.*s}\n", __func__, (int) format_len, arg);
+        return;
+    }
+    if (SPZ_REPORTERS_COUNT__ >= SPZ_MAX_REPORTERS) {
+        fprintf(stderr, "%s(): can't add more than {%i} reporters\n", __func__, SPZ_MAX_REPORTERS);
+        return;
+    }
+    FILE* out = NULL;
+    static bool on_stdout = false;
+    if (!strcmp(path, "-")) {
+        if (on_stdout) {
+            fprintf(stderr, "%s(): only one report can go to stdout, ignoring {%s}\n", __func__, arg);
+            return;
         }
-        printf("\nfailures:\n");
-        for (int i=0; i < failures; i++) {
-            printf("    %s::%s: exit code {%i}\n", suite.name, failed[i], exit_codes[i]);
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "%s(): failed moving output to stderr: %s\n", __func__, strerror(errno));
+            if (fd != -1) close(fd);
+            return;
         }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        out = fdopen(fd, "w");
+        on_stdout = true;
+    } else {
+        out = fopen(path, "w");
     }
-#endif // SPZ_NOPIPE
-#ifndef SPZ_NOTIMER
-    printf("\ntest result: %s. %i passed; %i failed; elapsed: %.2fs\n", (failures == 0 ? "\033[0;32PASSED\033[0m" : "\033[0;31mFAILED\033[0m"), successes, failures, elapsed);
+    if (!out) {
+        fprintf(stderr, "%s(): failed opening report {%s}: %s\n", __func__, path, strerror(errno));
+        return;
+    }
+    static bool at_exit = false;
+    if (!at_exit) {
+        atexit(spz_close_reporters);
+        at_exit = true;
+    }
+    add_test_reporter(make(out));
 #else
-    printf("\ntest result: %s. %i passed; %i failed;\n", (failures == 0 ? "\033[0;32PASSED\033[0m" : "\033[0;31mFAILED\033[0m"), successes, failures);
-#endif // SPZ_NOTIMER
-    return failures;
+    fprintf(stderr, "%s(): reports need piped tests, ignoring {%s}\n", __func__, arg);
+#endif // SPZ_NOPIPE
 }
 
 /**
- * Run all TestSuites in global TestRegistry. Wrapper of run_tests_record.
- * @see SPZ_TEST_REGISTRY__
- * @see run_tests_record
- * @param piped When >0, turns on stdout/stderr piping.
- * @return 0 for success or number of errors occurred.
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.shard_index
+ *  or SPZ_RUN_OPTIONS__.shard_count.
+ * @param arg The value to parse.
+ * @param dest The option to set.
  */
-int run_tests(int piped) {
-    return run_tests_record(piped, 0, NULL, NULL);
+static void spz_parse_shard(const char* arg, int* dest)
+{
+    char* end = NULL;
+    long value = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || value < 0 || value > INT32_MAX) {
+        fprintf(stderr, "%s(): invalid shard value {%s}\n", __func__, arg);
+        return;
+    }
+    *dest = (int) value;
 }
 
 /**
- * Run all TestSuites in global TestRegistry. Wrapper of run_testregistry_record.
- * @see SPZ_TEST_REGISTRY__
- * @see run_testregistry_record
- * @param piped When >0, turns on stdout/stderr piping.
- * @param record When >0, turns on stdout/stderr recording.
- * @param stdout_record_suffix Suffix used for stdout record.
- * @param stderr_record_suffix Suffix used for stderr record.
- * @return 0 for success or number of errors occurred.
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.seed.
+ * @param arg The value to parse, in decimal or 0x hex.
  */
-int run_tests_record(int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
-    return run_testregistry_record(SPZ_TEST_REGISTRY__, piped, record, stdout_record_suffix, stderr_record_suffix);
+static void spz_parse_seed(const char* arg)
+{
+    char* end = NULL;
+    unsigned long long seed = strtoull(arg, &end, 0);
+    if (end == arg || *end != '\0' || arg[0] == '-') {
+        fprintf(stderr, "%s(): invalid seed {%s}\n", __func__, arg);
+        return;
+    }
+    SPZ_RUN_OPTIONS__.seed = seed;
+    SPZ_RUN_OPTIONS__.seed_set = true;
 }
 
 /**
- * Run all TestSuites in passed TestRegistry. Wrapper of run_testregistry_record.
- * @see TestRegistry
- * @see run_testregistry_record
- * @param piped When >0, turns on stdout/stderr piping.
- * @return 0 for success or number of errors occurred.
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.prop_iters.
+ * @param arg The value to parse.
  */
-int run_testregistry(TestRegistry tr, int piped) {
-    return run_testregistry_record(tr, piped, 0, NULL, NULL);
+static void spz_parse_prop_iters(const char* arg)
+{
+    char* end = NULL;
+    long iters = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || iters <= 0 || iters > INT32_MAX) {
+        fprintf(stderr, "%s(): invalid property iterations {%s}\n", __func__, arg);
+        return;
+    }
+    SPZ_RUN_OPTIONS__.prop_iters = (int) iters;
 }
 
 /**
- * Run all TestSuites in a TestRegistry.
- * @see TestRegistry
- * @param piped When >0, turns on stdout/stderr piping.
- * @param record When >0, turns on stdout/stderr recording.
- * @param stdout_record_suffix Suffix used for stdout record.
- * @param stderr_record_suffix Suffix used for stderr record.
- * @return 0 for success or number of errors occurred.
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.fuzz_runs.
+ * A value of 0 fuzzes until an input fails.
+ * @param arg The value to parse.
  */
-int run_testregistry_record(TestRegistry tr, int piped, int record, const char* stdout_record_suffix, const char* stderr_record_suffix) {
-    int failures = 0;
-    printf("Running all test suites...\n");
-    for (int i = 0; i < tr.suites_count+1; i++) {
-        TestSuite suite = tr.suites[i];
-        printf("[  Suite  ] suite %s, %d tests\n", suite.name, suite.test_count);
-        int res = run_suite_record(suite, piped, record, stdout_record_suffix, stderr_record_suffix);
-        if (res > 0) {
-            printf("[ FAILED  ] Failures: {%d}\n", res);
+static void spz_parse_fuzz_runs(const char* arg)
+{
+    char* end = NULL;
+    long long runs = strtoll(arg, &end, 10);
+    if (end == arg || *end != '\0' || runs < 0) {
+        fprintf(stderr, "%s(): invalid fuzz runs {%s}\n", __func__, arg);
+        return;
+    }
+    SPZ_RUN_OPTIONS__.fuzz_runs = runs;
+}
+
+/**
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.fuzz_max_len.
+ * @param arg The value to parse.
+ */
+static void spz_parse_fuzz_max_len(const char* arg)
+{
+    char* end = NULL;
+    long len = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || len <= 0 || len > INT32_MAX) {
+        fprintf(stderr, "%s(): invalid fuzz max length {%s}\n", __func__, arg);
+        return;
+    }
+    SPZ_RUN_OPTIONS__.fuzz_max_len = (int) len;
+}
+
+/**
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.slowest.
+ * A value of 0 turns off the list.
+ * @param arg The value to parse.
+ */
+static void spz_parse_slowest(const char* arg)
+{
+    char* end = NULL;
+    long slowest = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || slowest < 0 || slowest > INT32_MAX) {
+        fprintf(stderr, "%s(): invalid slowest value {%s}\n", __func__, arg);
+        return;
+    }
+    SPZ_RUN_OPTIONS__.slowest = (int) slowest;
+}
+
+/**
+ * Internal helper used by spz_parse_args() to set SPZ_RUN_OPTIONS__.bench_threshold.
+ * @param arg The value to parse, in percent.
+ */
+static void spz_parse_bench_threshold(const char* arg)
+{
+    char* end = NULL;
+    double threshold = strtod(arg, &end);
+    if (end == arg || *end != '\0' || !(threshold >= 0)) {
+        fprintf(stderr, "%s(): invalid bench threshold value {%s}\n", __func__, arg);
+        return;
+    }
+    SPZ_RUN_OPTIONS__.bench_threshold = threshold;
+}
+
+/**
+ * Internal helper used by spz_parse_args() to match an option given either
+ *  as "NAME VALUE" or as "NAME=VALUE".
+ * @param argc The number of args.
+ * @param argv The args.
+ * @param i Index of the current arg, advanced past a separate value.
+ * @param name The option name to match.
+ * @param matched Set to true when the current arg is the option.
+ * @return The value of the option, or NULL.
+ */
+static const char* spz_option_value(int argc, char** argv, int* i, const char* name, bool* matched)
+{
+    const char* arg = argv[*i];
+    size_t len = strlen(name);
+    *matched = false;
+    if (strncmp(arg, name, len)) return NULL;
+    if (arg[len] == '=') {
+        *matched = true;
+        return arg + len + 1;
+    }
+    if (arg[len] != '\0') return NULL;
+    *matched = true;
+    if (*i+1 >= argc) {
+        fprintf(stderr, "%s(): missing value for {%s}\n", __func__, name);
+        return NULL;
+    }
+    (*i)++;
+    return argv[*i];
+}
+
+/**
+ * Parse runner options from the environment and argv into SPZ_RUN_OPTIONS__.
+ * Environment variables are read first, so that argv takes precedence.
+ * Recognized options are removed from argv, so that the remaining args can
+ *  be handled as subcommands or test names.
+ * @see SPZ_RUN_OPTIONS__
+ * @param argc The number of args.
+ * @param argv The args.
+ * @return The number of args left in argv.
+ */
+int spz_parse_args(int argc, char** argv) {
+    /* Each run checks new inputs, unless a seed is passed */
+    SPZ_RUN_OPTIONS__.seed = spz_rand_next(&(uint64_t) { (uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) &argc });
+    const char* env_seed = getenv("SPZ_SEED");
+    if (env_seed && *env_seed) {
+        spz_parse_seed(env_seed);
+    }
+    const char* env_prop_iters = getenv("SPZ_PROP_ITERS");
+    if (env_prop_iters && *env_prop_iters) {
+        spz_parse_prop_iters(env_prop_iters);
+    }
+    const char* env_changed = getenv("SPZ_CHANGED");
+    if (env_changed && *env_changed) {
+        SPZ_RUN_OPTIONS__.changed = strcmp(env_changed, "0") != 0;
+    }
+    const char* env_cache = getenv("SPZ_CACHE");
+    if (env_cache && *env_cache) {
+        SPZ_RUN_OPTIONS__.cache_path = env_cache;
+    }
+    const char* env_fuzz_runs = getenv("SPZ_FUZZ_RUNS");
+    if (env_fuzz_runs && *env_fuzz_runs) {
+        spz_parse_fuzz_runs(env_fuzz_runs);
+    }
+    const char* env_fuzz_max_len = getenv("SPZ_FUZZ_MAX_LEN");
+    if (env_fuzz_max_len && *env_fuzz_max_len) {
+        spz_parse_fuzz_max_len(env_fuzz_max_len);
+    }
+    const char* env_jobs = getenv("SPZ_JOBS");
+    if (env_jobs && *env_jobs) {
+        spz_parse_jobs(env_jobs);
+    }
+    const char* env_capture = getenv("SPZ_CAPTURE");
+    if (env_capture && *env_capture) {
+        spz_parse_capture(env_capture);
+    }
+    const char* env_fork_server = getenv("SPZ_FORK_SERVER");
+    if (env_fork_server && *env_fork_server) {
+        SPZ_RUN_OPTIONS__.fork_server = strcmp(env_fork_server, "0") != 0;
+    }
+    const char* env_in_process = getenv("SPZ_IN_PROCESS");
+    if (env_in_process && *env_in_process) {
+        SPZ_RUN_OPTIONS__.in_process = strcmp(env_in_process, "0") != 0;
+    }
+    const char* env_bench_threshold = getenv("SPZ_BENCH_THRESHOLD");
+    if (env_bench_threshold && *env_bench_threshold) {
+        spz_parse_bench_threshold(env_bench_threshold);
+    }
+    const char* env_shard_index = getenv("SPZ_SHARD_INDEX");
+    if (env_shard_index && *env_shard_index) {
+        spz_parse_shard(env_shard_index, &SPZ_RUN_OPTIONS__.shard_index);
+    }
+    const char* env_shard_count = getenv("SPZ_SHARD_COUNT");
+    if (env_shard_count && *env_shard_count) {
+        spz_parse_shard(env_shard_count, &SPZ_RUN_OPTIONS__.shard_count);
+    }
+    const char* env_shard_durations = getenv("SPZ_SHARD_DURATIONS");
+    if (env_shard_durations && *env_shard_durations) {
+        SPZ_RUN_OPTIONS__.shard_durations = env_shard_durations;
+    }
+    const char* env_report = getenv("SPZ_REPORT");
+    if (env_report && *env_report) {
+        spz_parse_report(env_report);
+    }
+    const char* env_perf = getenv("SPZ_PERF");
+    if (env_perf && *env_perf) {
+        SPZ_RUN_OPTIONS__.perf = strcmp(env_perf, "0") != 0;
+    }
+    const char* env_slowest = getenv("SPZ_SLOWEST");
+    if (env_slowest && *env_slowest) {
+        spz_parse_slowest(env_slowest);
+    }
+    const char* env_timeout = getenv("SPZ_TIMEOUT");
+    if (env_timeout && *env_timeout) {
+        spz_parse_timeout(env_timeout);
+    }
+    int left = 1;
+    for (int i = 1; i < argc; i++) {
+        bool matched = false;
+        const char* value = NULL;
+        if ((value = spz_option_value(argc, argv, &i, "--jobs", &matched)) || matched) {
+            if (value) spz_parse_jobs(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "-j", &matched)) || matched) {
+            if (value) spz_parse_jobs(value);
+        } else if (!strncmp(argv[i], "-j", strlen("-j")) && argv[i][strlen("-j")] >= '0' && argv[i][strlen("-j")] <= '9') {
+            spz_parse_jobs(argv[i] + strlen("-j"));
+        } else if ((value = spz_option_value(argc, argv, &i, "--capture", &matched)) || matched) {
+            if (value) spz_parse_capture(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--timeout", &matched)) || matched) {
+            if (value) spz_parse_timeout(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--shard-index", &matched)) || matched) {
+            if (value) spz_parse_shard(value, &SPZ_RUN_OPTIONS__.shard_index);
+        } else if ((value = spz_option_value(argc, argv, &i, "--shard-count", &matched)) || matched) {
+            if (value) spz_parse_shard(value, &SPZ_RUN_OPTIONS__.shard_count);
+        } else if ((value = spz_option_value(argc, argv, &i, "--shard-durations", &matched)) || matched) {
+            if (value) SPZ_RUN_OPTIONS__.shard_durations = value;
+        } else if ((value = spz_option_value(argc, argv, &i, "--report", &matched)) || matched) {
+            if (value) spz_parse_report(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--slowest", &matched)) || matched) {
+            if (value) spz_parse_slowest(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--bench-threshold", &matched)) || matched) {
+            if (value) spz_parse_bench_threshold(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--seed", &matched)) || matched) {
+            if (value) spz_parse_seed(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--prop-iters", &matched)) || matched) {
+            if (value) spz_parse_prop_iters(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--cache", &matched)) || matched) {
+            if (value) SPZ_RUN_OPTIONS__.cache_path = value;
+        } else if ((value = spz_option_value(argc, argv, &i, "--fuzz-runs", &matched)) || matched) {
+            if (value) spz_parse_fuzz_runs(value);
+        } else if ((value = spz_option_value(argc, argv, &i, "--fuzz-max-len", &matched)) || matched) {
+            if (value) spz_parse_fuzz_max_len(value);
+        } else if (!strcmp(argv[i], "--fork-server")) {
+            SPZ_RUN_OPTIONS__.fork_server = true;
+        } else if (!strcmp(argv[i], "--in-process")) {
+            SPZ_RUN_OPTIONS__.in_process = true;
+        } else if (!strcmp(argv[i], "--perf")) {
+            SPZ_RUN_OPTIONS__.perf = true;
+        } else if (!strcmp(argv[i], "--changed")) {
+            SPZ_RUN_OPTIONS__.changed = true;
         } else {
-            printf("[ SUCCESS ]\n");
+            argv[left++] = argv[i];
         }
-        failures += res;
-        printf("[ DONE    ]\n");
     }
-    printf("All tests completed. Failures: {%d}\n", failures);
-    return failures;
+    if (left < argc) argv[left] = NULL;
+#ifndef SPZ_NOPIPE
+    /* Keep the cache next to the binary, so that each one has its own */
+    static char cache_path[FILENAME_MAX];
+    if (!SPZ_RUN_OPTIONS__.cache_path && argc > 0) {
+        int len = snprintf(cache_path, sizeof(cache_path), "%s%s", argv[0], SPZ_CACHE_SUFFIX);
+        if (len >= 0 && (size_t) len < sizeof(cache_path)) {
+            SPZ_RUN_OPTIONS__.cache_path = cache_path;
+        }
+    }
+#endif // SPZ_NOPIPE
+    return left;
 }
 
 #ifndef SPZ_NOTIMER
@@ -1278,5 +8127,8 @@ double dt_stop(DumbTimer* dt)
 
 // Cleanup
 #undef register_test
+#undef spawn_piped__
 #undef run_piped__
+#undef SPZ_NO_COVERAGE
+#undef SPZ_FNV_OFFSET
 #endif // SPZ_IMPLEMENTATION